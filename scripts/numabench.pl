@@ -0,0 +1,140 @@
+#!/usr/bin/perl
+
+#
+# Compares the per-iteration time of nodepop with and without -numa
+# on a synthetic graph with planted overlapping communities.
+#
+#   numabench.pl -n 200000 -k 100 -nthreads 16 -secs 300
+#
+# The mean of the itertime.txt column (ms per iteration) is reported
+# for each run, skipping the first report interval. No numbers from a
+# multi-socket host have been recorded yet; until they are, -numa is
+# experimental.
+#
+
+use strict;
+use warnings;
+use Getopt::Long;
+
+my $nodepop = "../src/nodepop";
+my $n = 100000;
+my $k = 100;
+my $deg = 20;
+my $nthreads = 8;
+my $secs = 300;
+my $rfreq = 10;
+my $seed = 1;
+my $dir = "numabench";
+
+sub main() {
+    GetOptions ('bin=s' => \$nodepop,
+		'n=i' => \$n,
+		'k=i' => \$k,
+		'deg=i' => \$deg,
+		'nthreads=i' => \$nthreads,
+		'secs=i' => \$secs,
+		'rfreq=i' => \$rfreq,
+		'seed=i' => \$seed,
+		'dir=s' => \$dir);
+
+    gen_graph();
+    my $base = run("base", "");
+    my $numa = run("numa", "-numa");
+    printf "nodes=%d K=%d nthreads=%d\n", $n, $k, $nthreads;
+    printf "default: %.3f ms/iteration\n", $base;
+    printf "numa:    %.3f ms/iteration (%.1f%%)\n", $numa,
+	100 * ($numa - $base) / $base;
+}
+
+sub gen_graph() {
+    return if (-e "$dir/train.tsv");
+    mkdir $dir;
+    srand($seed);
+
+    my @comm;
+    my @memb;
+    for (my $i = 0; $i < $n; $i++) {
+	my $m = (rand() < 0.7) ? 1 : 2;
+	for (my $j = 0; $j < $m; $j++) {
+	    my $c = int(rand($k));
+	    push @{$memb[$i]}, $c;
+	    push @{$comm[$c]}, $i;
+	}
+    }
+
+    my %edges;
+    for (my $i = 0; $i < $n; $i++) {
+	for (my $j = 0; $j < $deg / 2; $j++) {
+	    my $c = $memb[$i][int(rand(scalar @{$memb[$i]}))];
+	    my $q = $comm[$c][int(rand(scalar @{$comm[$c]}))];
+	    $q = int(rand($n)) if (rand() < 0.1);
+	    next if ($q == $i);
+	    my ($a, $b) = ($i < $q) ? ($i, $q) : ($q, $i);
+	    $edges{"$a\t$b"} = 1;
+	}
+    }
+
+    my @e = keys %edges;
+    my $nt = int(scalar @e / 100);
+    open T, ">$dir/train.tsv";
+    open S, ">$dir/test.tsv";
+    open V, ">$dir/validation.tsv";
+    open U, ">$dir/test_users.tsv";
+    my %users;
+    for (my $i = 0; $i < scalar @e; $i++) {
+	my ($a, $b) = split /\t/, $e[$i];
+	if ($i < $nt) {
+	    printf S "%d\t%d\t1\n", $a + 1, $b + 1;
+	    $users{$a + 1} = 1 if (scalar keys %users < 1000);
+	} elsif ($i < 2 * $nt) {
+	    printf V "%d\t%d\t1\n", $a + 1, $b + 1;
+	} else {
+	    printf T "%d\t%d\n", $a + 1, $b + 1;
+	}
+    }
+    for (my $i = 0; $i < 2 * $nt; $i++) {
+	my $a = int(rand($n));
+	my $b = int(rand($n));
+	next if ($a == $b || exists $edges{($a < $b) ? "$a\t$b" : "$b\t$a"});
+	if ($i % 2) {
+	    printf S "%d\t%d\t0\n", $a + 1, $b + 1;
+	} else {
+	    printf V "%d\t%d\t0\n", $a + 1, $b + 1;
+	}
+    }
+    print U "$_\n" for (sort { $a <=> $b } keys %users);
+    close T;
+    close S;
+    close V;
+    close U;
+}
+
+sub run($$) {
+    my ($label, $opt) = @_;
+    my $cmd = sprintf("timeout %d %s -dir %s -n %d -k %d -glm -rnode ".
+		      "-seed %d -rfreq %d -nthreads %d -label %s %s > /dev/null",
+		      $secs, $nodepop, $dir, $n, $k, $seed, $rfreq,
+		      $nthreads, $label, $opt);
+    print "$cmd\n";
+    system($cmd);
+
+    my @d = glob("n$n-k$k-$label-*");
+    die "no output directory for $label\n" if (scalar @d == 0);
+    open F, "<$d[0]/itertime.txt" or die "no itertime.txt in $d[0]\n";
+    my ($s, $c) = (0, 0);
+    my $first = 1;
+    while (<F>) {
+	my @f = split;
+	if ($first) {
+	    $first = 0;
+	    next;
+	}
+	$s += $f[2];
+	$c++;
+    }
+    close F;
+    die "not enough iterations for $label\n" if ($c == 0);
+    return $s / $c;
+}
+
+main();
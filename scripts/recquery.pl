@@ -0,0 +1,97 @@
+#!/usr/bin/perl
+
+#
+# Client for nodepop -serve.
+#
+#   recquery.pl -s /tmp/rec.sock top <id> [N]
+#   recquery.pl -s /tmp/rec.sock score <id1> <id2>
+#   recquery.pl -s /tmp/rec.sock stats
+#   recquery.pl -s /tmp/rec.sock reload
+#   recquery.pl -s /tmp/rec.sock bench <ids file> [N]
+#
+# bench sends a top-N query for every id in the file and prints the
+# server's latency percentiles afterwards.
+#
+
+use strict;
+use warnings;
+use Getopt::Long;
+use Socket;
+
+my $sock = "/tmp/nodepop-rec.sock";
+my %ops = (top => 1, score => 2, stats => 3, reload => 4);
+my @status = ("ok", "unknown id", "bad request", "reload failed");
+
+sub request($$$$) {
+    my ($op, $tag, $a, $b) = @_;
+    print S pack("L4", $op, $tag, $a, $b);
+    my $h;
+    read(S, $h, 16) == 16 or die "server closed the connection\n";
+    my ($st, $rtag, $count, $gen) = unpack("L4", $h);
+    die "bad reply tag\n" if ($rtag != $tag);
+    my @items;
+    if ($op == $ops{stats}) {
+	my $d;
+	read(S, $d, 48) == 48 or die "short reply\n";
+	my ($lo, $hi, @p) = unpack("L2 d5", $d);
+	return ($st, $gen, [$lo + $hi * 4294967296, @p]);
+    }
+    for (my $i = 0; $i < $count; $i++) {
+	my $d;
+	read(S, $d, 16) == 16 or die "short reply\n";
+	my ($id, $pad, $score) = unpack("L2 d", $d);
+	push @items, [$id, $score];
+    }
+    return ($st, $gen, \@items);
+}
+
+sub print_stats($) {
+    my ($s) = @_;
+    printf "requests %d  latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+	@$s;
+}
+
+sub main() {
+    GetOptions('s=s' => \$sock);
+    my $cmd = shift @ARGV or die "usage: recquery.pl -s <socket> top|score|stats|reload|bench ...\n";
+
+    socket(S, PF_UNIX, SOCK_STREAM, 0) or die "socket: $!\n";
+    connect(S, sockaddr_un($sock)) or die "connect $sock: $!\n";
+    binmode(S);
+    select((select(S), $| = 1)[0]);
+
+    if ($cmd eq "top") {
+	my ($st, $gen, $items) = request($ops{top}, 1, $ARGV[0], $ARGV[1] || 10);
+	die "$status[$st]\n" if ($st);
+	printf "%d\t%.9f\n", @$_ for (@$items);
+    } elsif ($cmd eq "score") {
+	my ($st, $gen, $items) = request($ops{score}, 1, $ARGV[0], $ARGV[1]);
+	die "$status[$st]\n" if ($st);
+	printf "%d\t%d\t%.9f\n", $ARGV[0], $ARGV[1], $items->[0][1];
+    } elsif ($cmd eq "stats") {
+	my ($st, $gen, $s) = request($ops{stats}, 1, 0, 0);
+	print "model $gen\n";
+	print_stats($s);
+    } elsif ($cmd eq "reload") {
+	my ($st, $gen) = request($ops{reload}, 1, 0, 0);
+	die "$status[$st]\n" if ($st);
+	print "model $gen\n";
+    } elsif ($cmd eq "bench") {
+	open F, "<$ARGV[0]" or die "cannot open $ARGV[0]\n";
+	my $n = $ARGV[1] || 100;
+	my $tag = 1;
+	while (<F>) {
+	    my ($id) = split;
+	    next if (!defined $id);
+	    request($ops{top}, $tag++, $id, $n);
+	}
+	close F;
+	my ($st, $gen, $s) = request($ops{stats}, $tag, 0, 0);
+	print_stats($s);
+    } else {
+	die "unknown command $cmd\n";
+    }
+    close S;
+}
+
+main();
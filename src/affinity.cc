@@ -0,0 +1,112 @@
+#include "affinity.hh"
+#include "log.hh"
+
+#include <sched.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+#ifdef HAVE_LIBNUMA
+
+uint32_t
+NUMA::nnodes()
+{
+  if (numa_available() < 0)
+    return 1;
+  return numa_max_node() + 1;
+}
+
+int
+NUMA::run_on_node(uint32_t node)
+{
+  if (numa_available() < 0)
+    return -1;
+  return numa_run_on_node(node);
+}
+
+int
+NUMA::prefer_node(uint32_t node)
+{
+  if (numa_available() < 0)
+    return -1;
+  numa_set_preferred(node);
+  return 0;
+}
+
+#else
+
+#define MPOL_PREFERRED 1
+
+uint32_t
+NUMA::nnodes()
+{
+  static uint32_t n = 0;
+  if (n)
+    return n;
+  DIR *d = opendir("/sys/devices/system/node");
+  if (d) {
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+      uint32_t id;
+      if (sscanf(e->d_name, "node%u", &id) == 1 && id + 1 > n)
+	n = id + 1;
+    }
+    closedir(d);
+  }
+  if (!n)
+    n = 1;
+  return n;
+}
+
+int
+NUMA::run_on_node(uint32_t node)
+{
+  char fname[128];
+  sprintf(fname, "/sys/devices/system/node/node%d/cpulist", node);
+  FILE *f = fopen(fname, "r");
+  if (!f) {
+    lerr("cannot open %s:%s", fname, strerror(errno));
+    return -1;
+  }
+  char buf[4096];
+  if (!fgets(buf, sizeof(buf), f)) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  // cpulist is of the form "0-7,16-23"
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  char *p = buf;
+  while (*p && *p != '\n') {
+    char *q;
+    long a = strtol(p, &q, 10);
+    if (q == p)
+      break;
+    long b = a;
+    if (*q == '-')
+      b = strtol(q + 1, &q, 10);
+    for (long c = a; c <= b && c < CPU_SETSIZE; ++c)
+      CPU_SET(c, &set);
+    p = (*q == ',') ? q + 1 : q;
+  }
+  return sched_setaffinity(0, sizeof(set), &set);
+}
+
+int
+NUMA::prefer_node(uint32_t node)
+{
+  unsigned long mask = 1UL << node;
+  if (node >= sizeof(mask) * 8)
+    return -1;
+  return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, 
+		 sizeof(mask) * 8);
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef AFFINITY_HH
+#define AFFINITY_HH
+
+#include <stdint.h>
+
+//
+// NUMA placement helpers. Uses libnuma when configure finds it
+// (HAVE_LIBNUMA); otherwise reads the topology from sysfs and calls
+// sched_setaffinity(2) and set_mempolicy(2) directly.
+//
+class NUMA {
+public:
+  static uint32_t nnodes();
+
+  // restrict the calling thread to the CPUs of a node
+  static int run_on_node(uint32_t node);
+
+  // allocate the calling thread's new pages on a node
+  static int prefer_node(uint32_t node);
+
+  // contiguous share [begin, end) of n items owned by a node
+  static void node_range(uint32_t n, uint32_t node,
+			 uint32_t &begin, uint32_t &end);
+
+  // the node whose node_range() holds item i of n
+  static uint32_t node_of(uint32_t n, uint32_t i);
+};
+
+inline void
+NUMA::node_range(uint32_t n, uint32_t node, uint32_t &begin, uint32_t &end)
+{
+  uint32_t s = nnodes();
+  begin = (uint64_t)n * node / s;
+  end = (uint64_t)n * (node + 1) / s;
+}
+
+inline uint32_t
+NUMA::node_of(uint32_t n, uint32_t i)
+{
+  return ((uint64_t)(i + 1) * nnodes() - 1) / n;
+}
+
+#endif
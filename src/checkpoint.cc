@@ -0,0 +1,201 @@
+#include "checkpoint.hh"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char CHECKPOINT_MAGIC[8] = "NPCKPT";
+
+CheckpointHeader::CheckpointHeader()
+{
+  memset(this, 0, sizeof(*this));
+  memcpy(magic, CHECKPOINT_MAGIC, sizeof(magic));
+  version = VERSION;
+  bom = BOM;
+}
+
+bool
+CheckpointHeader::valid() const
+{
+  if (memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0)
+    return false;
+  if (bom != BOM || version != VERSION || size % 8)
+    return false;
+  for (uint32_t s = 0; s < NSECTIONS; ++s)
+    if (offset[s] % 8 || offset[s] < sizeof(*this) ||
+	offset[s] + bytes[s] > size)
+      return false;
+  return true;
+}
+
+// resizes section s to bytes and returns where to copy it
+void *
+CheckpointImage::section(CheckpointHeader::Section s, uint64_t bytes)
+{
+  _data[s].resize(bytes);
+  return bytes ? &_data[s][0] : NULL;
+}
+
+void
+CheckpointImage::release()
+{
+  for (uint32_t s = 0; s < CheckpointHeader::NSECTIONS; ++s)
+    vector<char>().swap(_data[s]);
+}
+
+// places the sections one after the other, 8-byte aligned
+void
+CheckpointImage::layout()
+{
+  uint64_t pos = sizeof(header);
+  for (uint32_t s = 0; s < CheckpointHeader::NSECTIONS; ++s) {
+    header.offset[s] = pos;
+    header.bytes[s] = _data[s].size();
+    pos += (_data[s].size() + 7) / 8 * 8;
+  }
+  header.size = pos;
+}
+
+int
+CheckpointImage::write_to(FILE *f) const
+{
+  static const char zeros[8] = { 0 };
+  if (fwrite(&header, sizeof(header), 1, f) != 1)
+    return -1;
+  for (uint32_t s = 0; s < CheckpointHeader::NSECTIONS; ++s) {
+    uint64_t b = _data[s].size();
+    uint32_t pad = (8 - b % 8) % 8;
+    if ((b && fwrite(&_data[s][0], 1, b, f) != b) ||
+	(pad && fwrite(zeros, 1, pad, f) != pad))
+      return -1;
+  }
+  if (fflush(f) != 0 || fsync(fileno(f)) < 0)
+    return -1;
+  return 0;
+}
+
+int
+CheckpointImage::write(string fname)
+{
+  layout();
+  string tmp = fname + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (!f) {
+    fprintf(stderr, "cannot open %s: %s\n", tmp.c_str(), strerror(errno));
+    return -1;
+  }
+  bool failed = write_to(f) < 0;
+  if (fclose(f) != 0)
+    failed = true;
+  if (failed || rename(tmp.c_str(), fname.c_str()) < 0) {
+    fprintf(stderr, "cannot write %s: %s\n", fname.c_str(), strerror(errno));
+    unlink(tmp.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+//
+// A record cut short by a crash is skipped by CheckpointFile, but
+// whatever is appended after it would be too; on a failed write the
+// log is cut back to where the record started.
+//
+int
+CheckpointImage::append(string fname)
+{
+  layout();
+  FILE *f = fopen(fname.c_str(), "a");
+  if (!f) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long start = ftell(f);
+  bool failed = start < 0 || write_to(f) < 0;
+  if (fclose(f) != 0)
+    failed = true;
+  if (failed) {
+    fprintf(stderr, "cannot append to %s: %s\n", fname.c_str(),
+	    strerror(errno));
+    if (start >= 0 && truncate(fname.c_str(), start) < 0)
+      fprintf(stderr, "cannot truncate %s: %s\n", fname.c_str(),
+	      strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+CheckpointFile::CheckpointFile()
+  : _base(NULL), _size(0)
+{
+}
+
+CheckpointFile::~CheckpointFile()
+{
+  if (_base)
+    munmap((void *)_base, _size);
+}
+
+// checkpoint.bin -> checkpoint.log
+string
+CheckpointFile::log_name(string fname)
+{
+  size_t n = fname.size();
+  if (n > 4 && fname.compare(n - 4, 4, ".bin") == 0)
+    return fname.substr(0, n - 4) + ".log";
+  return fname + ".log";
+}
+
+int
+CheckpointFile::open(string fname, bool log)
+{
+  int fd = ::open(fname.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "cannot stat %s: %s\n", fname.c_str(), strerror(errno));
+    close(fd);
+    return -1;
+  }
+  _size = st.st_size;
+  if (_size == 0) {
+    close(fd);
+    if (log)
+      return 0;
+    fprintf(stderr, "%s is empty\n", fname.c_str());
+    return -1;
+  }
+  void *p = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "cannot map %s: %s\n", fname.c_str(), strerror(errno));
+    _size = 0;
+    return -1;
+  }
+  _base = (const char *)p;
+
+  uint64_t pos = 0;
+  while (pos + sizeof(CheckpointHeader) <= _size) {
+    const CheckpointHeader *h = (const CheckpointHeader *)(_base + pos);
+    if (!h->valid() || pos + h->size > _size)
+      break;
+    _records.push_back(pos);
+    pos += h->size;
+    if (!log)
+      break;
+  }
+  if (!log && (_records.size() != 1 || pos != _size)) {
+    fprintf(stderr, "%s is not a version %d checkpoint or is truncated\n",
+	    fname.c_str(), CheckpointHeader::VERSION);
+    return -1;
+  }
+  if (log && pos != _size)
+    fprintf(stderr, "+ %s: ignoring %lu bytes after record %ld\n",
+	    fname.c_str(), (unsigned long)(_size - pos), _records.size());
+  return 0;
+}
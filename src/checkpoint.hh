@@ -0,0 +1,119 @@
+#ifndef CHECKPOINT_HH
+#define CHECKPOINT_HH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "env.hh"
+
+//
+// Binary training checkpoint (-checkpoint, -resume). A record is a
+// fixed header followed by sections at 8-byte aligned offsets, from
+// the start of the record, that the header lists; a mapped record's
+// arrays can be used in place. Values are in host byte order; a
+// record whose magic, version, byte order mark or size do not match
+// is rejected.
+//
+//   GAMMA              rows x K doubles, row by row
+//   LAMBDA             rows doubles
+//   MU, MUT_AG         K doubles
+//   SEQ2ID, SHUFFLED   n uint32_t
+//   RNG                the gsl_rng state
+//   ROWS               the node of each row (delta records only)
+//   GAMMAT_AG          K doubles for each node in AG_ROWS
+//   AG_ROWS            the rows' nodes that have -gamma-adagrad sums
+//
+// checkpoint.bin holds one full record, with all n rows.
+// checkpoint.log holds delta records (-checkpoint-delta); each has
+// only the rows changed since the record before it, and names in
+// base the iteration of the full record it extends.
+//
+class CheckpointHeader {
+public:
+  typedef enum { GAMMA = 0, GAMMAT_AG, LAMBDA, MU, MUT_AG,
+		 SEQ2ID, SHUFFLED, RNG, ROWS, AG_ROWS, NSECTIONS } Section;
+  typedef enum { DELTA = 1 } Flags;
+
+  static const uint32_t VERSION = 3;
+  static const uint32_t BOM = 0x01020304;
+
+  CheckpointHeader();
+  bool valid() const;
+  bool delta() const { return flags & DELTA; }
+
+  char magic[8];
+  uint32_t version;
+  uint32_t bom;
+  uint32_t n;
+  uint32_t k;
+  uint32_t iter;
+  uint32_t nh;          // stopping rule: reports without improvement
+  uint32_t flags;
+  uint32_t base;        // delta: iteration of the full record
+  double globalmu;
+  double prev_h;
+  double max_h;
+  uint64_t offset[NSECTIONS];
+  uint64_t bytes[NSECTIONS];
+  uint64_t size;        // of the whole record
+};
+
+//
+// A complete record held in memory, so that it can be filled quickly
+// on the training thread and written out from another one. write()
+// replaces a file with the record through <fname>.tmp and a rename,
+// so a crash leaves the previous file in place; append() adds it to
+// a log. Both return only once the data is synced. release() frees
+// the sections once they are no longer needed.
+//
+class CheckpointImage {
+public:
+  void *section(CheckpointHeader::Section s, uint64_t bytes);
+  void release();
+  const double *doubles(CheckpointHeader::Section s) const
+  { return _data[s].empty() ? NULL : (const double *)&_data[s][0]; }
+  int write(string fname);
+  int append(string fname);
+
+  CheckpointHeader header;
+
+private:
+  void layout();
+  int write_to(FILE *f) const;
+
+  vector<char> _data[CheckpointHeader::NSECTIONS];
+};
+
+//
+// A checkpoint file mapped read-only: a single full record, or the
+// records of a log up to the first incomplete one. Section pointers
+// stay valid until the object is destroyed.
+//
+class CheckpointFile {
+public:
+  CheckpointFile();
+  ~CheckpointFile();
+
+  int open(string fname, bool log = false);
+  uint32_t nrecords() const { return _records.size(); }
+  const CheckpointHeader &header(uint32_t r = 0) const
+  { return *(const CheckpointHeader *)(_base + _records[r]); }
+  uint64_t bytes(CheckpointHeader::Section s, uint32_t r = 0) const
+  { return header(r).bytes[s]; }
+  const void *section(CheckpointHeader::Section s, uint32_t r = 0) const
+  { return _base + _records[r] + header(r).offset[s]; }
+  const double *doubles(CheckpointHeader::Section s, uint32_t r = 0) const
+  { return (const double *)section(s, r); }
+  const uint32_t *uints(CheckpointHeader::Section s, uint32_t r = 0) const
+  { return (const uint32_t *)section(s, r); }
+
+  static string log_name(string fname);
+
+private:
+  const char *_base;
+  size_t _size;
+  vector<uint64_t> _records;
+};
+
+#endif
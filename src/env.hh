@@ -42,6 +42,7 @@ typedef std::map<uint32_t, vector<uint32_t> > MapVec;
 typedef std::map<uint32_t, vector<KV> > MapVecKV;
 typedef MapVec SparseMatrix2;
 typedef std::map<Edge, bool> SampleMap;
+typedef std::vector<std::pair<Edge, yval_t> > SampleList;
 typedef std::map<Edge, int> CountMap;
 typedef std::map<Edge, double> ValueMap;
 typedef std::map<uint32_t, string> StrMapInv;
@@ -69,7 +70,12 @@ public:
       bool init_comm, string init_comm_fname,
       bool node_scaling_on, bool lpmode,
       bool gtrim, bool fastinit, uint32_t max_iterations,
-      bool globalmu, bool adagrad, bool gamma_agrad);
+      bool globalmu, bool adagrad, bool gamma_agrad,
+      bool crng, bool numa, uint32_t shards, int32_t shard,
+      string ps_path, bool rank_scan, bool async_eval,
+      uint32_t heldout_sample, double heldout_tol, bool rank_gemm,
+      uint32_t checkpoint_freq, string resume, uint32_t checkpoint_delta,
+      string warm_start, bool npy, uint32_t lazy_pi);
   ~Env() { fclose(_plogf); }
 
   static string prefix;
@@ -195,6 +201,22 @@ public:
   bool globalmu;
   bool adagrad;
   bool gamma_adagrad;
+  bool crng;
+  bool numa;
+  uint32_t shards;
+  int32_t shard;
+  string ps_path;
+  bool rank_scan;
+  bool async_eval;
+  uint32_t heldout_sample;
+  double heldout_tol;
+  bool rank_gemm;
+  uint32_t checkpoint_freq;
+  string resume;
+  uint32_t checkpoint_delta;
+  string warm_start;
+  bool npy;
+  uint32_t lazy_pi;
 
   template<class T> static void plog(string s, const T &v);
   static string file_str(string fname);
@@ -281,7 +303,14 @@ Env::Env(uint32_t N, uint32_t K, bool massive,
 	 uint32_t nmem, bool ammopt, bool oo, bool init_comm,
 	 string init_comm_fname, bool nscaling, bool lpm,
 	 bool gtrim, bool fastinit, uint32_t max_itr,
-	 bool gmu, bool agrad, bool gamma_agrad)
+	 bool gmu, bool agrad, bool gamma_agrad,
+	 bool crng_opt, bool numa_opt, uint32_t shards_opt,
+	 int32_t shard_opt, string ps_path_opt, bool rank_scan_opt,
+	 bool async_eval_opt, uint32_t heldout_sample_opt,
+	 double heldout_tol_opt, bool rank_gemm_opt,
+	 uint32_t checkpoint_freq_opt, string resume_opt,
+	 uint32_t checkpoint_delta_opt, string warm_start_opt,
+	 bool npy_opt, uint32_t lazy_pi_opt)
   : n(N),
     k(K),
     t(2),
@@ -407,7 +436,23 @@ Env::Env(uint32_t N, uint32_t K, bool massive,
     max_iterations(max_itr),
     globalmu(gmu),
     adagrad(agrad),
-    gamma_adagrad(gamma_agrad)
+    gamma_adagrad(gamma_agrad),
+    crng(crng_opt),
+    numa(numa_opt),
+    shards(shards_opt),
+    shard(shard_opt),
+    ps_path(ps_path_opt),
+    rank_scan(rank_scan_opt),
+    async_eval(async_eval_opt),
+    heldout_sample(heldout_sample_opt),
+    heldout_tol(heldout_tol_opt),
+    rank_gemm(rank_gemm_opt),
+    checkpoint_freq(checkpoint_freq_opt),
+    resume(resume_opt),
+    checkpoint_delta(checkpoint_delta_opt),
+    warm_start(warm_start_opt),
+    npy(npy_opt),
+    lazy_pi(lazy_pi_opt)
 {
   assert (!(batch && (strat || rnode || rpair)));
 
@@ -490,6 +535,23 @@ Env::Env(uint32_t N, uint32_t K, bool massive,
     if (globalmu)
       sa << "-gmu";
 
+    if (crng)
+      sa << "-crng";
+
+    if (numa)
+      sa << "-numa";
+
+    if (shards > 0 && shard == (int32_t)shards)
+      sa << "-evalof" << shards;
+    else if (shards > 0)
+      sa << "-shard" << shard << "of" << shards;
+
+    if (heldout_sample > 0)
+      sa << "-hs" << heldout_sample;
+
+    if (heldout_tol >= 0)
+      sa << "-hi" << heldout_tol;
+
     if (pcp)
       sa << "pcp";
 
@@ -596,6 +658,19 @@ Env::Env(uint32_t N, uint32_t K, bool massive,
     plog("pcp", pcp);
     plog("postprocess", postprocess);
     plog("max_iterations", max_iterations);
+    plog("crng", crng);
+    plog("numa", numa);
+    plog("shards", shards);
+    plog("shard", shard);
+    plog("rank_scan", rank_scan);
+    plog("async_eval", async_eval);
+    plog("heldout_sample", heldout_sample);
+    plog("heldout_tol", heldout_tol);
+    plog("rank_gemm", rank_gemm);
+    plog("checkpoint_freq", checkpoint_freq);
+    plog("checkpoint_delta", checkpoint_delta);
+    plog("npy", npy);
+    plog("lazy_pi", lazy_pi);
     
     //plog("conv_nupdates", conv_nupdates);
     //plog("conv_thresh1", conv_thresh1);
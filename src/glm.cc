@@ -1,6 +1,7 @@
 #include "glm.hh"
 #include "log.hh"
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <math.h>
 
 GLMNetwork::GLMNetwork(Env &env, Network &network)
@@ -8,11 +9,13 @@ GLMNetwork::GLMNetwork(Env &env, Network &network)
     _n(env.n), _k(env.k),
     _t(env.t), _alpha(_k), _beta(_k), 
     _epsilon(0),
-    _pi(_n,_k), _theta(_n),
+    _pi(env.lazy_pi || partial_rows(env) ? 0 : _n, _k), _theta(_n),
     _mu0(0.0), _sigma0(1.0),
     _mu1(0.0), _sigma1(10.0),
-    _ones(0), _y(_n,_n),
-    _gamma(_n,_k), _gammat(_n,_k), _gammat_ag(_n,_k),
+    _ones(0), _y(env.gen ? _n : 0, env.gen ? _n : 0),
+    _gamma(_n, _k, true, !partial_rows(env)),
+    _gammat(_n,_k), _gammat_ag(_n,_k),
+    _sampled(_n), _touched(_n),
     _lambda(_n),
     _sigma_theta(0.1),
     _lambdat(_n), _sigma_thetat(.0),
@@ -20,7 +23,9 @@ GLMNetwork::GLMNetwork(Env &env, Network &network)
     _globalmu(.0), _globalmut(.0),
     _sigma_beta(0.5),
     _mut(_k), _mut_ag(_k), _sigma_betat(.0),
-    _Elogpi(_n,_k), 
+    _Elogpi(env.lazy_pi || ps_evaluator(env) ? 0 : _n, _k, true,
+	    !partial_rows(env)),
+    _epcache(NULL),
     _rho(.0), _tau0(65536), _kappa(0.5), 
     _murho(.0), _mutau0(65536*2), _mukappa(0.9),
     _noderhot(_n), _nodec(_n),
@@ -35,6 +40,17 @@ GLMNetwork::GLMNetwork(Env &env, Network &network)
     _shuffled_nodes(_n),
     _ignore_npairs(_n),
     _iter(0), 
+    _heldout_rng((uint64_t)env.seed, CRng::HELDOUT, 0, 0),
+    _ps(NULL),
+    _eval(NULL),
+    _hs(NULL),
+    _hc(NULL),
+    _nmi_counts(NULL),
+    _ckpt(NULL),
+    _ckpt_dirty(NULL),
+    _ckpt_based(false),
+    _ckpt_base(0),
+    _resumed(false),
     _save_ranking_file(false)
 {
   if (!_env.onesonly)
@@ -63,6 +79,19 @@ GLMNetwork::GLMNetwork(Env &env, Network &network)
 
   double p = n0 / (n0 + n1);
   Env::plog("inference n", _n);
+  if (_env.lazy_pi) {
+    _epcache = new RowCache(_n, _k, _env.lazy_pi);
+    Env::plog("E[log pi] cache rows", _epcache->rows());
+    Env::plog("E[log pi] cache MB", _epcache->bytes() / 1e6);
+    // the threshold index, -rank-gemm and -async-eval all work on a
+    // dense copy of pi; rank by scanning link_prob() instead
+    if (_env.async_eval || _env.rank_gemm || !_env.rank_scan)
+      lerr("-lazy-pi: ranking with -rank-scan; "
+	   "-async-eval and -rank-gemm ignored");
+    _env.async_eval = false;
+    _env.rank_gemm = false;
+    _env.rank_scan = true;
+  }
   Env::plog("inference links", n0);
   Env::plog("inference non-links", n1);
   Env::plog("expected prob of links within community", p);
@@ -113,43 +142,59 @@ GLMNetwork::GLMNetwork(Env &env, Network &network)
     exit(-1);
   }
 
+  // a resumed run carries on the per-report histories of the run
+  // that wrote the checkpoint
+  const char *hmode = _env.resume != "" && _env.shards == 0 ? "a" : "w";
+
   if (_env.log_training_likelihood) {
     _tef = fopen(Env::file_str("/training-pairs.txt").c_str(), "w");
     if (!_tef)  {
       lerr("cannot open training edges file:%s\n",  strerror(errno));
       exit(-1);
     }
-    _trf = fopen(Env::file_str("/training.txt").c_str(), "w");
+    _trf = fopen(Env::file_str("/training.txt").c_str(), hmode);
     if (!_trf)  {
       lerr("cannot open training file:%s\n",  strerror(errno));
       exit(-1);
     }
   }
 
-  _lf = fopen(Env::file_str("/logl.txt").c_str(), "w");
+  _lf = fopen(Env::file_str("/logl.txt").c_str(), hmode);
   if (!_lf)  {
     printf("cannot open logl file:%s\n",  strerror(errno));
     exit(-1);
   }
 
-  _hf = fopen(Env::file_str("/heldout.txt").c_str(), "w");
+  _hf = fopen(Env::file_str("/heldout.txt").c_str(), hmode);
   if (!_hf)  {
     lerr("cannot open heldout file:%s\n",  strerror(errno));
     exit(-1);
   }
 
-  _vf = fopen(Env::file_str("/validation.txt").c_str(), "w");
+  _vf = fopen(Env::file_str("/validation.txt").c_str(), hmode);
   if (!_vf)  {
     lerr("cannot open validation file:%s\n",  strerror(errno));
     exit(-1);
   }
 
-  _pf = fopen(Env::file_str("/precision.txt").c_str(), "w");
+  _pf = fopen(Env::file_str("/precision.txt").c_str(), hmode);
   if (!_pf)  {
     lerr("cannot open precision file:%s\n",  strerror(errno));
     exit(-1);
   }
 
+  _itf = fopen(Env::file_str("/itertime.txt").c_str(), hmode);
+  if (!_itf)  {
+    lerr("cannot open iteration time file:%s\n",  strerror(errno));
+    exit(-1);
+  }
+
+  _af = fopen(Env::file_str("/auc.txt").c_str(), hmode);
+  if (!_af)  {
+    lerr("cannot open auc file:%s\n",  strerror(errno));
+    exit(-1);
+  }
+
 
   if (_env.model_load)  {
     if (!_env.amm)
@@ -162,6 +207,12 @@ GLMNetwork::GLMNetwork(Env &env, Network &network)
       //compute_and_log_groups();
     }
   } else {
+    if (partial_rows(_env)) {
+      uint32_t begin, end;
+      ParamServer::shard_range(_n, _env.shards, _env.shard, begin, end);
+      for (uint32_t i = begin; i < end; ++i)
+	hold_row(i);
+    }
     init_gamma();
     load_heldout_sets();
     Env::plog("model load", false);
@@ -185,15 +236,68 @@ GLMNetwork::GLMNetwork(Env &env, Network &network)
     }
   }
   
+  if (_env.warm_start != "") {
+    if (_env.model_load)
+      lerr("-warm-start ignored with -load");
+    else if (warm_start(_env.warm_start) < 0)
+      exit(-1);
+  }
+
+  if (_env.numa)
+    numa_place();
+
   shuffle_nodes();
+  if (_env.resume != "") {
+    if (_env.shards > 0)
+      lerr("-resume ignored with -shards");
+    else if (load_checkpoint(_env.resume) < 0)
+      exit(-1);
+  }
   _start_time = time(0);
+  gettimeofday(&_report_tv, NULL);
   //approx_log_likelihood();
-  set_dir_exp(_gamma, _Elogpi);
+  if (_env.shards > 0)
+    ps_init();
+  if (!ps_evaluator(_env))
+    set_dir_exp(_gamma, _Elogpi);
+  init_rank_queries();
+
+  // the cache follows the training parameters, so it cannot serve
+  // snapshots or a changing sample
+  if (_env.heldout_tol >= 0 && (!_ps || ps_evaluator(_env))) {
+    if (_env.async_eval || _env.heldout_sample > 0)
+      lerr("-heldout-incr ignored with -async-eval or -heldout-sample");
+    else
+      _hc = new HeldoutCache(_heldout_list, _n, _k);
+  }
 
-  heldout_likelihood();
-  validation_likelihood();
-  if (_env.log_training_likelihood)
-    training_likelihood();
+  // with -shards only the evaluator sees the whole model; the run
+  // that wrote a checkpoint has already logged and judged every
+  // report up to it
+  if (_resumed)
+    log_resumed_heldout();
+  else if (!_ps || ps_evaluator(_env)) {
+    heldout_likelihood();
+    validation_likelihood();
+    if (_env.log_training_likelihood)
+      training_likelihood();
+  }
+}
+
+//
+// The heldout likelihood a resumed run starts from, for the log
+// only: heldout.txt, the stopping rule and the heldout sample are
+// left as the checkpoint had them.
+//
+void
+GLMNetwork::log_resumed_heldout()
+{
+  PairSums ps;
+  sample_likelihood(_heldout_list, ps, NULL);
+  double h = (_zeros_prob * (ps.szeros / ps.kzeros)) +
+    (_ones_prob * (ps.sones / ps.kones));
+  printf("+ resumed at iteration %d: heldout likelihood %.9f\n", _iter, h);
+  lerr("resumed at iteration %d: heldout likelihood %.9f", _iter, h);
 }
 
 int
@@ -282,12 +386,142 @@ GLMNetwork::load_gamma()
   Env::plog("model load", true);
 }
 
+//
+// Starts training from the model an earlier run saved in dir
+// (-warm-start), when the graph has since grown. gamma.txt and
+// deg.txt rows are matched to nodes by id rather than by position,
+// and mu carries over. A node the old model does not have gets the
+// mean gamma of its matched neighbors (or keeps its random gamma if
+// it has none), and its degree estimate of lambda shifted by the
+// mean amount training moved the matched nodes' lambda.
+//
+int
+GLMNetwork::warm_start(string dir)
+{
+  string fname = dir + "/gamma.txt";
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return -1;
+  }
+  const IDMap &id2seq = _network.id2seq();
+  double **gd = _gamma.data();
+  vector<bool> matched(_n, false);
+  uint32_t nmatched = 0, ndropped = 0;
+  char *line = NULL;
+  size_t sz = 0;
+  while (getline(&line, &sz, f) > 0) {
+    char *p = line, *q = NULL;
+    strtoul(p, &p, 10); // seq in the old graph
+    uint32_t id = strtoul(p, &p, 10);
+    IDMap::const_iterator itr = id2seq.find(id);
+    if (itr == id2seq.end()) {
+      ndropped++;
+      continue;
+    }
+    uint32_t n = itr->second;
+    uint32_t k = 0;
+    for (; k < _k; ++k) {
+      double v = strtod(p, &q);
+      if (q == p)
+	break;
+      gd[n][k] = v;
+      p = q;
+    }
+    strtod(p, &q);
+    if (k < _k || q != p) {
+      fprintf(stderr, "%s does not hold K = %d communities\n",
+	      fname.c_str(), _k);
+      free(line);
+      fclose(f);
+      return -1;
+    }
+    if (!matched[n])
+      nmatched++;
+    matched[n] = true;
+  }
+  free(line);
+  fclose(f);
+
+  fname = dir + "/deg.txt";
+  f = fopen(fname.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return -1;
+  }
+  uint32_t seq, id, deg;
+  double lambda, shift = .0;
+  uint32_t nshift = 0;
+  while (fscanf(f, "%u\t%u\t%u\t%lf\n", &seq, &id, &deg, &lambda) == 4) {
+    IDMap::const_iterator itr = id2seq.find(id);
+    if (itr == id2seq.end() || !matched[itr->second] || _env.nolambda)
+      continue;
+    shift += lambda - _lambda[itr->second];
+    nshift++;
+    _lambda[itr->second] = lambda;
+  }
+  fclose(f);
+
+  fname = dir + "/mu.txt";
+  f = fopen(fname.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return -1;
+  }
+  uint32_t k;
+  double v;
+  while (fscanf(f, "%u\t%lf\n", &k, &v) == 2) {
+    if (k == 65536)
+      _globalmu = v;
+    else if (k < _k)
+      _mu[k] = v;
+  }
+  fclose(f);
+
+  if (nshift > 0)
+    shift /= nshift;
+  uint32_t nnew = 0, nfromnbrs = 0;
+  for (uint32_t n = 0; n < _n; ++n) {
+    if (matched[n])
+      continue;
+    nnew++;
+    if (nshift > 0)
+      _lambda[n] += shift;
+    const vector<uint32_t> *edges = _network.get_edges(n);
+    if (!edges)
+      continue;
+    uint32_t c = 0;
+    for (uint32_t j = 0; j < edges->size(); ++j)
+      if (matched[(*edges)[j]])
+	c++;
+    if (c == 0)
+      continue;
+    for (uint32_t k = 0; k < _k; ++k) {
+      double s = .0;
+      for (uint32_t j = 0; j < edges->size(); ++j)
+	if (matched[(*edges)[j]])
+	  s += gd[(*edges)[j]][k];
+      gd[n][k] = s / c;
+    }
+    nfromnbrs++;
+  }
+  fprintf(stdout, "+ warm start from %s: %d nodes matched, %d new "
+	  "(%d from neighbors), %d no longer in the graph\n",
+	  dir.c_str(), nmatched, nnew, nfromnbrs, ndropped);
+  fflush(stdout);
+  Env::plog("warm start matched", nmatched);
+  Env::plog("warm start new", nnew);
+  return 0;
+}
+
 void
 GLMNetwork::load_heldout_sets()
 {
   _network.load_heldout_sets(_env.datdir + "/test.tsv", _precision_map, _ignore_npairs);
   _network.load_heldout_sets(_env.datdir + "/validation.tsv", _heldout_map, _ignore_npairs);
   load_nodes_for_precision();
+  set_sample_list(_precision_map, _precision_list);
+  set_sample_list(_heldout_map, _heldout_list);
   Env::plog("curr_seq after all files loaded:", _network.curr_seq());
   FILE *g = fopen(Env::file_str("/precision-pairs.txt").c_str(), "w");
   write_sample(g, _precision_map);
@@ -297,6 +531,15 @@ GLMNetwork::load_heldout_sets()
   fclose(g);
 }
 
+void
+GLMNetwork::set_sample_list(const SampleMap &mp, SampleList &l)
+{
+  l.clear();
+  l.reserve(mp.size());
+  for (SampleMap::const_iterator i = mp.begin(); i != mp.end(); ++i)
+    l.push_back(std::pair<Edge, yval_t>(i->first, i->second));
+}
+
 void
 GLMNetwork::write_sample(FILE *f, SampleMap &mp)
 {
@@ -367,17 +610,73 @@ GLMNetwork::shuffle_nodes()
 {
   for (uint32_t i = 0; i < _n; ++i)
     _shuffled_nodes[i] = i;
-  gsl_ran_shuffle(_r, (void *)_shuffled_nodes.data(), _n, sizeof(uint32_t));
+  if (_env.crng) {
+    CRng rng(seed(), CRng::SHUFFLE, 0, 0);
+    rng.shuffle(_shuffled_nodes.data(), _n);
+  } else
+    gsl_ran_shuffle(_r, (void *)_shuffled_nodes.data(), _n, sizeof(uint32_t));
 }
 
 GLMNetwork::~GLMNetwork()
 {
+  if (_eval) {
+    _eval->finish();
+    delete _eval;
+  }
+  if (_ckpt) {
+    _ckpt->finish();
+    delete _ckpt;
+  }
+  delete _ckpt_dirty;
   fclose(_lf);
   fclose(_hf);
   fclose(_vf);
   if (_env.log_training_likelihood)
     fclose(_trf);
   fclose(_pf);
+  fclose(_itf);
+  fclose(_af);
+  delete _hs;
+  delete _hc;
+  delete _nmi_counts;
+  delete _ps;
+  delete _epcache;
+}
+
+void
+GLMNetwork::numa_place()
+{
+  uint32_t nnodes = NUMA::nnodes();
+  Env::plog("numa nodes", nnodes);
+  vector<PlacementThread *> threads(nnodes);
+  for (uint32_t i = 0; i < nnodes; ++i) {
+    threads[i] = new PlacementThread(*this, i);
+    threads[i]->create();
+  }
+  for (uint32_t i = 0; i < nnodes; ++i) {
+    threads[i]->join();
+    delete threads[i];
+  }
+}
+
+void
+GLMNetwork::place_rows(uint32_t begin, uint32_t end)
+{
+  _gamma.move_rows(begin, end);
+  _Elogpi.move_rows(begin, end);    // no rows with -lazy-pi
+  _pi.move_rows(begin, end);
+  _network.move_edges(begin, end);
+}
+
+int
+PlacementThread::do_work()
+{
+  uint32_t begin, end;
+  NUMA::node_range(_glm._n, _numa_node, begin, end);
+  if (NUMA::prefer_node(_numa_node) < 0)
+    lerr("cannot set memory policy for numa node %d", _numa_node);
+  _glm.place_rows(begin, end);
+  return 0;
 }
 
 string
@@ -549,12 +848,54 @@ GLMNetwork::set_training_sample(int s)
 void
 GLMNetwork::init_gamma()
 {
+  if (_env.crng) {
+    uint32_t nt = nthreads();
+    vector<InitGammaThread *> threads(nt);
+    for (uint32_t i = 0; i < nt; ++i) {
+      uint64_t begin = (uint64_t)_n * i / nt;
+      uint64_t end = (uint64_t)_n * (i + 1) / nt;
+      threads[i] = new InitGammaThread(*this, begin, end);
+      start_worker(threads[i], i, nt);
+    }
+    for (uint32_t i = 0; i < nt; ++i) {
+      threads[i]->join();
+      delete threads[i];
+    }
+    return;
+  }
+
+  // rows a -shards worker does not hold are drawn all the same, so
+  // that the rng is where it would be with every row
   double **d = _gamma.data();
-  for (uint32_t i = 0; i < _n; ++i)
+  Array skip(_k);
+  for (uint32_t i = 0; i < _n; ++i) {
+    double *r = d[i] ? d[i] : skip.data();
     for (uint32_t j = 0; j < _k; ++j)  {
       double v = (_k < 100) ? 1.0 : (double)100.0 / _k;
-      d[i][j] = gsl_ran_gamma(_r, 100 * v, 0.01);
+      r[j] = gsl_ran_gamma(_r, 100 * v, 0.01);
     }
+  }
+}
+
+void
+GLMNetwork::init_gamma(uint32_t begin, uint32_t end)
+{
+  double **d = _gamma.data();
+  double v = (_k < 100) ? 1.0 : (double)100.0 / _k;
+  for (uint32_t i = begin; i < end; ++i) {
+    if (!d[i])
+      continue;
+    CRng rng(seed(), CRng::INIT, 0, i);
+    for (uint32_t j = 0; j < _k; ++j)
+      d[i][j] = rng.gamma(100 * v, 0.01);
+  }
+}
+
+int
+InitGammaThread::do_work()
+{
+  _glm.init_gamma(_begin, _end);
+  return 0;
 }
 
 void
@@ -621,11 +962,11 @@ LocalCompute::update_phi()
 {
   const Array &mu = _glm._mu;
   double globalmu = _glm._globalmu;
-  const Matrix &Elogpi = _glm._Elogpi;
   const double &sigma_beta = _glm._sigma_beta;
   const double &epsilon = _glm._epsilon;
   double **phid = _phi.data();
-  const double ** const elogpid = _glm._Elogpi.const_data();
+  const double * const elogpip = _glm.elogpi(_p);
+  const double * const elogpiq = _glm.elogpi(_q);
 
   compute_X_and_XS(_p,_q);
   for (uint32_t k = 0; k < _k; ++k) { 
@@ -638,18 +979,18 @@ LocalCompute::update_phi()
     double u2 = _log_X + epsilon;
     double u = exp(u1) - exp(u2);
     
-    phid[k][k] = Elogpi.at(_p,k) + Elogpi.at(_q,k);
+    phid[k][k] = elogpip[k] + elogpiq[k];
 
     if (_env.globalmu)
       phid[k][k] += (_y * (globalmu - epsilon) - u);
     else
       phid[k][k] += (_y * (mu[k] - epsilon) - u);
-    debug("Elogpi(%d,%d) = %f\n", _p, k, Elogpi.at(_p,k));
+    debug("Elogpi(%d,%d) = %f\n", _p, k, elogpip[k]);
   }
   for (uint32_t k1 = 0; k1 < _k ; ++k1)
     for (uint32_t k2 = 0; k2 < _k ; ++k2) 
       if (k1 != k2)  
-	phid[k1][k2] = elogpid[_p][k1] + elogpid[_q][k2];
+	phid[k1][k2] = elogpip[k1] + elogpiq[k2];
   _phi.lognormalize();
   compute_X_and_XS(_p,_q);
   _valid = true;
@@ -661,6 +1002,7 @@ GLMNetwork::init_heldout()
   int s = _env.heldout_ratio * _network.ones();
   set_heldout_sample(s);
   set_heldout_degrees();
+  set_sample_list(_heldout_map, _heldout_list);
   //set_validation_sample(s);
 
 #ifdef TRAINING_SAMPLE
@@ -684,28 +1026,45 @@ GLMNetwork::init_heldout()
 void
 GLMNetwork::randomnode_infer()
 {
-  _mut_ag.zero();
-  _gammat_ag.zero();
+  if (!_resumed) {
+    _mut_ag.zero();
+    _gammat_ag.clear();
+  }
   Env::plog("random node infer", true);
   set_dir_exp(_gamma, _Elogpi);
+  if (_env.async_eval) {
+    _eval = new EvalThread(*this);
+    _eval->create();
+  }
+  if (_env.checkpoint_freq > 0 || _env.checkpoint_delta > 0) {
+    _ckpt = new CheckpointThread(*this);
+    _ckpt->create();
+  }
+  if (_env.checkpoint_delta > 0)
+    _ckpt_dirty = new NodeSet(_n);
   while (1) {
     //
     // L step
     //
-    NodeMap sampled_nodes;
-    vector<uint32_t> nodes;
+    CRng mbrng(seed(), CRng::MINIBATCH, _iter, 0);
+    _gammat.clear();
+    _sampled.clear();
+    _touched.clear();
     do {
-      uint32_t start_node = gsl_rng_uniform_int(_r, _n);
-      NodeMap::const_iterator itr = sampled_nodes.find(start_node);
-      if (itr == sampled_nodes.end()) {
+      uint32_t start_node;
+      if (_env.crng)
+	start_node = mbrng.uniform_int(_n);
+      else
+	start_node = gsl_rng_uniform_int(_r, _n);
+      if (_sampled.insert(start_node)) {
+	_touched.insert(start_node);
 	set_dir_exp(start_node, _gamma, _Elogpi);
 	_gammat.zero(start_node);
-	nodes.push_back(start_node);
-	sampled_nodes[start_node] = true;
       }
-    } while (sampled_nodes.size() < _env.sets_mini_batch);
-    
-    map<uint32_t, bool> neighbor_nodes;
+    } while (_sampled.size() < _env.sets_mini_batch);
+    // start nodes are visited in increasing order
+    _sampled.sort();
+    const vector<uint32_t> &snodes = _sampled.nodes();
     
     _mut.zero();
     _globalmut = .0;
@@ -714,9 +1073,8 @@ GLMNetwork::randomnode_infer()
     _lambdat.zero();
 
     uint32_t c = 0;
-    for (NodeMap::const_iterator itr = sampled_nodes.begin(); 
-	 itr != sampled_nodes.end(); ++itr) {
-      uint32_t start_node = itr->first;
+    for (uint32_t s = 0; s < snodes.size(); ++s) {
+      uint32_t start_node = snodes[s];
 
       const vector<uint32_t> *edges = _network.get_edges(start_node);
       if (!edges)
@@ -733,13 +1091,9 @@ GLMNetwork::randomnode_infer()
 	if (!edge_ok(e))
 	  continue;
 	
-	NodeMap::const_iterator nt = neighbor_nodes.find(a);
-	NodeMap::const_iterator st = sampled_nodes.find(a);
-	if (nt == neighbor_nodes.end() && st == sampled_nodes.end()) {
-	  neighbor_nodes[a] = true;
+	if (_touched.insert(a)) {
 	  set_dir_exp(a, _gamma, _Elogpi);
 	  _gammat.zero(a);
-	  nodes.push_back(a);
 	}
 	uint32_t p = e.first;
 	uint32_t q = e.second;
@@ -747,24 +1101,7 @@ GLMNetwork::randomnode_infer()
       }
       
       vector<Edge> sample;
-      double v = (double)(gsl_rng_uniform_int(_r, _n)) / _noninf_setsize;
-      uint32_t q = ((int)v) * _noninf_setsize;
-      tst("\nq = %d, set size = %d\n", q, _noninf_setsize);
-      
-      while (sample.size() < _noninf_setsize) {
-	uint32_t node = _shuffled_nodes[q];
-	if (node == start_node) {
-	  q = (q + 1) % _n;
-	  continue;
-	}
-	
-	yval_t y = get_y(start_node, node);
-	Edge e(start_node, node);
-	Network::order_edge(_env, e);
-	if (y == 0 && edge_ok(e))
-	  sample.push_back(e);
-	q = (q + 1) % _n;
-      }
+      sample_nonlinks(start_node, sample);
       
       double scale = (_n - _network.deg(start_node)) / sample.size();
       //printf("start node = %d, scale = %f, sample size = %ld\n", 
@@ -782,9 +1119,10 @@ GLMNetwork::randomnode_infer()
 	else
 	  a = q;
 
-	nodes.push_back(a);
-	set_dir_exp(a, _gamma, _Elogpi);
-	_gammat.zero(a);
+	if (_touched.insert(a)) {
+	  set_dir_exp(a, _gamma, _Elogpi);
+	  _gammat.zero(a);
+	}
 	process(p,q,scale);
       }
     }
@@ -794,7 +1132,7 @@ GLMNetwork::randomnode_infer()
     debug("* sigma_thetat=%.5f\n", _sigma_thetat);
     debug("* sigma_betat=%.5f\n", _sigma_betat);    
 
-    double scale = _n / (2 * sampled_nodes.size());
+    double scale = _n / (2 * _sampled.size());
     // mut
     for (uint32_t k = 0; k < _k; ++k) {
       _globalmut += _mut[k];
@@ -803,30 +1141,11 @@ GLMNetwork::randomnode_infer()
     }
     _globalmut += (_mu0 - _globalmu) / SQ(_sigma0);
 
-    for (NodeMap::const_iterator itr = sampled_nodes.begin(); 
-	 itr != sampled_nodes.end(); ++itr) {
-      uint32_t n = itr->first;
-      _lambdat[n] += (_mu1 -_lambda[n]) / SQ(_sigma1);
-      for (uint32_t k = 0; k < _k; ++k) {
-	_gammat.add(n, k, _alpha[k] - _gamma.at(n,k));
-	if (_env.gamma_adagrad)
-	  _gammat_ag.add(n,k, _gammat.at(n,k) * _gammat.at(n,k));
-      }
-
-      _rho = pow(_tau0 + _iter, -1 * _kappa);
+    for (uint32_t s = 0; s < snodes.size(); ++s) {
+      uint32_t n = snodes[s];
+      update_node(n);
       _murho = pow(_mutau0 + _iter, -1 * _mukappa);
 
-      for (uint32_t k = 0; k < _k; ++k) {
-	if (_env.gamma_adagrad)
-	  _gamma.add(n, k, _gammat.at(n,k) / _gammat_ag.at(n,k));
-	else
-	  _gamma.add(n, k, _rho * _gammat.at(n,k));
-      }
-
-      if (!_env.nolambda)
-	_lambda[n] += _rho * _lambdat[n];
-      set_dir_exp(n, _gamma, _Elogpi);
-      
       for (uint32_t k = 0; k < _k; ++k) {
 	if (_env.adagrad || _env.gamma_adagrad)
 	  _mu[k] += _mut[k] / sqrt(_mut_ag[k]);
@@ -852,22 +1171,30 @@ GLMNetwork::randomnode_infer()
     fflush(stdout);
     if (_iter % _env.reportfreq == 0) {
       printf("\niteration %d (skipped heldout %d)\n", _iter, c);
-      estimate_pi();
-      heldout_likelihood();
-
-      if (_iter % 100 == 0) {
-	lerr("iteration:%d, save precision", _iter);
-	precision_likelihood();
-	write_ranking_file();
-	lerr("done");
+      log_iteration_time();
+      if (_eval)
+	post_evaluation();
+      else {
+	estimate_pi();
+	heldout_likelihood();
+
+	if (_iter % 100 == 0) {
+	  lerr("iteration:%d, save precision", _iter);
+	  precision_likelihood();
+	  write_ranking_file();
+	  lerr("done");
+	}
       }
 
       if (_env.terminate) {
-	compute_and_log_groups();
-	do_on_stop();
+	if (_eval) {
+	  _eval->drain();
+	  estimate_pi();
+	}
+	do_on_stop(false);
 	_env.terminate = false;
       }
-      if (_iter % 1000 == 0) {
+      if (!_eval && _iter % 1000 == 0) {
 	lerr("iteration:%d, save ranking file", _iter);
 	_save_ranking_file = true;
 	write_ranking_file();
@@ -875,117 +1202,624 @@ GLMNetwork::randomnode_infer()
 	lerr("done");
       }
     }
+    if (_env.checkpoint_freq > 0 && _iter % _env.checkpoint_freq == 0)
+      save_checkpoint();
+    else if (_env.checkpoint_delta > 0 && _iter % _env.checkpoint_delta == 0)
+      save_checkpoint(true);
   }
 }
 
+//
+// Worker side of -shards: start nodes are drawn from this shard's
+// node range only, so the gamma and lambda rows it updates are its
+// own. Rows of the other endpoints are fetched from the parameter
+// server before the minibatch is processed, and the updated rows and
+// the mu gradient are pushed back at the end of each iteration.
+//
 void
-GLMNetwork::do_on_stop()
+GLMNetwork::sharded_infer()
 {
-  save_model();
-  precision_likelihood();
-  _save_ranking_file = true;
-  write_ranking_file();
-  _save_ranking_file = false;
-  save_groups();
-  compute_and_log_groups();
+  uint32_t begin, end;
+  ParamServer::shard_range(_n, _env.shards, _env.shard, begin, end);
+  uint32_t mbsize = _env.sets_mini_batch / _env.shards;
+  if (mbsize == 0)
+    mbsize = 1;
+  if (mbsize > end - begin)
+    mbsize = end - begin;
+
+  _mut_ag.zero();
+  _gammat_ag.clear();
+  Env::plog("sharded infer", true);
+  Env::plog("shard minibatch", mbsize);
+  while (1) {
+    CRng mbrng(seed(), CRng::MINIBATCH, _iter, _env.shard);
+    _gammat.clear();
+    _sampled.clear();
+    _touched.clear();
+    do {
+      uint32_t start_node;
+      if (_env.crng)
+	start_node = begin + mbrng.uniform_int(end - begin);
+      else
+	start_node = begin + gsl_rng_uniform_int(_r, end - begin);
+      _sampled.insert(start_node);
+    } while (_sampled.size() < mbsize);
+    // start nodes are updated in the order they were drawn, and their
+    // pairs collected in increasing order
+    const vector<uint32_t> &snodes = _sampled.nodes();
+    vector<uint32_t> sorted(snodes);
+    std::sort(sorted.begin(), sorted.end());
+
+    // collect the pairs first so that remote rows are fetched in
+    // a single round trip
+    vector<Edge> pairs;
+    vector<double> scales;
+    for (uint32_t s = 0; s < sorted.size(); ++s) {
+      uint32_t start_node = sorted[s];
+      const vector<uint32_t> *edges = _network.get_edges(start_node);
+      if (!edges)
+	continue;
+      for (uint32_t i = 0; i < edges->size(); ++i) {
+	Edge e(start_node, (*edges)[i]);
+	Network::order_edge(_env, e);
+	if (!edge_ok(e))
+	  continue;
+	pairs.push_back(e);
+	scales.push_back(1.0);
+      }
+      vector<Edge> sample;
+      sample_nonlinks(start_node, sample);
+      double scale = (_n - _network.deg(start_node)) / sample.size();
+      for (uint32_t i = 0; i < sample.size(); ++i) {
+	pairs.push_back(sample[i]);
+	scales.push_back(scale);
+      }
+    }
+
+    vector<uint32_t> remote;
+    for (uint32_t i = 0; i < pairs.size(); ++i) {
+      uint32_t a[2] = { pairs[i].first, pairs[i].second };
+      for (uint32_t j = 0; j < 2; ++j)
+	if (_touched.insert(a[j]) && (a[j] < begin || a[j] >= end))
+	  remote.push_back(a[j]);
+    }
+    if (partial_rows(_env))
+      hold_remote(remote);
+    if (_ps->get_rows(remote, _gamma, _lambda) < 0)
+      exit(-1);
+
+    _mut.zero();
+    _globalmut = .0;
+    _sigma_betat = .0;
+    _sigma_thetat = .0;
+    _lambdat.zero();
+    const vector<uint32_t> &touched = _touched.nodes();
+    for (uint32_t i = 0; i < touched.size(); ++i) {
+      set_dir_exp(touched[i], _gamma, _Elogpi);
+      _gammat.zero(touched[i]);
+    }
+    for (uint32_t i = 0; i < snodes.size(); ++i)
+      if (!_touched.has(snodes[i]))
+	_gammat.zero(snodes[i]);
+
+    for (uint32_t i = 0; i < pairs.size(); ++i)
+      process(pairs[i].first, pairs[i].second, scales[i]);
+
+    for (uint32_t i = 0; i < snodes.size(); ++i)
+      update_node(snodes[i]);
+
+    bool stop = false;
+    if (_ps->put_rows(snodes, _gamma, _lambda) < 0 ||
+	_ps->push_mu(_iter, snodes.size(), _mut, _mu, _globalmu, stop) < 0)
+      exit(-1);
+    if (stop) {
+      printf("\nparameter server stopped training at iteration %d\n", _iter);
+      struct rusage ru;
+      if (getrusage(RUSAGE_SELF, &ru) == 0)
+	lerr("peak RSS: %.1f MB", ru.ru_maxrss / 1e3);
+      exit(0);
+    }
+
+    _iter++;
+    printf("\riteration %d\n", _iter);
+    fflush(stdout);
+    if (_env.shard == 0 && _iter % _env.reportfreq == 0) {
+      printf("\niteration %d\n", _iter);
+      log_iteration_time();
+    }
+  }
 }
 
+//
+// The -ps-eval process. At each report, once the server of range 0 is
+// done with the iteration, fetches every row from the range servers
+// and evaluates them as randomnode_infer() does; the heldout stopping
+// rule stops the workers through the server. When training is
+// stopped otherwise, the result files are written from the rows
+// fetched then.
+//
 void
-GLMNetwork::assign_training_links()
+GLMNetwork::ps_evaluate()
 {
-  _nlinks = 0;
-  double **linksd = _links.data();
-  for (uint32_t p = 0; p < _n; ++p)  {
-    //const vector<uint32_t> *edges = _network.get_edges(p);
-    //for (uint32_t r = 0; r < edges->size(); ++r) {
-    //uint32_t q = (*edges)[r];
-    for (uint32_t q = 0; q < _n; ++q)  {    
+  Env::plog("sharded evaluation", true);
+  if (_env.async_eval)
+    lerr("-async-eval ignored with -shards");
+  uint32_t next_precision = (_iter / 100 + 1) * 100;
+  while (1) {
+    uint32_t next = (_iter / _env.reportfreq + 1) * _env.reportfreq;
+    bool stop = false;
+    if (_ps->wait(next, _iter, stop) < 0)
+      exit(-1);
+    ps_fetch_all();
+    estimate_pi();
+    if (stop) {
+      printf("\nparameter server stopped training at iteration %d\n", _iter);
+      do_on_stop();
+      exit(0);
+    }
 
-      if (p >= q)
-	continue;
-      
-      Edge e(p, q);
-      Network::order_edge(_env, e);
-      if (!edge_ok(e))
-	continue;
-      
-      linksd[_nlinks][0] = p;
-      linksd[_nlinks][1] = q;
-      _nlinks++;
+    // an iteration is skipped if the workers got ahead
+    printf("\niteration %d\n", _iter);
+    fflush(stdout);
+    heldout_likelihood();
+    if (_iter >= next_precision) {
+      lerr("iteration:%d, save precision", _iter);
+      precision_likelihood();
+      write_ranking_file();
+      lerr("done");
+      next_precision = (_iter / 100 + 1) * 100;
+    }
 
-      _training_links[p]++;
-      _training_links[q]++;
+    if (_env.terminate) {
+      do_on_stop(false);
+      _env.terminate = false;
     }
   }
 }
 
-
 void
-GLMNetwork::process(uint32_t p, uint32_t q, double scale)
+GLMNetwork::ps_init()
 {
-  yval_t y = _network.y(p,q);
+  uint32_t begin = 0, end = 0;
+  if (!ps_evaluator(_env)) {
+    ParamServer::shard_range(_n, _env.shards, _env.shard, begin, end);
+    Env::plog("shard begin", begin);
+    Env::plog("shard end", end);
+  }
 
-  _lc.reset(p,q,y);
-  _lc.update_phi();
-  
-  double log_X = _lc.cached_log_X();
-  double log_XS = _lc.cached_log_XS();
+  PSParams p;
+  p.n = _n;
+  p.k = _k;
+  p.adagrad = _env.adagrad || _env.gamma_adagrad;
+  p.mu0 = _mu0;
+  p.sigma0 = _sigma0;
+  p.mutau0 = _mutau0;
+  p.mukappa = _mukappa;
+
+  _ps = new PSClient(_env.ps_path, _env.shard, _env.shards);
+  if (_ps->connect_server() < 0 || _ps->hello(p) < 0)
+    exit(-1);
 
-  const Matrix &phi = _lc.phi();
+  // the evaluator starts from the rows every shard has published
+  if (ps_evaluator(_env)) {
+    bool stop = false;
+    if (_ps->wait(0, _iter, stop) < 0)
+      exit(-1);
+    ps_fetch_all();
+    return;
+  }
 
-  double **gtd = _gammat.data();
-  Array phi1k(_k), phi2k(_k);
-  for (uint32_t k = 0; k < _k; ++k) {
-    phi.slice(0, k, phi1k);
-    phi.slice(1, k, phi2k);
+  // publish the initial rows of this shard and wait for the others
+  vector<uint32_t> owned;
+  for (uint32_t i = begin; i < end; ++i)
+    owned.push_back(i);
+  if (_ps->put_rows(owned, _gamma, _lambda) < 0 || _ps->sync() < 0)
+    exit(-1);
+}
 
-    gtd[p][k] += scale * phi1k.sum();
-    gtd[q][k] += scale * phi2k.sum();
-  }
-  
-  const double ** const phid = _lc.phi().const_data();
-  for (uint32_t k = 0; k < _k; ++k) {
-    double u1;
-    if (_env.globalmu)
-      u1 = log_X + _globalmu + SQ(_sigma_beta)/2; 
-    else
-      u1 = log_X + _mu[k] + SQ(_sigma_beta)/2;
-    _mut[k] += scale * phid[k][k] * (y - exp(u1));
-    //printf("mut[%d] = %f\n", k, phid[k][k] * (y - exp(u1)));
-  }
-  
-  // sigma_beta gradient
-  double u1 = log_X;
-  Array list_of_exps(_k);
-  for (uint32_t k = 0; k < _k; ++k) {
-    double l = phid[k][k];
-    if (l < 1e-30)
-      l = 1e-30;
-    list_of_exps[k] = log(l) + _mu[k];
-  }
-  double u2 = list_of_exps.logsum();
-  double u = exp(u1 + u2);
-  _sigma_betat += _sigma_beta * u;
-  
-  // lambda_a, lambda_b gradients
-  double xs = exp(log_XS);
-  _lambdat[p] += scale * (y - xs);
-  _lambdat[q] += scale * (y - xs);
-  
-  // sigma_theta gradient
-  _sigma_thetat += 2 * _sigma_theta * xs;
+void
+GLMNetwork::hold_row(uint32_t p)
+{
+  _gamma.alloc_row(p);
+  if (_Elogpi.m() > 0)
+    _Elogpi.alloc_row(p);
 }
 
+//
+// With partial_rows(), makes room for this minibatch's remote rows
+// and frees those of the last minibatch it does not touch again; the
+// rows held are the shard's own and at most one minibatch's others.
+//
 void
-GLMNetwork::infer()
+GLMNetwork::hold_remote(const vector<uint32_t> &remote)
 {
-  randomnode_infer();
+  for (uint32_t i = 0; i < _remote.size(); ++i) {
+    uint32_t p = _remote[i];
+    if (_touched.has(p))
+      continue;
+    _gamma.free_row(p);
+    if (_Elogpi.m() > 0)
+      _Elogpi.free_row(p);
+  }
+  for (uint32_t i = 0; i < remote.size(); ++i)
+    hold_row(remote[i]);
+  _remote = remote;
 }
 
+// the evaluator's copy of every row; it keeps no E[log pi]
 void
-GLMNetwork::estimate_pi()
+GLMNetwork::ps_fetch_all()
 {
-  const double ** const gd = _gamma.const_data();
+  vector<uint32_t> ids(_n);
+  for (uint32_t i = 0; i < _n; ++i)
+    ids[i] = i;
+  if (_ps->get_rows(ids, _gamma, _lambda) < 0)
+    exit(-1);
+  if (_hc)
+    _hc->invalidate();
+}
+
+void
+GLMNetwork::sample_nonlinks(uint32_t start_node, vector<Edge> &sample)
+{
+  uint32_t offset;
+  if (_env.crng) {
+    CRng nlrng(seed(), CRng::NONLINKS, _iter, start_node);
+    offset = nlrng.uniform_int(_n);
+  } else
+    offset = gsl_rng_uniform_int(_r, _n);
+  double v = (double)offset / _noninf_setsize;
+  uint32_t q = ((int)v) * _noninf_setsize;
+  tst("\nq = %d, set size = %d\n", q, _noninf_setsize);
+  
+  while (sample.size() < _noninf_setsize) {
+    uint32_t node = _shuffled_nodes[q];
+    if (node == start_node) {
+      q = (q + 1) % _n;
+      continue;
+    }
+    
+    yval_t y = get_y(start_node, node);
+    Edge e(start_node, node);
+    Network::order_edge(_env, e);
+    if (y == 0 && edge_ok(e))
+      sample.push_back(e);
+    q = (q + 1) % _n;
+  }
+}
+
+SparseRows::~SparseRows()
+{
+  for (uint32_t i = 0; i < _blocks.size(); ++i)
+    delete[] _blocks[i];
+}
+
+double *
+SparseRows::add(uint32_t n)
+{
+  uint32_t s = _nodes.size();
+  if (s / BLOCK_ROWS == _blocks.size())
+    _blocks.push_back(new double[(uint64_t)BLOCK_ROWS * _k]);
+  double *r = _blocks[s / BLOCK_ROWS] + (uint64_t)(s % BLOCK_ROWS) * _k;
+  memset(r, 0, _k * sizeof(double));
+  _slot[n] = s;
+  _nodes.push_back(n);
+  return r;
+}
+
+// an all-zero row is what an untouched node reads as, so it is only
+// stored for a node that already has a row
+void
+SparseRows::set(uint32_t n, const double *v)
+{
+  if (_slot[n] == NONE) {
+    uint32_t k = 0;
+    while (k < _k && v[k] == .0)
+      k++;
+    if (k == _k)
+      return;
+  }
+  memcpy(row(n), v, _k * sizeof(double));
+}
+
+void
+SparseRows::clear()
+{
+  for (uint32_t i = 0; i < _nodes.size(); ++i)
+    _slot[_nodes[i]] = NONE;
+  _nodes.clear();
+}
+
+uint64_t
+SparseRows::bytes() const
+{
+  return _slot.size() * sizeof(uint32_t) +
+    (uint64_t)_blocks.size() * BLOCK_ROWS * _k * sizeof(double);
+}
+
+GroupCounts::GroupCounts(const Network &network, uint32_t n, uint32_t k)
+  : _start(n + 1, 0), _used(n, 0)
+{
+  for (uint32_t i = 0; i < n; ++i) {
+    const vector<uint32_t> *edges = network.get_edges(i);
+    uint32_t d = edges ? edges->size() : 0;
+    _start[i + 1] = _start[i] + (d < k ? d : k);
+  }
+  _group.resize(_start[n]);
+  _count.resize(_start[n]);
+}
+
+RowCache::RowCache(uint32_t n, uint32_t k, uint32_t rows)
+  : _k(k), _slot(n, NONE),
+    _node(rows < MIN_ROWS ? MIN_ROWS : rows, NONE),
+    _prev(_node.size()), _next(_node.size()),
+    _rows((uint64_t)_node.size() * k),
+    _head(0), _tail(_node.size() - 1),
+    _hits(0), _misses(0)
+{
+  for (uint32_t e = 0; e < _node.size(); ++e) {
+    _prev[e] = e > 0 ? e - 1 : NONE;
+    _next[e] = e + 1 < _node.size() ? e + 1 : NONE;
+  }
+}
+
+void
+RowCache::unlink(uint32_t e)
+{
+  if (_prev[e] != NONE)
+    _next[_prev[e]] = _next[e];
+  else
+    _head = _next[e];
+  if (_next[e] != NONE)
+    _prev[_next[e]] = _prev[e];
+  else
+    _tail = _prev[e];
+}
+
+void
+RowCache::push_front(uint32_t e)
+{
+  _prev[e] = NONE;
+  _next[e] = _head;
+  _prev[_head] = e;
+  _head = e;
+}
+
+void
+RowCache::push_back(uint32_t e)
+{
+  _next[e] = NONE;
+  _prev[e] = _tail;
+  _next[_tail] = e;
+  _tail = e;
+}
+
+// a dropped row is the first to be reused
+void
+RowCache::drop(uint32_t n)
+{
+  uint32_t e = _slot[n];
+  if (e == NONE)
+    return;
+  _slot[n] = NONE;
+  _node[e] = NONE;
+  if (e != _tail) {
+    unlink(e);
+    push_back(e);
+  }
+}
+
+void
+RowCache::clear()
+{
+  for (uint32_t e = 0; e < _node.size(); ++e)
+    if (_node[e] != NONE) {
+      _slot[_node[e]] = NONE;
+      _node[e] = NONE;
+    }
+}
+
+uint64_t
+RowCache::bytes() const
+{
+  return _slot.size() * sizeof(uint32_t) +
+    (uint64_t)_node.size() * (3 * sizeof(uint32_t) + _k * sizeof(double));
+}
+
+void
+GLMNetwork::update_node(uint32_t n)
+{
+  double *gt = _gammat.row(n);
+  double *ag = _env.gamma_adagrad ? _gammat_ag.row(n) : NULL;
+  _lambdat[n] += (_mu1 -_lambda[n]) / SQ(_sigma1);
+  for (uint32_t k = 0; k < _k; ++k) {
+    gt[k] += _alpha[k] - _gamma.at(n,k);
+    if (ag)
+      ag[k] += gt[k] * gt[k];
+  }
+
+  _rho = pow(_tau0 + _iter, -1 * _kappa);
+
+  for (uint32_t k = 0; k < _k; ++k) {
+    if (ag)
+      _gamma.add(n, k, gt[k] / ag[k]);
+    else
+      _gamma.add(n, k, _rho * gt[k]);
+  }
+
+  if (!_env.nolambda)
+    _lambda[n] += _rho * _lambdat[n];
+  set_dir_exp(n, _gamma, _Elogpi);
+  if (_hc)
+    _hc->mark(n);
+  if (_ckpt_dirty)
+    _ckpt_dirty->insert(n);
+}
+
+void
+GLMNetwork::log_iteration_time()
+{
+  struct timeval now, d;
+  gettimeofday(&now, NULL);
+  timeval_subtract(&d, &now, &_report_tv);
+  double ms = d.tv_sec * 1e3 + d.tv_usec / 1e3;
+  fprintf(_itf, "%d\t%d\t%.3f\n", _iter, duration(), ms / _env.reportfreq);
+  fflush(_itf);
+  _report_tv = now;
+}
+
+//
+// Writes the model, precision, ranking and community files. Training
+// goes on after a signal (wait false), so the checkpoint writer is
+// left to finish the result files in the background.
+//
+void
+GLMNetwork::do_on_stop(bool wait)
+{
+  lerr("gradient rows: %.1f MB; adagrad rows: %.1f MB for %ld nodes",
+       _gammat.bytes() / 1e6, _gammat_ag.bytes() / 1e6,
+       _gammat_ag.nodes().size());
+  if (_epcache) {
+    uint64_t h = _epcache->hits(), m = _epcache->misses();
+    lerr("E[log pi] cache: %.1f MB; %lu hits, %lu misses (%.1f%% hits)",
+	 _epcache->bytes() / 1e6, (unsigned long)h, (unsigned long)m,
+	 h + m > 0 ? 100.0 * h / (h + m) : .0);
+  }
+  // with a checkpoint writer, the result files are written from the
+  // final image on its thread while precision and ranking run here
+  ModelView v(*this);
+  if (_ckpt)
+    _ckpt->post(false, true);
+  else {
+    save_model(v);
+    if ((_env.checkpoint_freq > 0 || _env.checkpoint_delta > 0) && !_ps)
+      save_checkpoint();
+  }
+  precision_likelihood();
+  _save_ranking_file = true;
+  write_ranking_file();
+  _save_ranking_file = false;
+  if (!_ckpt) {
+    save_groups(v);
+    compute_and_log_groups(v);
+  }
+  // the caller may exit next
+  if (_ckpt && wait)
+    _ckpt->drain();
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+    lerr("peak RSS: %.1f MB", ru.ru_maxrss / 1e3);
+}
+
+void
+GLMNetwork::assign_training_links()
+{
+  _nlinks = 0;
+  double **linksd = _links.data();
+  for (uint32_t p = 0; p < _n; ++p)  {
+    //const vector<uint32_t> *edges = _network.get_edges(p);
+    //for (uint32_t r = 0; r < edges->size(); ++r) {
+    //uint32_t q = (*edges)[r];
+    for (uint32_t q = 0; q < _n; ++q)  {    
+
+      if (p >= q)
+	continue;
+      
+      Edge e(p, q);
+      Network::order_edge(_env, e);
+      if (!edge_ok(e))
+	continue;
+      
+      linksd[_nlinks][0] = p;
+      linksd[_nlinks][1] = q;
+      _nlinks++;
+
+      _training_links[p]++;
+      _training_links[q]++;
+    }
+  }
+}
+
+
+void
+GLMNetwork::process(uint32_t p, uint32_t q, double scale)
+{
+  yval_t y = _network.y(p,q);
+
+  _lc.reset(p,q,y);
+  _lc.update_phi();
+  
+  double log_X = _lc.cached_log_X();
+  double log_XS = _lc.cached_log_XS();
+
+  const Matrix &phi = _lc.phi();
+
+  double *gtp = _gammat.row(p);
+  double *gtq = _gammat.row(q);
+  Array phi1k(_k), phi2k(_k);
+  for (uint32_t k = 0; k < _k; ++k) {
+    phi.slice(0, k, phi1k);
+    phi.slice(1, k, phi2k);
+
+    gtp[k] += scale * phi1k.sum();
+    gtq[k] += scale * phi2k.sum();
+  }
+  
+  const double ** const phid = _lc.phi().const_data();
+  for (uint32_t k = 0; k < _k; ++k) {
+    double u1;
+    if (_env.globalmu)
+      u1 = log_X + _globalmu + SQ(_sigma_beta)/2; 
+    else
+      u1 = log_X + _mu[k] + SQ(_sigma_beta)/2;
+    _mut[k] += scale * phid[k][k] * (y - exp(u1));
+    //printf("mut[%d] = %f\n", k, phid[k][k] * (y - exp(u1)));
+  }
+  
+  // sigma_beta gradient
+  double u1 = log_X;
+  Array list_of_exps(_k);
+  for (uint32_t k = 0; k < _k; ++k) {
+    double l = phid[k][k];
+    if (l < 1e-30)
+      l = 1e-30;
+    list_of_exps[k] = log(l) + _mu[k];
+  }
+  double u2 = list_of_exps.logsum();
+  double u = exp(u1 + u2);
+  _sigma_betat += _sigma_beta * u;
+  
+  // lambda_a, lambda_b gradients
+  double xs = exp(log_XS);
+  _lambdat[p] += scale * (y - xs);
+  _lambdat[q] += scale * (y - xs);
+  
+  // sigma_theta gradient
+  _sigma_thetat += 2 * _sigma_theta * xs;
+}
+
+void
+GLMNetwork::infer()
+{
+  // the training loop reads rows of every NUMA node; with -numa it is
+  // pinned to the first, so it does not migrate between sockets
+  if (_env.numa && NUMA::run_on_node(0) < 0)
+    lerr("cannot pin the training thread to numa node 0");
+  if (_ps && ps_evaluator(_env))
+    ps_evaluate();
+  else if (_ps)
+    sharded_infer();
+  else
+    randomnode_infer();
+}
+
+// with -lazy-pi, pi_row() estimates each row when it is read
+void
+GLMNetwork::estimate_pi()
+{
+  if (_env.lazy_pi)
+    return;
+  const double ** const gd = _gamma.const_data();
   double **epid = _pi.data();
   for (uint32_t n = 0; n < _n; ++n) {
     double s = .0;
@@ -997,159 +1831,929 @@ GLMNetwork::estimate_pi()
   }
 }
 
-void
-GLMNetwork::save_groups()
+ModelView::ModelView(const GLMNetwork &glm)
+  : _k(glm._k), _iter(glm._iter), _gamma(glm._gamma.const_data()),
+    _pi(glm._env.lazy_pi ? NULL : glm._pi.const_data()),
+    _lambda(glm._lambda.const_data()), _mu(glm._mu.const_data()),
+    _globalmu(glm._globalmu)
 {
-  FILE *groupsf = fopen(Env::file_str("/groups.txt").c_str(), "w");
-  char buf[32];
-  const IDMap &seq2id = _network.seq2id();
+}
 
-  ostringstream sa;
-  Array groups(_n);
-  Array pi_i(_k);
-  for (uint32_t i = 0; i < _n; ++i) {
-    sa << i << "\t";
-    IDMap::const_iterator it = seq2id.find(i);
-    uint32_t id = 0;
-    if (it == seq2id.end()) { // single node
-      id = i;
-    } else
-      id = (*it).second;
-
-    sa << id << "\t";
-    _pi.slice(0, i, pi_i);
+ModelView::ModelView(const GLMNetwork &glm, const LinkModel &m)
+  : _k(glm._k), _iter(glm._iter), _gamma(NULL),
+    _pi(m._pi.const_data()), _lambda(m._lambda.const_data()),
+    _mu(m._mu.const_data()), _globalmu(m._globalmu)
+{
+}
+
+ModelView::ModelView(const GLMNetwork &glm, const CheckpointImage &img)
+  : _k(glm._k), _iter(img.header.iter), _rows(glm._n), _pi(NULL),
+    _lambda(img.doubles(CheckpointHeader::LAMBDA)),
+    _mu(img.doubles(CheckpointHeader::MU)),
+    _globalmu(img.header.globalmu)
+{
+  const double *g = img.doubles(CheckpointHeader::GAMMA);
+  for (uint32_t p = 0; p < glm._n; ++p)
+    _rows[p] = g + (uint64_t)p * _k;
+  _gamma = &_rows[0];
+}
+
+void
+ModelRows::format(uint32_t i, OutBuf &out) const
+{
+  const IDMap &m = _glm._network.seq2id();
+  IDMap::const_iterator idt = m.find(i);
+  uint32_t k = _glm._k;
+  switch (_file) {
+  case GAMMA: {
+    assert (idt != m.end());
+    const double *g = _v.gamma(i);
+    out.put_uint(i).put('\t').put_uint(idt->second);
+    for (uint32_t j = 0; j < k; ++j)
+      out.put('\t').put_fixed(g[j], 5);
+    out.put('\n');
+    break;
+  }
+  case GROUPS: {
+    Array pi_i(k);
+    const double *pid = _v.pi_row(i, pi_i);
+    out.put_uint(i).put('\t');
+    out.put_uint(idt == m.end() ? i : idt->second).put('\t'); // single node
     double max = .0;
-    for (uint32_t j = 0; j < _k; ++j) {
-      memset(buf, 0, 32);
-      sprintf(buf,"%.3f", pi_i[j]);
-      sa << buf << "\t";
-      if (pi_i[j] > max) {
-	max = pi_i[j];
-	groups[i] = j;
+    uint32_t group = 0;
+    for (uint32_t j = 0; j < k; ++j) {
+      out.put_fixed(pid[j], 3).put('\t');
+      if (pid[j] > max) {
+	max = pid[j];
+	group = j;
       }
     }
-    sa << groups[i] << "\n";
+    out.put_uint(group).put('\n');
+    break;
+  }
+  case POPULARITY:
+    if (idt == m.end())
+      break;
+    out.put_uint(i).put('\t').put_uint(idt->second).put('\t');
+    out.put_uint(_glm._network.deg(i)).put('\t');
+    out.put_fixed(_v.lambda(i), 5).put('\n');
+    break;
+  case GML_NODES:
+    assert (idt != m.end());
+    out.put("\tnode\n\t[\n\t\tid ").put_uint(i);
+    out.put("\n\t\textid ").put_uint(idt->second);
+    out.put("\n\t\tpopularity ").put_fixed(exp(_v.lambda(i)), 5);
+    out.put("\n\t\tgroup ").put_uint(_v.most_likely_group(i));
+    out.put("\n\t]\n");
+    break;
   }
-  fprintf(groupsf, "%s", sa.str().c_str());
-  fflush(groupsf);
-  fclose(groupsf);
 }
 
 void
-GLMNetwork::save_popularity()
+GLMNetwork::save_groups(const ModelView &v)
 {
-  FILE *degf = fopen(Env::file_str("/deg.txt").c_str(), "w");
-  for (uint32_t n = 0; n < _n; ++n) {
-    const IDMap &m = _network.seq2id();
-    IDMap::const_iterator idt = m.find(n);
-    if (idt != m.end()) {
-      fprintf(degf,"%d\t%d\t%d\t%.5f\n", 
-	      n, (*idt).second, _network.deg(n), _lambda[n]);
-    }
-  }
-  fclose(degf);
+  OutFile f;
+  if (f.open(Env::file_str("/groups.txt")) < 0)
+    return;
+  f.put_rows(ModelRows(*this, v, ModelRows::GROUPS), _n, nthreads());
+  f.close();
+}
+
+void
+GLMNetwork::save_popularity(const ModelView &v)
+{
+  OutFile f;
+  if (f.open(Env::file_str("/deg.txt")) < 0)
+    return;
+  f.put_rows(ModelRows(*this, v, ModelRows::POPULARITY), _n, nthreads());
+  f.close();
 }
 
 
 void
-GLMNetwork::save_mu()
+GLMNetwork::save_mu(const ModelView &v)
 {
-  FILE *f = fopen(Env::file_str("/mu.txt").c_str(), "w");
-  fprintf(f, "%d\t%.5f\n", 65536, _globalmu);
+  OutFile f;
+  if (f.open(Env::file_str("/mu.txt")) < 0)
+    return;
+  f.put_uint(65536).put('\t').put_fixed(v.globalmu(), 5).put('\n');
   for (uint32_t k = 0; k < _k; ++k)
-    fprintf(f,"%d\t%.5f\n", k, _mu[k]);
-  fclose(f);
+    f.put_uint(k).put('\t').put_fixed(v.mu(k), 5).put('\n');
+  f.close();
+}
+
+
+//
+// gamma.npy and pi.npy (n x K), lambda.npy (n), mu.npy (K) and
+// ids.npy (n), the id of each node; row i of each is node i of the
+// text files. Values are the full doubles, not the rounded text.
+//
+int
+GLMNetwork::save_npy(const ModelView &v)
+{
+  const IDMap &m = _network.seq2id();
+  NpyFile f;
+  if (f.open(Env::file_str("/gamma.npy"), "f8", _n, _k) < 0)
+    return -1;
+  for (uint32_t i = 0; i < _n; ++i)
+    f.put((const char *)v.gamma(i), _k * sizeof(double));
+  if (f.close() < 0 ||
+      f.open(Env::file_str("/pi.npy"), "f8", _n, _k) < 0)
+    return -1;
+  Array pi_i(_k);
+  for (uint32_t i = 0; i < _n; ++i)
+    f.put((const char *)v.pi_row(i, pi_i), _k * sizeof(double));
+  if (f.close() < 0 ||
+      f.open(Env::file_str("/lambda.npy"), "f8", _n) < 0)
+    return -1;
+  for (uint32_t i = 0; i < _n; ++i) {
+    double l = v.lambda(i);
+    f.put((const char *)&l, sizeof(l));
+  }
+  if (f.close() < 0 ||
+      f.open(Env::file_str("/mu.npy"), "f8", _k) < 0)
+    return -1;
+  for (uint32_t k = 0; k < _k; ++k) {
+    double u = v.mu(k);
+    f.put((const char *)&u, sizeof(u));
+  }
+  if (f.close() < 0 ||
+      f.open(Env::file_str("/ids.npy"), "u4", _n) < 0)
+    return -1;
+  for (uint32_t i = 0; i < _n; ++i) {
+    IDMap::const_iterator idt = m.find(i);
+    uint32_t id = idt != m.end() ? idt->second : i;
+    f.put((const char *)&id, sizeof(id));
+  }
+  return f.close();
 }
 
+void
+GLMNetwork::save_model(const ModelView &v)
+{
+  OutFile gammaf, hnodef;
+  if (gammaf.open(Env::file_str("/gamma.txt")) < 0 ||
+      hnodef.open(Env::file_str("/heldout-nodes.txt")) < 0)
+    return;
+  gammaf.put_rows(ModelRows(*this, v, ModelRows::GAMMA), _n, nthreads());
+  gammaf.close();
+
+  const IDMap &m = _network.seq2id();
+  for (uint32_t i = 0; i < _n; ++i) {
+    if (_heldout_deg[i] < _network.deg(i))
+      continue;
+    IDMap::const_iterator idt = m.find(i);
+    assert (idt != m.end());
+    hnodef.put_uint(i).put('\t').put_uint(idt->second).put('\t');
+    hnodef.put_uint(_heldout_deg[i]).put('\n');
+  }
+  hnodef.close();
+  save_popularity(v);
+  save_mu(v);
+  if (_env.npy)
+    save_npy(v);
+}
 
+// writes the result files from a full checkpoint image; runs on the
+// CheckpointThread
 void
-GLMNetwork::save_model()
+GLMNetwork::save_results(const CheckpointImage &img)
 {
-  FILE *gammaf = fopen(Env::file_str("/gamma.txt").c_str(), "w");
-  FILE *hnodef = fopen(Env::file_str("/heldout-nodes.txt").c_str(), "w");
+  ModelView v(*this, img);
+  save_model(v);
+  save_groups(v);
+  compute_and_log_groups(v);
+}
+
+//
+// Copies everything randomnode_infer() carries from one iteration to
+// the next, at full precision, so that a run resumed from it takes
+// the same steps as the run that wrote it. A delta copies only the
+// gamma, gammat_ag and lambda rows update_node() changed since the
+// last checkpoint.
+//
+void
+GLMNetwork::snapshot_checkpoint(CheckpointImage &img, bool delta)
+{
+  CheckpointHeader &h = img.header;
+  h = CheckpointHeader();
+  h.n = _n;
+  h.k = _k;
+  h.iter = _iter;
+  h.nh = _nh;
+  h.globalmu = _globalmu;
+  h.prev_h = _prev_h;
+  h.max_h = _max_h;
+
+  vector<uint32_t> all;
+  if (!delta) {
+    all.resize(_n);
+    for (uint32_t i = 0; i < _n; ++i)
+      all[i] = i;
+  }
+  const vector<uint32_t> &rows = delta ? _ckpt_dirty->nodes() : all;
+  uint32_t nrows = rows.size();
+
+  uint64_t row = _k * sizeof(double);
+  double *g = (double *)img.section(CheckpointHeader::GAMMA, nrows * row);
+  double *l = (double *)img.section(CheckpointHeader::LAMBDA,
+				    nrows * sizeof(double));
   const double ** const gd = _gamma.const_data();
+  uint32_t nag = 0;
+  for (uint32_t i = 0; i < nrows; ++i) {
+    uint32_t p = rows[i];
+    memcpy(g + (uint64_t)i * _k, gd[p], row);
+    l[i] = _lambda[p];
+    if (_gammat_ag.find(p))
+      nag++;
+  }
+
+  // adagrad sums only for the rows that have them, none without
+  // -gamma-adagrad
+  double *a = (double *)img.section(CheckpointHeader::GAMMAT_AG, nag * row);
+  uint32_t *ar = (uint32_t *)img.section(CheckpointHeader::AG_ROWS,
+					 nag * sizeof(uint32_t));
+  for (uint32_t i = 0, j = 0; i < nrows; ++i) {
+    const double *ap = _gammat_ag.find(rows[i]);
+    if (!ap)
+      continue;
+    memcpy(a + (uint64_t)j * _k, ap, row);
+    ar[j++] = rows[i];
+  }
+  memcpy(img.section(CheckpointHeader::MU, row), _mu.const_data(), row);
+  memcpy(img.section(CheckpointHeader::MUT_AG, row),
+	 _mut_ag.const_data(), row);
+  memcpy(img.section(CheckpointHeader::RNG, gsl_rng_size(_r)),
+	 gsl_rng_state(_r), gsl_rng_size(_r));
+
+  if (delta) {
+    h.flags = CheckpointHeader::DELTA;
+    h.base = _ckpt_base;
+    memcpy(img.section(CheckpointHeader::ROWS, nrows * sizeof(uint32_t)),
+	   &rows[0], nrows * sizeof(uint32_t));
+    img.section(CheckpointHeader::SEQ2ID, 0);
+    img.section(CheckpointHeader::SHUFFLED, 0);
+  } else {
+    uint32_t *ids = (uint32_t *)img.section(CheckpointHeader::SEQ2ID,
+					    _n * sizeof(uint32_t));
+    for (uint32_t i = 0; i < _n; ++i) {
+      IDMap::const_iterator itr = _network.seq2id().find(i);
+      ids[i] = itr != _network.seq2id().end() ? itr->second : 0;
+    }
+    memcpy(img.section(CheckpointHeader::SHUFFLED, _n * sizeof(uint32_t)),
+	   _shuffled_nodes.const_data(), _n * sizeof(uint32_t));
+    img.section(CheckpointHeader::ROWS, 0);
+    _ckpt_based = true;
+    _ckpt_base = _iter;
+  }
+  if (_ckpt_dirty)
+    _ckpt_dirty->clear();
+}
+
+//
+// Hands a snapshot to the background writer if there is one, and
+// writes it here otherwise. A delta is taken only on top of a full
+// checkpoint from this run, and only while it is the smaller one.
+//
+int
+GLMNetwork::save_checkpoint(bool delta)
+{
+  if (delta && (!_ckpt_based || !_ckpt || _ckpt->need_full() ||
+		_ckpt_dirty->nodes().size() > _n / 2))
+    delta = false;
+  if (_ckpt) {
+    _ckpt->post(delta);
+    return 0;
+  }
+  CheckpointImage img;
+  snapshot_checkpoint(img, false);
+  return img.write(Env::file_str("/checkpoint.bin"));
+}
+
+int
+GLMNetwork::load_checkpoint(string fname)
+{
+  CheckpointFile f;
+  if (f.open(fname) < 0)
+    return -1;
+  const CheckpointHeader &h = f.header();
+  if (h.n != _n || h.k != _k) {
+    fprintf(stderr, "%s has n = %d, K = %d; expected n = %d, K = %d\n",
+	    fname.c_str(), h.n, h.k, _n, _k);
+    return -1;
+  }
+  uint64_t nk = (uint64_t)_n * _k * sizeof(double);
+  if (f.bytes(CheckpointHeader::GAMMA) != nk ||
+      f.bytes(CheckpointHeader::LAMBDA) != _n * sizeof(double) ||
+      f.bytes(CheckpointHeader::MU) != _k * sizeof(double) ||
+      f.bytes(CheckpointHeader::MUT_AG) != _k * sizeof(double) ||
+      f.bytes(CheckpointHeader::SEQ2ID) != _n * sizeof(uint32_t) ||
+      f.bytes(CheckpointHeader::SHUFFLED) != _n * sizeof(uint32_t) ||
+      f.bytes(CheckpointHeader::RNG) != gsl_rng_size(_r)) {
+    fprintf(stderr, "%s: section sizes do not match this model\n",
+	    fname.c_str());
+    return -1;
+  }
+  const uint32_t *ids = f.uints(CheckpointHeader::SEQ2ID);
   for (uint32_t i = 0; i < _n; ++i) {
-    const IDMap &m = _network.seq2id();
-    IDMap::const_iterator idt = m.find(i);
-    if (idt != m.end()) {
+    IDMap::const_iterator itr = _network.seq2id().find(i);
+    if (itr == _network.seq2id().end() || itr->second != ids[i]) {
+      fprintf(stderr, "%s was written for a different network "
+	      "(node %d)\n", fname.c_str(), i);
+      return -1;
+    }
+  }
 
-      if (_heldout_deg[i] >= _network.deg(i)) {
-	fprintf(hnodef, "%d\t%d\t%d\n", i, idt->second, _heldout_deg[i]);
-	//printf("* Warning: node %d(%d) not used in training\n", 
-	//(*idt).second, i);
-	//continue;
-      }
+  double **gd = _gamma.data();
+  const double *g = f.doubles(CheckpointHeader::GAMMA);
+  for (uint32_t i = 0; i < _n; ++i)
+    memcpy(gd[i], g + (uint64_t)i * _k, _k * sizeof(double));
+  _gammat_ag.clear();
+  if (load_ag_rows(f, 0, fname) < 0)
+    return -1;
+  memcpy(_lambda.data(), f.doubles(CheckpointHeader::LAMBDA),
+	 _n * sizeof(double));
+  memcpy(_mu.data(), f.doubles(CheckpointHeader::MU), _k * sizeof(double));
+  memcpy(_mut_ag.data(), f.doubles(CheckpointHeader::MUT_AG),
+	 _k * sizeof(double));
+  memcpy(_shuffled_nodes.data(), f.uints(CheckpointHeader::SHUFFLED),
+	 _n * sizeof(uint32_t));
+  memcpy(gsl_rng_state(_r), f.section(CheckpointHeader::RNG),
+	 gsl_rng_size(_r));
+
+  _iter = h.iter;
+  _nh = h.nh;
+  _globalmu = h.globalmu;
+  _prev_h = h.prev_h;
+  _max_h = h.max_h;
+
+  string log = CheckpointFile::log_name(fname);
+  if (access(log.c_str(), F_OK) == 0 && load_checkpoint_log(log, h.iter) < 0)
+    return -1;
+  _resumed = true;
+  Env::plog("resumed at iteration", _iter);
+  return 0;
+}
 
-      fprintf(gammaf,"%d\t", i);
-      debug("looking up i %d\n", i);
-      fprintf(gammaf,"%d\t", (*idt).second);
-      for (uint32_t k = 0; k < _k; ++k) {
-	if (k == _k - 1)
-	  fprintf(gammaf,"%.5f\n", gd[i][k]);
-	else
-	  fprintf(gammaf,"%.5f\t", gd[i][k]);
+// sets the adagrad rows of record r
+int
+GLMNetwork::load_ag_rows(const CheckpointFile &f, uint32_t r, string fname)
+{
+  uint64_t nag = f.bytes(CheckpointHeader::AG_ROWS, r) / sizeof(uint32_t);
+  if (f.bytes(CheckpointHeader::GAMMAT_AG, r) != nag * _k * sizeof(double)) {
+    fprintf(stderr, "%s: bad adagrad rows at iteration %d\n",
+	    fname.c_str(), f.header(r).iter);
+    return -1;
+  }
+  const uint32_t *rows = f.uints(CheckpointHeader::AG_ROWS, r);
+  const double *a = f.doubles(CheckpointHeader::GAMMAT_AG, r);
+  for (uint32_t i = 0; i < nag; ++i) {
+    if (rows[i] >= _n) {
+      fprintf(stderr, "%s: bad node %d\n", fname.c_str(), rows[i]);
+      return -1;
+    }
+    _gammat_ag.set(rows[i], a + (uint64_t)i * _k);
+  }
+  return 0;
+}
+
+//
+// Replays the delta records in fname that extend the full checkpoint
+// taken at iteration base; records of an older base are left over
+// from before the last compaction and are skipped.
+//
+int
+GLMNetwork::load_checkpoint_log(string fname, uint32_t base)
+{
+  CheckpointFile f;
+  if (f.open(fname, true) < 0)
+    return -1;
+  uint32_t applied = 0;
+  double **gd = _gamma.data();
+  for (uint32_t r = 0; r < f.nrecords(); ++r) {
+    const CheckpointHeader &h = f.header(r);
+    if (!h.delta() || h.base != base || h.iter <= _iter)
+      continue;
+    uint64_t nrows = f.bytes(CheckpointHeader::ROWS, r) / sizeof(uint32_t);
+    if (h.n != _n || h.k != _k ||
+	f.bytes(CheckpointHeader::GAMMA, r) != nrows * _k * sizeof(double) ||
+	f.bytes(CheckpointHeader::LAMBDA, r) != nrows * sizeof(double) ||
+	f.bytes(CheckpointHeader::MU, r) != _k * sizeof(double) ||
+	f.bytes(CheckpointHeader::MUT_AG, r) != _k * sizeof(double) ||
+	f.bytes(CheckpointHeader::RNG, r) != gsl_rng_size(_r)) {
+      fprintf(stderr, "%s: bad delta record at iteration %d\n",
+	      fname.c_str(), h.iter);
+      return -1;
+    }
+    const uint32_t *rows = f.uints(CheckpointHeader::ROWS, r);
+    const double *g = f.doubles(CheckpointHeader::GAMMA, r);
+    const double *l = f.doubles(CheckpointHeader::LAMBDA, r);
+    for (uint32_t i = 0; i < nrows; ++i) {
+      uint32_t p = rows[i];
+      if (p >= _n) {
+	fprintf(stderr, "%s: bad node %d\n", fname.c_str(), p);
+	return -1;
       }
+      memcpy(gd[p], g + (uint64_t)i * _k, _k * sizeof(double));
+      _lambda[p] = l[i];
+    }
+    if (load_ag_rows(f, r, fname) < 0)
+      return -1;
+    memcpy(_mu.data(), f.doubles(CheckpointHeader::MU, r),
+	   _k * sizeof(double));
+    memcpy(_mut_ag.data(), f.doubles(CheckpointHeader::MUT_AG, r),
+	   _k * sizeof(double));
+    memcpy(gsl_rng_state(_r), f.section(CheckpointHeader::RNG, r),
+	   gsl_rng_size(_r));
+    _iter = h.iter;
+    _nh = h.nh;
+    _globalmu = h.globalmu;
+    _prev_h = h.prev_h;
+    _max_h = h.max_h;
+    applied++;
+  }
+  printf("+ applied %d delta checkpoints from %s, now at iteration %d\n",
+	 applied, fname.c_str(), _iter);
+  return 0;
+}
+
+
+PairEvalThread::PairEvalThread(const GLMNetwork &glm, const SampleList &pairs,
+			       const vector<uint32_t> &mine,
+			       vector<PairSums> &blocks, Array *lik,
+			       const LinkModel *model, const PairLayout *layout)
+  : _glm(glm), _pairs(pairs), _mine(mine),
+    _blocks(blocks), _lik(lik), _model(model), _layout(layout)
+{
+}
+
+int
+PairEvalThread::do_work()
+{
+  uint32_t npairs = _pairs.size();
+  for (uint32_t j = 0; j < _mine.size(); ++j) {
+    uint32_t b = _mine[j];
+    PairSums &sums = _blocks[b];
+    sums.reset();
+    uint32_t begin, end;
+    if (_layout) {
+      begin = _layout->start[b];
+      end = _layout->start[b + 1];
     } else {
-      printf("strange error!\n");
-      fflush(stdout);
-      assert(0);
+      begin = b * BLOCK_SIZE;
+      end = (b + 1) * BLOCK_SIZE;
+      if (end > npairs)
+	end = npairs;
+    }
+    for (uint32_t s = begin; s < end; ++s) {
+      uint32_t i = _layout ? _layout->order[s] : s;
+      const Edge &e = _pairs[i].first;
+      yval_t y = _pairs[i].second;
+      assert (e.first != e.second);
+      double u;
+      if (_model)
+	u = _model->pair_likelihood(e.first, e.second, y);
+      else
+	u = _glm.pair_likelihood2(e.first, e.second, y);
+      sums.add(y, u);
+      if (_lik)
+	(*_lik)[i] = u;
     }
   }
-  fclose(gammaf);
-  fclose(hnodef);
-  save_popularity();
-  save_mu();
+  return 0;
 }
 
+PairLayout::PairLayout(const SampleList &pairs, uint32_t n)
+{
+  // counting sort of the pair indices by NUMA node
+  uint32_t nnodes = NUMA::nnodes();
+  vector<uint32_t> first(nnodes + 1, 0);
+  vector<uint32_t> node(pairs.size());
+  for (uint32_t i = 0; i < pairs.size(); ++i) {
+    node[i] = NUMA::node_of(n, pairs[i].first.first);
+    first[node[i] + 1]++;
+  }
+  for (uint32_t j = 0; j < nnodes; ++j)
+    first[j + 1] += first[j];
+
+  vector<uint32_t> next(first.begin(), first.end() - 1);
+  order.resize(pairs.size());
+  for (uint32_t i = 0; i < pairs.size(); ++i)
+    order[next[node[i]]++] = i;
+
+  for (uint32_t j = 0; j < nnodes; ++j)
+    for (uint32_t s = first[j]; s < first[j + 1];
+	 s += PairEvalThread::BLOCK_SIZE) {
+      start.push_back(s);
+      numa.push_back(j);
+    }
+  start.push_back(pairs.size());
+}
+
+HeldoutSample::HeldoutSample(const SampleList &all, uint32_t size,
+			     uint64_t seed)
+  : _all(all)
+{
+  for (uint32_t i = 0; i < all.size(); ++i)
+    _order[all[i].second ? 1 : 0].push_back(i);
+  CRng rng(seed, CRng::HELDOUT, 1, 0);
+  for (uint32_t y = 0; y < 2; ++y) {
+    if (_order[y].size() > 0)
+      rng.shuffle(&_order[y][0], _order[y].size());
+    _size[y] = size < _order[y].size() ? size : _order[y].size();
+  }
+  build();
+}
+
+void
+HeldoutSample::build()
+{
+  _pairs.clear();
+  for (uint32_t y = 0; y < 2; ++y)
+    for (uint32_t i = 0; i < _size[y]; ++i)
+      _pairs.push_back(_all[_order[y][i]]);
+}
+
+bool
+HeldoutSample::full() const
+{
+  return _size[0] == _order[0].size() && _size[1] == _order[1].size();
+}
+
+void
+HeldoutSample::grow()
+{
+  for (uint32_t y = 0; y < 2; ++y) {
+    _size[y] *= 2;
+    if (_size[y] > _order[y].size())
+      _size[y] = _order[y].size();
+  }
+  build();
+}
+
+//
+// Sample mean and variance of the stratum's likelihoods, or with diff
+// of their change since update(), over the pairs update() saw.
+//
+void
+HeldoutSample::stratum_stats(const Array &lik, uint32_t y, bool diff,
+			     uint32_t &n, double &mean, double &var) const
+{
+  uint32_t off = y ? _size[0] : 0;
+  n = diff ? _prev[y].size() : _size[y];
+  mean = var = .0;
+  if (n == 0)
+    return;
+  for (uint32_t i = 0; i < n; ++i)
+    mean += lik[off + i] - (diff ? _prev[y][i] : .0);
+  mean /= n;
+  if (n < 2)
+    return;
+  for (uint32_t i = 0; i < n; ++i) {
+    double v = lik[off + i] - (diff ? _prev[y][i] : .0) - mean;
+    var += v * v;
+  }
+  var /= n - 1;
+}
 
 double
-GLMNetwork::heldout_likelihood(bool nostop)
+HeldoutSample::stderror(const Array &lik, double w0, double w1) const
 {
-  uint32_t k = 0, kzeros = 0, kones = 0;
-  double s = .0, szeros = 0, sones = 0;
+  double w[2] = { w0, w1 };
+  double v = .0;
+  for (uint32_t y = 0; y < 2; ++y) {
+    uint32_t n;
+    double mean, var;
+    stratum_stats(lik, y, false, n, mean, var);
+    if (n > 0)
+      v += w[y] * w[y] * (1 - (double)n / _order[y].size()) * var / n;
+  }
+  return sqrt(v);
+}
 
-  for (SampleMap::const_iterator i = _heldout_map.begin();
-       i != _heldout_map.end(); ++i) {
-    const Edge &e = i->first;
-    uint32_t p = e.first;
-    uint32_t q = e.second;
-    assert (p != q);
+// stratified estimate of the change since update(), and its error
+bool
+HeldoutSample::change(const Array &lik, double w0, double w1,
+		      double &d, double &se) const
+{
+  double w[2] = { w0, w1 };
+  d = se = .0;
+  for (uint32_t y = 0; y < 2; ++y) {
+    uint32_t n;
+    double mean, var;
+    stratum_stats(lik, y, true, n, mean, var);
+    if (n == 0)
+      return false;
+    d += w[y] * mean;
+    se += w[y] * w[y] * (1 - (double)n / _order[y].size()) * var / n;
+  }
+  se = sqrt(se);
+  return true;
+}
 
-    yval_t y = i->second;
-    double u = pair_likelihood2(p,q,y);
-    s += u;
-    k += 1;
-    if (y) {
-      sones += u;
-      kones++;
-    } else {
-      szeros += u;
-      kzeros++;
+void
+HeldoutSample::update(const Array &lik)
+{
+  for (uint32_t y = 0; y < 2; ++y) {
+    uint32_t off = y ? _size[0] : 0;
+    _prev[y].resize(_size[y]);
+    for (uint32_t i = 0; i < _size[y]; ++i)
+      _prev[y][i] = lik[off + i];
+  }
+}
+
+HeldoutCache::HeldoutCache(const SampleList &pairs, uint32_t n, uint32_t k)
+  : _pairs(pairs), _start(n + 1, 0), _dirty(n),
+    _stamp(pairs.size(), 0), _epoch(0), _valid(false),
+    _lik(pairs.size()), _mu(k), _globalmu(.0)
+{
+  for (uint32_t i = 0; i < pairs.size(); ++i) {
+    _start[pairs[i].first.first + 1]++;
+    _start[pairs[i].first.second + 1]++;
+  }
+  for (uint32_t v = 0; v < n; ++v)
+    _start[v + 1] += _start[v];
+  _index.resize(_start[n]);
+  vector<uint32_t> fill(_start.begin(), _start.end() - 1);
+  for (uint32_t i = 0; i < pairs.size(); ++i) {
+    _index[fill[pairs[i].first.first]++] = i;
+    _index[fill[pairs[i].first.second]++] = i;
+  }
+}
+
+bool
+HeldoutCache::stale(const Array &mu, double globalmu, double tol) const
+{
+  if (!_valid || fabs(globalmu - _globalmu) > tol)
+    return true;
+  for (uint32_t k = 0; k < _mu.size(); ++k)
+    if (fabs(mu[k] - _mu[k]) > tol)
+      return true;
+  return false;
+}
+
+void
+HeldoutCache::reset(const PairSums &sums, const Array &lik,
+		    const Array &mu, double globalmu)
+{
+  _sums = sums;
+  for (uint32_t i = 0; i < _lik.size(); ++i)
+    _lik[i] = lik[i];
+  for (uint32_t k = 0; k < _mu.size(); ++k)
+    _mu[k] = mu[k];
+  _globalmu = globalmu;
+  _valid = true;
+  _dirty.clear();
+}
+
+// the pairs with a dirty endpoint, each once; clears the dirty set
+void
+HeldoutCache::affected(SampleList &pairs, vector<uint32_t> &which)
+{
+  ++_epoch;
+  const vector<uint32_t> &dirty = _dirty.nodes();
+  for (uint32_t d = 0; d < dirty.size(); ++d) {
+    uint32_t n = dirty[d];
+    for (uint32_t j = _start[n]; j < _start[n + 1]; ++j) {
+      uint32_t i = _index[j];
+      if (_stamp[i] == _epoch)
+	continue;
+      _stamp[i] = _epoch;
+      which.push_back(i);
+      pairs.push_back(_pairs[i]);
     }
-    debug("edge likelihood for (%d,%d) is %f\n", p,q,u);
   }
+  _dirty.clear();
+}
+
+void
+HeldoutCache::apply(const vector<uint32_t> &which, const Array &lik)
+{
+  for (uint32_t t = 0; t < which.size(); ++t) {
+    uint32_t i = which[t];
+    _sums.adjust(_pairs[i].second, lik[t] - _lik[i]);
+    _lik[i] = lik[t];
+  }
+}
+
+static bool
+by_score(const pair<double, yval_t> &a, const pair<double, yval_t> &b)
+{
+  return a.first > b.first;
+}
+
+void
+PairAUC::compute(const SampleList &pairs, const Array &lik)
+{
+  uint32_t n = pairs.size();
+  vector<pair<double, yval_t> > v(n);
+  uint32_t npos = 0, nneg = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    yval_t y = pairs[i].second;
+    // lik is log p for links and log (1 - p) for non-links
+    v[i].first = y ? exp(lik[i]) : -expm1(lik[i]);
+    v[i].second = y;
+    if (y)
+      npos++;
+    else
+      nneg++;
+  }
+  roc = pr = .0;
+  if (npos == 0 || nneg == 0)
+    return;
+  std::sort(v.begin(), v.end(), by_score);
+
+  double below = nneg; // negatives not yet passed
+  uint32_t tp = 0, fp = 0;
+  for (uint32_t i = 0; i < n; ) {
+    uint32_t gp = 0, gn = 0;
+    uint32_t j = i;
+    for (; j < n && v[j].first == v[i].first; ++j) {
+      if (v[j].second)
+	gp++;
+      else
+	gn++;
+    }
+    below -= gn;
+    roc += gp * (below + 0.5 * gn);
+    tp += gp;
+    fp += gn;
+    if (gp)
+      pr += gp * ((double)tp / (tp + fp));
+    i = j;
+  }
+  roc /= (double)npos * nneg;
+  pr /= npos;
+}
+
+void
+GLMNetwork::sample_likelihood(const SampleList &pairs, PairSums &sums,
+			      Array *lik, const LinkModel *model) const
+{
+  PairLayout *layout = NULL;
+  if (_env.numa && NUMA::nnodes() > 1)
+    layout = new PairLayout(pairs, _n);
+  uint32_t nb = layout ? layout->nblocks() :
+    PairEvalThread::nblocks(pairs.size());
+  vector<PairSums> blocks(nb);
+  uint32_t nt = nthreads();
+  if (nt > nb)
+    nt = nb;
+  if (nt < 1)
+    nt = 1;
+  vector<vector<uint32_t> > mine;
+  split_work(layout ? &layout->numa : NULL, nb, nt, mine);
+
+  if (nt <= 1) {
+    PairEvalThread t(*this, pairs, mine[0], blocks, lik, model, layout);
+    t.do_work();
+  } else {
+    vector<PairEvalThread *> threads(nt);
+    for (uint32_t i = 0; i < nt; ++i) {
+      threads[i] = new PairEvalThread(*this, pairs, mine[i], blocks, lik,
+				      model, layout);
+      start_worker(threads[i], i, nt);
+    }
+    for (uint32_t i = 0; i < nt; ++i) {
+      threads[i]->join();
+      delete threads[i];
+    }
+  }
+  delete layout;
+
+  sums.reset();
+  for (uint32_t b = 0; b < nb; ++b)
+    sums.add(blocks[b]);
+}
+
+//
+// Deals nitems work items out to nt workers. With numa, the NUMA
+// node each item's rows live on, the items of a NUMA node go in turn
+// to the workers start_worker() pins to it (to worker node % nt when
+// there are fewer workers than NUMA nodes); otherwise worker w takes
+// items w, w + nt, ...
+//
+void
+GLMNetwork::split_work(const vector<uint32_t> *numa, uint32_t nitems,
+		       uint32_t nt, vector<vector<uint32_t> > &mine) const
+{
+  mine.assign(nt, vector<uint32_t>());
+  if (!numa) {
+    for (uint32_t i = 0; i < nitems; ++i)
+      mine[i % nt].push_back(i);
+    return;
+  }
+  uint32_t nnodes = NUMA::nnodes();
+  vector<vector<uint32_t> > workers(nnodes);
+  for (uint32_t w = 0; w < nt; ++w)
+    workers[worker_node(w, nt)].push_back(w);
+  for (uint32_t j = 0; j < nnodes; ++j)
+    if (workers[j].empty())
+      workers[j].push_back(j % nt);
+
+  vector<uint32_t> next(nnodes, 0);
+  for (uint32_t i = 0; i < nitems; ++i) {
+    uint32_t j = (*numa)[i];
+    const vector<uint32_t> &ws = workers[j];
+    mine[ws[next[j]++ % ws.size()]].push_back(i);
+  }
+}
+
+double
+GLMNetwork::heldout_likelihood(bool nostop)
+{
+  bool stop = false;
+  double a = heldout_likelihood(_iter, NULL, stop);
+  if (_env.use_validation_stop && stop) {
+    if (_ps)
+      _ps->stop();
+    do_on_stop();
+    exit(0);
+  }
+  return a;
+}
+
+//
+// Logs the heldout likelihood of the training parameters, or of a
+// snapshot taken at iteration iter, and sets stop once it has
+// converged.
+//
+double
+GLMNetwork::heldout_likelihood(uint32_t iter, const LinkModel *model,
+			       bool &stop)
+{
+  if (_env.heldout_sample > 0 && !_hs)
+    _hs = new HeldoutSample(_heldout_list, _env.heldout_sample, seed());
+  const SampleList &pairs = _hs ? _hs->pairs() : _heldout_list;
+
+  PairSums ps;
+  bool cached = _hc && !model;
+  Array plik(cached ? 0 : pairs.size());
+  if (!cached)
+    sample_likelihood(pairs, ps, &plik, model);
+  const Array &lik = cached ? cached_heldout_likelihood(ps) : plik;
+
+  uint32_t k = ps.k, kzeros = ps.kzeros, kones = ps.kones;
+  double s = ps.s, szeros = ps.szeros, sones = ps.sones;
+
   double nshol = (_zeros_prob * (szeros / kzeros)) + (_ones_prob * (sones / kones));
-  fprintf(_hf, "%d\t%d\t%.9f\t%d\t%.9f\t%d\t%.9f\t%d\t%.9f\t%.9f\t%.9f\n",
-	  _iter, duration(), s / k, k,
+  fprintf(_hf, "%d\t%d\t%.9f\t%d\t%.9f\t%d\t%.9f\t%d\t%.9f\t%.9f\t%.9f",
+	  iter, duration(), s / k, k,
 	  szeros / kzeros, kzeros, sones / kones, kones,
 	  _zeros_prob * (szeros / kzeros),
 	  _ones_prob * (sones / kones),
 	  nshol);
+  // a sampled estimate is followed by its standard error
+  if (_hs)
+    fprintf(_hf, "\t%.9f", _hs->stderror(lik, _zeros_prob, _ones_prob));
+  fprintf(_hf, "\n");
   fflush(_hf);
+  log_auc(iter, model, pairs, lik);
+  if (_env.nmi && iter > 0) {
+    MapVec communities;
+    if (!_nmi_counts)
+      _nmi_counts = new GroupCounts(_network, _n, _k);
+    if (model)
+      find_communities(ModelView(*this, *model), *_nmi_counts,
+		       communities, NULL);
+    else
+      find_communities(ModelView(*this), *_nmi_counts, communities, NULL);
+    compute_mutual(iter, communities);
+  }
 
   // Use hol @ network sparsity as stopping criteria
   double a = nshol;
-  bool stop = false;
+  stop = false;
   int why = -1;
-  if (_iter > 100) {
-    if (a > _prev_h && _prev_h != 0 && fabs((a - _prev_h) / _prev_h) < 0.00001) {
+
+  // on a sample, the change is measured on the pairs scored last time
+  // too; one within two standard errors of zero decides nothing, and
+  // the sample is doubled for the next report instead
+  double c = a, d = .0, dse = .0;
+  bool noisy = false;
+  if (_hs && _hs->change(lik, _zeros_prob, _ones_prob, d, dse)) {
+    c = _prev_h + d;
+    noisy = fabs(d) < 2 * dse;
+  }
+  if (_hs) {
+    _hs->update(lik);
+    if (iter > 100 && noisy) {
+      _hs->grow();
+      printf("+ heldout change %.3g +- %.3g, sample grown to %ld pairs\n",
+	     d, dse, _hs->pairs().size());
+    }
+  }
+
+  if (iter > 100 && !noisy) {
+    if (c > _prev_h && _prev_h != 0 && fabs((c - _prev_h) / _prev_h) < 0.00001) {
       stop = true;
       why = 100;
-    } else if (a < _prev_h)
+    } else if (c < _prev_h)
       _nh++;
-    else if (a > _prev_h)
+    else if (c > _prev_h)
       _nh = 0;
-
+  }
+  if (iter > 100) {
     if (a > _max_h)
       _max_h = a;
     
@@ -1161,21 +2765,73 @@ GLMNetwork::heldout_likelihood(bool nostop)
   _prev_h = nshol;
   FILE *f = fopen(Env::file_str("/max.txt").c_str(), "w");
   fprintf(f, "%d\t%d\t%.5f\t%.5f\t%d\n", 
-	  _iter, duration(), 
+	  iter, duration(), 
 	  a, _max_h, why);
   fclose(f);
-  if (_env.use_validation_stop && stop) {
-    do_on_stop();
-    exit(0);
-  }
   return a;
 }
 
+//
+// Heldout likelihoods of the training parameters through the cache:
+// a full pass if mu has moved too far, otherwise only the pairs of
+// nodes updated since the last report are rescored.
+//
+const Array &
+GLMNetwork::cached_heldout_likelihood(PairSums &sums)
+{
+  if (_hc->stale(_mu, _globalmu, _env.heldout_tol)) {
+    Array lik(_heldout_list.size());
+    sample_likelihood(_heldout_list, sums, &lik);
+    _hc->reset(sums, lik, _mu, _globalmu);
+    return _hc->lik();
+  }
+
+  SampleList changed;
+  vector<uint32_t> which;
+  uint32_t ndirty = _hc->ndirty();
+  _hc->affected(changed, which);
+  if (changed.size() > 0) {
+    PairSums cs;
+    Array lik(changed.size());
+    sample_likelihood(changed, cs, &lik);
+    _hc->apply(which, lik);
+  }
+  printf("+ heldout: rescored %ld of %ld pairs for %d updated nodes\n",
+	 changed.size(), _heldout_list.size(), ndirty);
+  sums = _hc->sums();
+  return _hc->lik();
+}
+
+//
+// Writes auc.txt: iteration, seconds, then AUC-ROC and AUC-PR over
+// the heldout pairs and over the precision pairs.
+//
+void
+GLMNetwork::log_auc(uint32_t iter, const LinkModel *model,
+		    const SampleList &heldout, const Array &heldout_lik)
+{
+  PairAUC h, p;
+  h.compute(heldout, heldout_lik);
+
+  PairSums ps;
+  Array lik(_precision_list.size());
+  sample_likelihood(_precision_list, ps, &lik, model);
+  p.compute(_precision_list, lik);
+
+  fprintf(_af, "%d\t%d\t%.9f\t%.9f\t%.9f\t%.9f\n",
+	  iter, duration(), h.roc, h.pr, p.roc, p.pr);
+  fflush(_af);
+}
+
 double
 GLMNetwork::precision_likelihood(bool nostop)
 {
-  uint32_t k = 0, kzeros = 0, kones = 0;
-  double s = .0, szeros = 0, sones = 0;
+  return precision_likelihood(_iter, NULL);
+}
+
+double
+GLMNetwork::precision_likelihood(uint32_t iter, const LinkModel *model)
+{
   _degstats.clear();
   _ndegstats.clear();
   _vmap.clear();
@@ -1184,25 +2840,18 @@ GLMNetwork::precision_likelihood(bool nostop)
   FILE *df = fopen(Env::file_str("/degstats.txt").c_str(), "w");
   assert (df);
 
-  for (SampleMap::const_iterator i = _precision_map.begin();
-       i != _precision_map.end(); ++i) {
-    
-    const Edge &e = i->first;
+  PairSums ps;
+  Array lik(_precision_list.size());
+  sample_likelihood(_precision_list, ps, &lik, model);
+
+  uint32_t k = ps.k, kzeros = ps.kzeros, kones = ps.kones;
+  double s = ps.s, szeros = ps.szeros, sones = ps.sones;
+
+  for (uint32_t i = 0; i < _precision_list.size(); ++i) {
+    const Edge &e = _precision_list[i].first;
     uint32_t p = e.first;
     uint32_t q = e.second;
-    assert (p != q);
-
-    yval_t y = i->second;
-    double u = pair_likelihood2(p,q,y);
-    s += u;
-    k += 1;
-    if (y) {
-      sones += u;
-      kones++;
-    } else {
-      szeros += u;
-      kzeros++;
-    }
+    double u = lik[i];
     info("edge likelihood for (%d,%d) is %f\n", p,q,u);
 
     uint32_t pdeg = _network.deg(p);
@@ -1222,7 +2871,7 @@ GLMNetwork::precision_likelihood(bool nostop)
   }
   double nshol = (_zeros_prob * (szeros / kzeros)) + (_ones_prob * (sones / kones));
   fprintf(_hf, "%d\t%d\t%.9f\t%d\t%.9f\t%d\t%.9f\t%d\t%.9f\t%.9f\t%.9f\n",
-	  _iter, duration(), s / k, k,
+	  iter, duration(), s / k, k,
 	  szeros / kzeros, kzeros, sones / kones, kones,
 	  _zeros_prob * (szeros / kzeros),
 	  _ones_prob * (sones / kones),
@@ -1358,7 +3007,6 @@ GLMNetwork::approx_log_likelihood()
 {
   set_dir_exp(_gamma, _Elogpi);
   const double * const alphad = _alpha.const_data();
-  const double ** const elogpid = _Elogpi.const_data();
   const double ** const gd = _gamma.const_data();
 
   double s = .0, s1 = .0;
@@ -1369,9 +3017,10 @@ GLMNetwork::approx_log_likelihood()
       v += gsl_sf_lngamma(alphad[k]);
     s += gsl_sf_lngamma(_alpha.sum()) - v;
     
+    const double *elogpid = elogpi(p);
     v = .0;
     for (uint32_t k = 0; k < _k; ++k) {
-      v += (alphad[k] - 1) * elogpid[p][k];
+      v += (alphad[k] - 1) * elogpid[k];
     }
     s += v;
 
@@ -1382,7 +3031,7 @@ GLMNetwork::approx_log_likelihood()
 
     v = .0;
     for (uint32_t k = 0; k < _k; ++k)
-      v += (gd[p][k] - 1) * elogpid[p][k];
+      v += (gd[p][k] - 1) * elogpid[k];
     s -= v;
 
     // theta
@@ -1435,9 +3084,11 @@ GLMNetwork::approx_log_likelihood()
       debug("w = %f\n", w);
       s -= log(1 + w);
       
+      const double *elogpia = elogpi(a);
+      const double *elogpib = elogpi(b);
       for (uint32_t k1 = 0; k1 < _k; ++k1)
 	for (uint32_t k2 = 0; k2 < _k; ++k2) {
-	  s += phid[k1][k2] * (elogpid[a][k1] + elogpid[b][k2]);
+	  s += phid[k1][k2] * (elogpia[k1] + elogpib[k2]);
 	  if (phid[k1][k2] > .0)
 	    s -= phid[k1][k2] * log(phid[k1][k2]);
 	}
@@ -1534,15 +3185,24 @@ GLMNetwork::get_random_edge(bool link, Edge &e) const
     e.second = 0;
 
     do {
-      e.first = gsl_rng_uniform_int(_r, _n);
-      e.second = gsl_rng_uniform_int(_r, _n);
+      if (_env.crng) {
+	e.first = _heldout_rng.uniform_int(_n);
+	e.second = _heldout_rng.uniform_int(_n);
+      } else {
+	e.first = gsl_rng_uniform_int(_r, _n);
+	e.second = gsl_rng_uniform_int(_r, _n);
+      }
       Network::order_edge(_env, e);
       assert(e.first == e.second || Network::check_edge_order(e));
     } while (!edge_ok(e));
   } else {
     do {
       const EdgeList &edges = _network.edges();
-      int m  = gsl_rng_uniform_int(_r, _network.ones());
+      int m;
+      if (_env.crng)
+	m = _heldout_rng.uniform_int(_network.ones());
+      else
+	m = gsl_rng_uniform_int(_r, _network.ones());
       e = edges[m];
       assert(Network::check_edge_order(e));
     } while (!edge_ok(e));
@@ -1550,38 +3210,47 @@ GLMNetwork::get_random_edge(bool link, Edge &e) const
 }
 
 void
-GLMNetwork::compute_and_log_groups()
+GLMNetwork::compute_and_log_groups(const ModelView &v)
 {
-  Matrix fmap(_n,_k);
-  double **fmapd = fmap.data();
-
-  _communities.clear();
   uint32_t unlikely = 0;
   uint32_t c = 0;
-  Array pi_i(_k);
-  FILE *f = fopen(Env::file_str("/network.gml").c_str(), "w");
-  fprintf(f, "graph\n[\n\tdirected 0\n");
-  fflush(f);
+  OutFile f;
+  if (f.open(Env::file_str("/network.gml")) < 0)
+    return;
+  f.put("graph\n[\n\tdirected 0\n");
+  f.put_rows(ModelRows(*this, v, ModelRows::GML_NODES), _n, nthreads());
 
+  GroupCounts counts(_network, _n, _k);
+  MapVec communities;
+  c = find_communities(v, counts, communities, &f);
+  printf("unlikely = %d\n", unlikely);
+  fflush(stdout);
+  printf("c = %d\n", c);
+  fflush(stdout);
+  write_communities(communities, "/communities.txt");
+  f.close();
 
-  for (uint32_t i = 0; i < _n; ++i) {
-    const IDMap &m = _network.seq2id();
-    IDMap::const_iterator idt = m.find(i);
+  if (_env.nmi) 
+    compute_mutual(v.iter(), communities);
+}
 
-    assert (idt != m.end());
-    fprintf(f, "\tnode\n\t[\n");
-    fprintf(f, "\t\tid %d\n", i);
-    fprintf(f, "\t\textid %d\n", idt->second);
-    fprintf(f, "\t\tpopularity %.5f\n", exp(_lambda[i]));
-    fprintf(f, "\t\tgroup %d\n", most_likely_group(i));
-    fprintf(f, "\t]\n");
-    fflush(f);
-  }
+//
+// Assigns each link to the community most likely to have produced
+// it, and collects the endpoints of links above -link-thresh into
+// communities. With gml, the links are also written to network.gml.
+//
+uint32_t
+GLMNetwork::find_communities(const ModelView &v, GroupCounts &counts,
+			     MapVec &communities, OutFile *gml)
+{
+  Array pi_i(_k), pi_m(_k);
+  uint32_t c = 0;
 
+  communities.clear();
+  counts.clear();
   for (uint32_t i = 0; i < _n; ++i) {
-    _pi.slice(0, i, pi_i);
+    const double *pii = v.pi_row(i, pi_i);
     
-    Array pi_m(_k);
     const vector<uint32_t> *edges = _network.get_edges(i);
 
     for (uint32_t e = 0; e < edges->size(); ++e) {
@@ -1591,40 +3260,32 @@ GLMNetwork::compute_and_log_groups()
 	assert  (y == 1);
 	c++;
 	
-	_pi.slice(0, m, pi_m);
+	const double *pim = v.pi_row(m, pi_m);
 	uint32_t max_k = 65535;
-	double max = find_max_k(i, m, pi_i, pi_m, max_k);
+	double max = find_max_k(i, m, pii, pim, v, max_k);
 
 	
-	fmapd[i][max_k]++;
-	fmapd[m][max_k]++;
+	uint32_t ci = counts.add(i, max_k);
+	uint32_t cm = counts.add(m, max_k);
 
 	if (max > _env.link_thresh) {
-	  if (fmapd[i][max_k] > _env.lt_min_deg)
-	    _communities[max_k].push_back(i);
-	  if (fmapd[m][max_k] > _env.lt_min_deg)
-	    _communities[max_k].push_back(m);
+	  if (ci > _env.lt_min_deg)
+	    communities[max_k].push_back(i);
+	  if (cm > _env.lt_min_deg)
+	    communities[max_k].push_back(m);
 	}
 	
-	fprintf(f, "\tedge\n\t[\n");
-	fprintf(f, "\t\tsource %d\n", i);
-	fprintf(f, "\t\ttarget %d\n", m);
-	fprintf(f, "\t\tcolor %d\n", max_k);
-	fprintf(f, "\t]\n");
-	fflush(f);
+	if (gml) {
+	  gml->put("\tedge\n\t[\n\t\tsource ").put_uint(i);
+	  gml->put("\n\t\ttarget ").put_uint(m);
+	  gml->put("\n\t\tcolor ").put_uint(max_k);
+	  gml->put("\n\t]\n");
+	}
 	c++;
       }
     }
   }
-  printf("unlikely = %d\n", unlikely);
-  fflush(stdout);
-  printf("c = %d\n", c);
-  fflush(stdout);
-  write_communities(_communities, "/communities.txt");
-  fclose(f);
-
-  if (_env.nmi) 
-    compute_mutual("/communities.txt");
+  return c;
 }
 
 
@@ -1641,27 +3302,25 @@ GLMNetwork::write_nodemap(FILE *f, NodeMap &mp)
 }
 
 void
-GLMNetwork::compute_mutual(string s)
+GLMNetwork::compute_mutual(uint32_t iter, const MapVec &communities)
 {
-  char cmd[1024];
-  sprintf(cmd, "/usr/local/bin/mutual %s %s >> %s",
-	  Env::file_str("/ground_truth.txt").c_str(),
-	  Env::file_str(s.c_str()).c_str(),
-	  Env::file_str("/mutual.txt").c_str());
-  if (system(cmd) < 0)
-    lerr("error spawning cmd %s:%s", cmd, strerror(errno));
+  double nmi = overlapping_nmi(communities, _network.gt_communities_seq());
+  FILE *f = fopen(Env::file_str("/mutual.txt").c_str(), "a");
+  fprintf(f, "%d\t%d\t%.6f\n", iter, duration(), nmi);
+  fclose(f);
 }
 
 double
 GLMNetwork::find_max_k(uint32_t i, uint32_t j, 
-		       Array &pi_i, Array &pi_j, uint32_t &max_k)
+		       const double *pi_i, const double *pi_j,
+		       const ModelView &v, uint32_t &max_k)
 {
   double max = .0;
   double s = .0;
   for (uint32_t k = 0; k < _k; ++k) {
-    double logodds = _mu[k] + _lambda[i] + _lambda[j];
+    double logodds = v.mu(k) + v.lambda(i) + v.lambda(j);
     debug("mu=%.3f, lambda i=%3f, lambda j=%3f, pi i=%.3f, pi j=%.3f\n", 
-	  _mu[k], _lambda[i], _lambda[j], pi_i[k], pi_j[k]);
+	  v.mu(k), v.lambda(i), v.lambda(j), pi_i[k], pi_j[k]);
     // apply logit-inverse function
     double l = (1.0 / (1 + exp(-logodds))) * pi_i[k] * pi_j[k];
     s += l;
@@ -1674,75 +3333,578 @@ GLMNetwork::find_max_k(uint32_t i, uint32_t j,
 }
 
 
+//
+// A pair (n,m) is ranked if it is either a test link or a 0 in
+// training (however, validation links are also a 0 in training; we
+// must skip them). The pairs each query node skips and its test
+// pairs are collected here once, from the node's adjacency list and
+// one pass over each heldout map, instead of looking up every
+// candidate in the maps at each ranking.
+//
+void
+GLMNetwork::init_rank_queries()
+{
+  _rank_queries.clear();
+  _rank_queries.reserve(_sampled_nodes.size());
+  vector<uint32_t> slot(_n, (uint32_t)-1);
+  for (NodeMap::const_iterator itr = _sampled_nodes.begin();
+       itr != _sampled_nodes.end(); ++itr) {
+    slot[itr->first] = _rank_queries.size();
+    _rank_queries.push_back(RankQuery(itr->first));
+  }
+
+  typedef std::pair<uint32_t, yval_t> Test;
+  vector<vector<Test> > tests(_rank_queries.size());
+  for (SampleMap::const_iterator i = _precision_map.begin();
+       i != _precision_map.end(); ++i) {
+    const Edge &e = i->first;
+    if (slot[e.first] != (uint32_t)-1)
+      tests[slot[e.first]].push_back(Test(e.second, i->second));
+    if (_env.undirected && slot[e.second] != (uint32_t)-1)
+      tests[slot[e.second]].push_back(Test(e.first, i->second));
+  }
+  for (SampleMap::const_iterator i = _heldout_map.begin();
+       i != _heldout_map.end(); ++i) {
+    const Edge &e = i->first;
+    if (slot[e.first] != (uint32_t)-1)
+      _rank_queries[slot[e.first]].skip.push_back(e.second);
+    if (_env.undirected && slot[e.second] != (uint32_t)-1)
+      _rank_queries[slot[e.second]].skip.push_back(e.first);
+  }
+
+  uint64_t nskip = 0;
+  for (uint32_t i = 0; i < _rank_queries.size(); ++i) {
+    RankQuery &r = _rank_queries[i];
+    vector<Test> &t = tests[i];
+    std::sort(t.begin(), t.end());
+    r.test.resize(t.size());
+    r.test_y.resize(t.size());
+    for (uint32_t j = 0; j < t.size(); ++j) {
+      r.test[j] = t[j].first;
+      r.test_y[j] = t[j].second;
+    }
+
+    r.skip.push_back(r.node);
+    const vector<uint32_t> *v = _network.get_edges(r.node);
+    if (v)
+      for (uint32_t j = 0; j < v->size(); ++j)
+	if (!std::binary_search(r.test.begin(), r.test.end(), (*v)[j]))
+	  r.skip.push_back((*v)[j]);
+    std::sort(r.skip.begin(), r.skip.end());
+    r.skip.erase(std::unique(r.skip.begin(), r.skip.end()), r.skip.end());
+    nskip += r.skip.size();
+  }
+  if (_rank_queries.size() > 0)
+    Env::plog("avg candidates skipped per query node",
+	      (double)nskip / _rank_queries.size());
+}
+
+RankingThread::RankingThread(const GLMNetwork &glm,
+			     const vector<RankQuery> &queries,
+			     const vector<uint32_t> &mine, uint32_t topN,
+			     vector<vector<KV> > &results,
+			     const LinkIndex *index, const LinkModel *model,
+			     const LinkBlockScorer *scorer)
+  : _glm(glm), _queries(queries), _mine(mine),
+    _results(results), _top(topN), _index(index), _model(model),
+    _scorer(scorer), _scored(0)
+{
+  if (_index)
+    _seen.resize(_glm._n, 0);
+}
+
+int
+RankingThread::do_work()
+{
+  if (_scorer) {
+    rank_blocks();
+    return 0;
+  }
+
+  uint32_t n = _glm._n;
+  for (uint32_t j = 0; j < _mine.size(); ++j) {
+    uint32_t i = _mine[j];
+    const RankQuery &query = _queries[i];
+    uint32_t p = query.node;
+    _top.clear();
+    if (_index)
+      _scored += _index->top(p, _top, _seen, i + 1, query);
+    else {
+      // score [m, skip[s]) and step over skip[s]
+      const vector<uint32_t> &skip = query.skip;
+      uint32_t m = 0;
+      for (uint32_t s = 0; s <= skip.size(); ++s) {
+	uint32_t end = s < skip.size() ? skip[s] : n;
+	_scored += end - m;
+	for (; m < end; ++m) {
+	  double u;
+	  if (_model)
+	    u = _model->link_prob(p, m);
+	  else {
+	    double a1 = 0, a2 = 0;
+	    double l1 = 0, l2 = 0;
+	    u = _glm.link_prob(p, m, a1, a2, l1, l2);
+	  }
+	  _top.push(m, u);
+	}
+	m = end + 1;
+      }
+    }
+    _top.sorted(_results[i]);
+  }
+  return 0;
+}
+
+// scores this thread's queries a block at a time, then keeps the
+// top N of each row, stepping over its skipped candidates
+void
+RankingThread::rank_blocks()
+{
+  uint32_t n = _glm._n;
+  uint32_t bs = _scorer->block_size();
+  vector<uint32_t> block, nodes;
+  for (uint32_t j = 0; j < _mine.size(); ) {
+    block.clear();
+    nodes.clear();
+    for (; j < _mine.size() && block.size() < bs; ++j) {
+      block.push_back(_mine[j]);
+      nodes.push_back(_queries[_mine[j]].node);
+    }
+    _scorer->score(&nodes[0], nodes.size(), _out, _ws);
+
+    for (uint32_t b = 0; b < block.size(); ++b) {
+      const vector<uint32_t> &skip = _queries[block[b]].skip;
+      const double *row = &_out[(uint64_t)b * n];
+      _top.clear();
+      uint32_t m = 0;
+      for (uint32_t s = 0; s <= skip.size(); ++s) {
+	uint32_t end = s < skip.size() ? skip[s] : n;
+	_scored += end - m;
+	for (; m < end; ++m)
+	  _top.push(m, row[m]);
+	m = end + 1;
+      }
+      _top.sorted(_results[block[b]]);
+    }
+  }
+}
+
+LinkModel *
+GLMNetwork::link_model() const
+{
+  LinkModel *m = new LinkModel(_n, _k, _env.globalmu);
+  Array pi_p(_k);
+  double **pid = m->_pi.data();
+  for (uint32_t p = 0; p < _n; ++p) {
+    estimate_pi(p, pi_p);
+    for (uint32_t k = 0; k < _k; ++k)
+      pid[p][k] = pi_p[k];
+    m->_lambda[p] = _lambda[p];
+    IDMap::const_iterator itr = _network.seq2id().find(p);
+    if (itr != _network.seq2id().end()) {
+      m->_seq2id[p] = itr->second;
+      m->_id2seq[itr->second] = p;
+    }
+  }
+  for (uint32_t k = 0; k < _k; ++k)
+    m->_mu[k] = _mu[k];
+  m->_globalmu = _globalmu;
+  m->_epsilon = _epsilon;
+  return m;
+}
+
+// the training pi, lambda and mu, as estimate_pi() last left pi
+LinkParams
+GLMNetwork::link_params() const
+{
+  assert(!_env.lazy_pi);
+  LinkParams lp;
+  lp.n = _n;
+  lp.k = _k;
+  lp.pi = _pi.const_data();
+  lp.lambda = _lambda.const_data();
+  lp.mu = _mu.const_data();
+  lp.globalmu = _globalmu;
+  lp.epsilon = _epsilon;
+  lp.globalmu_on = _env.globalmu;
+  return lp;
+}
+
+// copies pi, lambda and mu into m; the id maps are left alone
+void
+GLMNetwork::snapshot(LinkModel &m) const
+{
+  const double ** const gd = _gamma.const_data();
+  double **pid = m._pi.data();
+  for (uint32_t p = 0; p < _n; ++p) {
+    double s = .0;
+    for (uint32_t k = 0; k < _k; ++k)
+      s += gd[p][k];
+    assert(s);
+    for (uint32_t k = 0; k < _k; ++k)
+      pid[p][k] = gd[p][k] / s;
+    m._lambda[p] = _lambda[p];
+  }
+  for (uint32_t k = 0; k < _k; ++k)
+    m._mu[k] = _mu[k];
+  m._globalmu = _globalmu;
+  m._epsilon = _epsilon;
+}
+
+//
+// Evaluates a snapshot taken at iteration iter; runs on the
+// EvalThread. Returns true if the heldout likelihood asks training to
+// stop.
+//
+bool
+GLMNetwork::evaluate(const LinkModel &m, uint32_t iter,
+		     bool precision, bool save_ranking)
+{
+  bool stop = false;
+  heldout_likelihood(iter, &m, stop);
+  if (precision) {
+    lerr("iteration:%d, save precision", iter);
+    precision_likelihood(iter, &m);
+    _save_ranking_file = save_ranking;
+    write_ranking_file(&m);
+    _save_ranking_file = false;
+    lerr("done");
+  }
+  printf("+ evaluated snapshot of iteration %d\n", iter);
+  fflush(stdout);
+  return _env.use_validation_stop && stop;
+}
+
+//
+// Hands the current parameters to the evaluator, unless an earlier
+// snapshot has already converged; training then stops as it would
+// have at that report.
+//
+void
+GLMNetwork::post_evaluation()
+{
+  if (_eval->stop_requested()) {
+    _eval->drain();
+    if (_ps)
+      _ps->stop();
+    estimate_pi();
+    do_on_stop();
+    exit(0);
+  }
+  _eval->post(_iter, _iter % 100 == 0, _iter % 1000 == 0);
+}
+
+EvalThread::EvalThread(GLMNetwork &glm)
+  : _glm(glm), _busy(-1), _pending(-1), _exit(false), _stop(false)
+{
+  for (uint32_t i = 0; i < 2; ++i)
+    _buf[i] = new LinkModel(glm._n, glm._k, glm._env.globalmu);
+}
+
+EvalThread::~EvalThread()
+{
+  for (uint32_t i = 0; i < 2; ++i)
+    delete _buf[i];
+}
+
+int
+EvalThread::do_work()
+{
+  for (;;) {
+    _cm.lock();
+    while (_pending < 0 && !_exit)
+      _cm.wait();
+    if (_pending < 0) {
+      _cm.unlock();
+      break;
+    }
+    _busy = _pending;
+    _pending = -1;
+    Job job = _job[_busy];
+    _cm.unlock();
+
+    bool stop = _glm.evaluate(*_buf[_busy], job.iter,
+			      job.precision, job.save_ranking);
+
+    _cm.lock();
+    _busy = -1;
+    if (stop)
+      _stop = true;
+    _cm.broadcast();
+    _cm.unlock();
+  }
+  return 0;
+}
+
+void
+EvalThread::post(uint32_t iter, bool precision, bool save_ranking)
+{
+  _cm.lock();
+  // a snapshot still pending is replaced, wherever the worker is
+  int b = _pending >= 0 ? _pending : (_busy == 0 ? 1 : 0);
+  if (_pending == b) {
+    printf("+ evaluation behind, dropping snapshot of iteration %d\n",
+	   _job[b].iter);
+    // a replaced snapshot still owes its precision and ranking run
+    precision = precision || _job[b].precision;
+    save_ranking = save_ranking || _job[b].save_ranking;
+    _pending = -1;
+  }
+  _cm.unlock();
+
+  _glm.snapshot(*_buf[b]);
+  _job[b].iter = iter;
+  _job[b].precision = precision;
+  _job[b].save_ranking = save_ranking;
+
+  _cm.lock();
+  _pending = b;
+  _cm.signal();
+  _cm.unlock();
+}
+
+// waits until every posted snapshot has been evaluated
+void
+EvalThread::drain()
+{
+  _cm.lock();
+  while (_busy >= 0 || _pending >= 0)
+    _cm.wait();
+  _cm.unlock();
+}
+
+void
+EvalThread::finish()
+{
+  _cm.lock();
+  _exit = true;
+  _cm.broadcast();
+  _cm.unlock();
+  join();
+}
+
+bool
+EvalThread::stop_requested()
+{
+  _cm.lock();
+  bool stop = _stop;
+  _cm.unlock();
+  return stop;
+}
+
+CheckpointThread::CheckpointThread(GLMNetwork &glm)
+  : _glm(glm), _busy(-1), _pending(-1), _exit(false), _need_full(false)
+{
+  _results[0] = _results[1] = false;
+}
+
+int
+CheckpointThread::do_work()
+{
+  for (;;) {
+    _cm.lock();
+    while (_pending < 0 && !_exit)
+      _cm.wait();
+    if (_pending < 0) {
+      _cm.unlock();
+      break;
+    }
+    _busy = _pending;
+    _pending = -1;
+    bool broken = _need_full;
+    bool results = _results[_busy];
+    _cm.broadcast();  // a delta may be waiting to be posted
+    _cm.unlock();
+
+    struct timeval start, end, d;
+    gettimeofday(&start, NULL);
+    CheckpointImage &img = _img[_busy];
+    string bin = Env::file_str("/checkpoint.bin");
+    string log = CheckpointFile::log_name(bin);
+    bool delta = img.header.delta();
+    int r;
+    if (delta && broken) {
+      // the record before it never reached the log
+      printf("+ skipping delta checkpoint of iteration %d\n",
+	     img.header.iter);
+      r = -1;
+    } else if (delta)
+      r = img.append(log);
+    else if ((r = img.write(bin)) == 0 && truncate(log.c_str(), 0) < 0 &&
+	     errno != ENOENT)
+      lerr("cannot truncate %s: %s", log.c_str(), strerror(errno));
+    if (r == 0) {
+      gettimeofday(&end, NULL);
+      timeval_subtract(&d, &end, &start);
+      lerr("%s checkpoint at iteration %d (%.1f MB) written in %.3f s",
+	   delta ? "delta" : "full", img.header.iter, img.header.size / 1e6,
+	   d.tv_sec + d.tv_usec / 1e6);
+    }
+    if (results)
+      _glm.save_results(img);
+    img.release();
+
+    _cm.lock();
+    if (r < 0)
+      _need_full = true;
+    _busy = -1;
+    _cm.broadcast();
+    _cm.unlock();
+  }
+  return 0;
+}
+
+void
+CheckpointThread::post(bool delta, bool results)
+{
+  _cm.lock();
+  // a delta needs every record before it on disk first
+  while (delta && _pending >= 0)
+    _cm.wait();
+  // an image still pending is replaced, wherever the writer is
+  int b = _pending >= 0 ? _pending : (_busy == 0 ? 1 : 0);
+  if (_pending == b) {
+    printf("+ checkpoint writer behind, dropping iteration %d\n",
+	   _img[b].header.iter);
+    _pending = -1;
+    results = results || _results[b];
+  }
+  _results[b] = results;
+  if (!delta)
+    _need_full = false;
+  _cm.unlock();
+
+  _glm.snapshot_checkpoint(_img[b], delta);
+
+  _cm.lock();
+  _pending = b;
+  _cm.signal();
+  _cm.unlock();
+}
+
+// waits until every posted checkpoint is on disk
+void
+CheckpointThread::drain()
+{
+  _cm.lock();
+  while (_busy >= 0 || _pending >= 0)
+    _cm.wait();
+  _cm.unlock();
+}
+
+bool
+CheckpointThread::need_full()
+{
+  _cm.lock();
+  bool r = _need_full;
+  _cm.unlock();
+  return r;
+}
+
+void
+CheckpointThread::finish()
+{
+  _cm.lock();
+  _exit = true;
+  _cm.broadcast();
+  _cm.unlock();
+  join();
+}
+
+//
+// Ranks candidates for the precision query nodes with the training
+// parameters, or with a snapshot of them if model is given.
+//
 void
-GLMNetwork::write_ranking_file()
+GLMNetwork::write_ranking_file(const LinkModel *model)
 {
   uint32_t topN_by_user = 100;
-  uint32_t c = 0;
 
-  FILE *f = 0;
+  OutFile f;
   if (_save_ranking_file)
-    f = fopen(Env::file_str("/ranking.tsv").c_str(), "w");
-  uint32_t ntest_pairs = 0;
+    f.open(Env::file_str("/ranking.tsv"));
   printf("\n+ Precision  map size = %ld\n", _precision_map.size());
   printf("\n+ Writing ranking file for %ld nodes in query file\n", 
 	 _sampled_nodes.size());
   fflush(stdout);
 
-  double mhits10 = 0, mhits50 = 0, mhits100 = 0;
-  uint32_t total_users = 0;
-  for (NodeMap::const_iterator itr = _sampled_nodes.begin();
-       itr != _sampled_nodes.end(); ++itr) {
-    KVArray mlist(_n);  
-    uint32_t n = itr->first;
-    for (uint32_t m = 0; m < _n; ++m) {
-      
-      if (n == m) {
-	mlist[m].first = m;
-	mlist[m].second = -1;
-	continue;
-      }
-
-      Edge e(n,m);
-      Network::order_edge(_env, e);
-      //
-      // check that this pair e is either a test link or a 0 in training
-      // (however, validation links are also a 0 in training; we must skip them)
-      //
-      const SampleMap::const_iterator w = _precision_map.find(e);
-      if (w != _precision_map.end() || (w == _precision_map.end() && _network.y(n,m) == 0)) {
-	
-	const SampleMap::const_iterator v = _heldout_map.find(e);
-	if (v != _heldout_map.end()) {
-	  mlist[m].first = m;
-	  mlist[m].second = -1;
-	  continue;
-	}
-	
-	yval_t y = (w != _precision_map.end()) ? w->second : 0;
-	double a1 = 0, a2 = 0;
-	double l1 = 0, l2 = 0;
-	double u = link_prob(n,m, a1,a2,l1,l2);
-	mlist[m].first = m;
-	mlist[m].second = u;
-	ntest_pairs++;
+  const vector<RankQuery> &queries = _rank_queries;
+
+  // the index reads pi where it is, from the model or the training
+  // parameters; only -rank-gemm needs a model to copy pi from
+  LinkModel *own = NULL;
+  LinkIndex *index = NULL;
+  LinkBlockScorer *scorer = NULL;
+  if (_env.rank_gemm) {
+    if (!model)
+      model = own = link_model();
+    scorer = new LinkBlockScorer(*model);
+    if (scorer->build() < 0) {
+      lerr("-rank-gemm: %d of %d communities have a mu of their own; "
+	   "ranking without it", scorer->ngroups(), _k);
+      delete scorer;
+      scorer = NULL;
+    }
+  }
+  if (!scorer && !_env.rank_scan) {
+    index = new LinkIndex(model ? model->params() : link_params());
+    index->build();
+  }
 
-      } else {
-	mlist[m].first = m;
-	mlist[m].second = -1;
-      }
+  vector<vector<KV> > results(queries.size());
+  uint64_t scored = 0;
+  uint32_t nt = nthreads();
+  if (nt > queries.size())
+    nt = queries.size();
+  if (nt < 1)
+    nt = 1;
+  // with -numa, each query goes to a worker on the NUMA node its row
+  // was placed on
+  vector<uint32_t> qnuma;
+  if (_env.numa && NUMA::nnodes() > 1)
+    for (uint32_t i = 0; i < queries.size(); ++i)
+      qnuma.push_back(NUMA::node_of(_n, queries[i].node));
+  vector<vector<uint32_t> > mine;
+  split_work(qnuma.empty() ? NULL : &qnuma, queries.size(), nt, mine);
+
+  if (nt <= 1) {
+    RankingThread t(*this, queries, mine[0], topN_by_user, results,
+		    index, model, scorer);
+    t.do_work();
+    scored = t.scored();
+  } else {
+    vector<RankingThread *> threads(nt);
+    for (uint32_t i = 0; i < nt; ++i) {
+      threads[i] = new RankingThread(*this, queries, mine[i],
+				     topN_by_user, results, index, model,
+				     scorer);
+      start_worker(threads[i], i, nt);
+    }
+    for (uint32_t i = 0; i < nt; ++i) {
+      threads[i]->join();
+      scored += threads[i]->scored();
+      delete threads[i];
     }
+  }
+  delete index;
+  delete scorer;
+  if (queries.size() > 0)
+    printf("+ scored %.2f%% of candidate pairs\n",
+	   100.0 * scored / ((double)queries.size() * _n));
+
+  double mhits10 = 0, mhits50 = 0, mhits100 = 0;
+  uint32_t total_users = 0;
+  for (uint32_t i = 0; i < queries.size(); ++i) {
+    const RankQuery &query = queries[i];
+    uint32_t n = query.node;
+    const vector<KV> &mlist = results[i];
 
     uint32_t hits10 = 0, hits100 = 0, hits50 = 0;
-    mlist.sort_by_value();
     for (uint32_t j = 0; j < topN_by_user && j < mlist.size(); ++j) {
-      KV &kv = mlist[j];
+      const KV &kv = mlist[j];
       uint32_t m = kv.first;
       double pred = kv.second;
 
-      if (pred < 0)
-	continue;
-
       uint32_t m2 = 0, n2 = 0;
 
       IDMap::const_iterator it = _network.seq2id().find(n);
@@ -1754,13 +3916,8 @@ GLMNetwork::write_ranking_file()
       m2 = mt->second;
       n2 = it->second;
 
-      //printf("n = %d (%d), m = %d (%d), pred = %.5f \n", n2, n, m2, m, pred);
       yval_t  actual_value = 0;
-      Edge e(n,m);
-      Network::order_edge(_env, e);
-      const SampleMap::const_iterator w = _precision_map.find(e);
-      if (w != _precision_map.end()) {
-	actual_value = w->second;
+      if (query.test_value(m, actual_value)) {
 	if (j < 10) {
 	  hits10++;
 	  hits50++;
@@ -1771,18 +3928,22 @@ GLMNetwork::write_ranking_file()
 	} else if (j < 100)
 	  hits100++;
       }
-      if (_save_ranking_file)
-	fprintf(f, "%d\t%d\t%.5f\t%d\t%.5f\n", n2, m2, pred, 
-		actual_value, pair_likelihood2(n,m,actual_value));
+      if (f.is_open()) {
+	f.put_uint(n2).put('\t').put_uint(m2).put('\t').put_fixed(pred, 5);
+	f.put('\t').put_uint(actual_value).put('\t');
+	f.put_fixed(model ? model->pair_likelihood(n,m,actual_value) :
+		    pair_likelihood2(n,m,actual_value), 5).put('\n');
+      }
     }
     mhits10 += (double)hits10 / 10;
     mhits50 += (double)hits50 / 50;
     mhits100 += (double)hits100 / 100;
     total_users++;
-    printf("\r done %d", total_users);
   }
-  if (_save_ranking_file)
-    fclose(f);
+  printf("\r done %d", total_users);
+  if (f.is_open())
+    f.close();
+  delete own;
   fprintf(_pf, "%.5f\t%.5f\t%.5f\n", 
 	  (double)mhits10 / total_users, 
 	  (double)mhits50 / total_users, 
@@ -1835,7 +3996,9 @@ void
 GLMNetwork::write_communities(MapVec &communities, string name)
 {
   const IDMap &seq2id = _network.seq2id();
-  FILE *commf = fopen(Env::file_str(name.c_str()).c_str(), "w");
+  OutFile commf;
+  if (commf.open(Env::file_str(name.c_str())) < 0)
+    return;
   //FILE *sizef = fopen(Env::file_str("/communities_size.txt").c_str(), "a");
   map<uint32_t, uint32_t> count;
   for (std::map<uint32_t, vector<uint32_t> >::const_iterator i = communities.begin();
@@ -1867,11 +4030,11 @@ GLMNetwork::write_communities(MapVec &communities, string name)
       vids[j] = ids[j];
     vids.sort();
     for (uint32_t j = 0; j < vids.size(); ++j)
-      fprintf(commf, "%d ", vids[j]);
+      commf.put_uint(vids[j]).put(' ');
 
-    fprintf(commf, "\n");
+    commf.put('\n');
     //fprintf(sizef, "%d\t%ld\n", i->first, uniq.size());
   }
-  fclose(commf);
+  commf.close();
 }
 
@@ -3,6 +3,7 @@
 
 #include <list>
 #include <utility>
+#include <algorithm>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -12,6 +13,13 @@
 #include "network.hh"
 #include "thread.hh"
 #include "tsqueue.hh"
+#include "rng.hh"
+#include "affinity.hh"
+#include "ps.hh"
+#include "linkmodel.hh"
+#include "nmi.hh"
+#include "checkpoint.hh"
+#include "outfile.hh"
 
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
@@ -24,6 +32,7 @@
 #define GAMMA_ADAGRAD 1
 
 class GLMNetwork;
+class PairLayout;
 class LocalCompute {
 public:
   LocalCompute(const Env &env, GLMNetwork &glm);
@@ -57,6 +66,519 @@ private:
   double _log_XS;
 };
 
+//
+// likelihood sums over a list of heldout/test pairs
+//
+class PairSums {
+public:
+  PairSums() { reset(); }
+
+  void reset();
+  void add(yval_t y, double u);
+  void add(const PairSums &b);
+  void adjust(yval_t y, double d);
+
+  double s;
+  double szeros;
+  double sones;
+  uint32_t k;
+  uint32_t kzeros;
+  uint32_t kones;
+
+private:
+  // Kahan compensation terms
+  double _cs;
+  double _czeros;
+  double _cones;
+};
+
+//
+// Stratified subsample of the heldout pairs (-heldout-sample). Links
+// and non-links are each shuffled once and the sample is a prefix of
+// both, so a grown sample contains the old one. The last likelihood
+// of every sampled pair is kept, and successive reports are compared
+// pair by pair over the pairs both have scored. Standard errors
+// include the finite population correction, so they are zero once a
+// stratum is sampled in full.
+//
+class HeldoutSample {
+public:
+  HeldoutSample(const SampleList &all, uint32_t size, uint64_t seed);
+  ~HeldoutSample() { }
+
+  const SampleList &pairs() const { return _pairs; }
+  bool full() const;
+  void grow();
+
+  double stderror(const Array &lik, double w0, double w1) const;
+  bool change(const Array &lik, double w0, double w1,
+	      double &d, double &se) const;
+  void update(const Array &lik);
+
+private:
+  void build();
+  void stratum_stats(const Array &lik, uint32_t y, bool diff,
+		     uint32_t &n, double &mean, double &var) const;
+
+  const SampleList &_all;
+  vector<uint32_t> _order[2]; // indices into _all, by y
+  uint32_t _size[2];
+  SampleList _pairs;          // non-link prefix, then link prefix
+  vector<double> _prev[2];
+};
+
+//
+// A set of nodes, each listed once in the order it was added, that
+// is emptied in O(1): a node is in the set if its stamp is the
+// current epoch, and clear() starts the next one.
+//
+class NodeSet {
+public:
+  NodeSet(uint32_t n): _stamp(n, 0), _epoch(1) { }
+
+  bool insert(uint32_t n);   // false if n was already in the set
+  bool has(uint32_t n) const { return _stamp[n] == _epoch; }
+  uint32_t size() const { return _nodes.size(); }
+  const vector<uint32_t> &nodes() const { return _nodes; }
+  void sort() { std::sort(_nodes.begin(), _nodes.end()); }
+  void clear();
+
+private:
+  vector<uint32_t> _stamp;
+  uint32_t _epoch;
+  vector<uint32_t> _nodes;
+};
+
+//
+// Heldout pair likelihoods kept between reports (-heldout-incr tol).
+// Between reports only the gamma and lambda rows update_node()
+// touches change, and those nodes are marked dirty; a report rescores
+// the pairs with a dirty endpoint, found through a node -> pair
+// index, and moves the sums by the difference. Pairs with no dirty
+// endpoint keep the mu they were scored with, so all pairs are
+// rescored once mu has moved more than tol since the last full pass.
+//
+class HeldoutCache {
+public:
+  HeldoutCache(const SampleList &pairs, uint32_t n, uint32_t k);
+  ~HeldoutCache() { }
+
+  void mark(uint32_t node);
+  void invalidate() { _valid = false; }
+  bool stale(const Array &mu, double globalmu, double tol) const;
+  void reset(const PairSums &sums, const Array &lik,
+	     const Array &mu, double globalmu);
+  void affected(SampleList &pairs, vector<uint32_t> &which);
+  void apply(const vector<uint32_t> &which, const Array &lik);
+
+  const PairSums &sums() const { return _sums; }
+  const Array &lik() const { return _lik; }
+  uint32_t ndirty() const { return _dirty.size(); }
+
+private:
+  const SampleList &_pairs;
+  vector<uint32_t> _start;  // pairs of node n: _index[_start[n].._start[n+1])
+  vector<uint32_t> _index;
+  NodeSet _dirty;
+  vector<uint32_t> _stamp;
+  uint32_t _epoch;
+
+  bool _valid;
+  PairSums _sums;
+  Array _lik;
+  Array _mu;       // mu at the last full pass
+  double _globalmu;
+};
+
+//
+// Area under the ROC and precision-recall curves for a pair list,
+// computed with one sort by decreasing link probability. The
+// probabilities come from the pair log likelihoods, so pairs are not
+// scored a second time. Pairs with the same score share a threshold:
+// for ROC each of them counts as half above the others in the group,
+// and for precision-recall the group counts as a single step.
+//
+class PairAUC {
+public:
+  PairAUC(): roc(.0), pr(.0) { }
+
+  void compute(const SampleList &pairs, const Array &lik);
+
+  double roc;
+  double pr;  // average precision
+};
+
+//
+// Evaluates pair_likelihood2() over some blocks of a SampleList. The
+// list is cut into fixed-size blocks that do not depend on the number
+// of threads; each thread takes the blocks split_work() deals it and
+// the caller combines the block sums in block order, so the reduction
+// is the same for any -nthreads. With a layout (-numa), the blocks
+// are cut from the layout's order instead of the list's. With a
+// model, pairs are scored against it instead of the training
+// parameters.
+//
+class PairEvalThread : public Thread {
+public:
+  PairEvalThread(const GLMNetwork &glm, const SampleList &pairs,
+		 const vector<uint32_t> &mine,
+		 vector<PairSums> &blocks, Array *lik,
+		 const LinkModel *model = NULL,
+		 const PairLayout *layout = NULL);
+  ~PairEvalThread() { }
+
+  int do_work();
+
+  static const uint32_t BLOCK_SIZE = 1024;
+  static uint32_t nblocks(uint32_t npairs);
+
+private:
+  const GLMNetwork &_glm;
+  const SampleList &_pairs;
+  const vector<uint32_t> &_mine;
+  vector<PairSums> &_blocks;
+  Array *_lik;
+  const LinkModel *_model;
+  const PairLayout *_layout;
+};
+
+//
+// With -numa, the order pairs are evaluated in: grouped by the NUMA
+// node owning their first node, each group cut into blocks of its
+// own, so the rows a block reads first live on its NUMA node. The
+// block sums then add up in an order that depends on the number of
+// NUMA nodes but not on -nthreads.
+//
+class PairLayout {
+public:
+  PairLayout(const SampleList &pairs, uint32_t n);
+
+  uint32_t nblocks() const { return numa.size(); }
+
+  vector<uint32_t> order;   // pair indices, NUMA node by NUMA node
+  vector<uint32_t> start;   // block b is order[start[b]..start[b+1])
+  vector<uint32_t> numa;    // the NUMA node of each block
+};
+
+//
+// What write_ranking_file() needs to know about one query node, built
+// once from the training links and the heldout sets: the candidates
+// it never ranks (the node itself, its training links that are not
+// test pairs, and its validation pairs) and its test pairs with their
+// values, each sorted by node.
+//
+class RankQuery {
+public:
+  RankQuery(uint32_t p = 0): node(p) { }
+
+  bool rank_candidate(uint32_t q) const;
+  bool test_value(uint32_t q, yval_t &y) const;
+
+  uint32_t node;
+  vector<uint32_t> skip;
+  vector<uint32_t> test;
+  vector<yval_t> test_y;
+};
+
+//
+// Ranks all candidates for the query nodes split_work() deals the
+// thread; results are stored per query so the caller can write them
+// out in query order. With an index, only the candidates it cannot
+// rule out are scored; with a block scorer, the thread's queries are
+// scored in blocks against all nodes; otherwise the candidates
+// between two skipped nodes are scored in a plain loop, against the
+// model if there is one and the training parameters otherwise.
+//
+class RankingThread : public Thread {
+public:
+  RankingThread(const GLMNetwork &glm, const vector<RankQuery> &queries,
+		const vector<uint32_t> &mine, uint32_t topN,
+		vector<vector<KV> > &results,
+		const LinkIndex *index = NULL,
+		const LinkModel *model = NULL,
+		const LinkBlockScorer *scorer = NULL);
+  ~RankingThread() { }
+
+  int do_work();
+  uint64_t scored() const { return _scored; }
+
+private:
+  void rank_blocks();
+
+  const GLMNetwork &_glm;
+  const vector<RankQuery> &_queries;
+  const vector<uint32_t> &_mine;
+  vector<vector<KV> > &_results;
+  TopN _top;
+  const LinkIndex *_index;
+  const LinkModel *_model;
+  const LinkBlockScorer *_scorer;
+  vector<uint32_t> _seen;
+  vector<double> _out;
+  vector<double> _ws;
+  uint64_t _scored;
+};
+
+//
+// Background evaluation (-async-eval). At each report the training
+// loop copies pi, lambda and mu into one of two LinkModel buffers and
+// posts it; this thread runs the heldout, precision and ranking
+// evaluation on the snapshot while training continues, and logs the
+// results under the iteration the snapshot was taken at. The
+// training loop only fills the buffer the evaluator is not reading;
+// a snapshot still waiting when the next one is posted is replaced.
+//
+class EvalThread : public Thread {
+public:
+  EvalThread(GLMNetwork &glm);
+  ~EvalThread();
+
+  int do_work();
+  void post(uint32_t iter, bool precision, bool save_ranking);
+  void drain();
+  void finish();
+  bool stop_requested();
+
+private:
+  class Job {
+  public:
+    Job(): iter(0), precision(false), save_ranking(false) { }
+    uint32_t iter;
+    bool precision;
+    bool save_ranking;
+  };
+
+  GLMNetwork &_glm;
+  CondMutex _cm;
+  LinkModel *_buf[2];
+  Job _job[2];
+  int _busy;     // buffer being evaluated, or -1
+  int _pending;  // buffer posted and not yet picked up, or -1
+  bool _exit;
+  bool _stop;    // heldout likelihood says training has converged
+};
+
+//
+// How many of each node's links went to each group, as counted by
+// find_communities(). A node has one slot per group it has links in,
+// and there are at most min(degree, K) of those, so the counts take
+// O(links) memory rather than n x K; clear() empties them for the
+// next pass without freeing them.
+//
+class GroupCounts {
+public:
+  GroupCounts(const Network &network, uint32_t n, uint32_t k);
+
+  uint32_t add(uint32_t n, uint32_t g);   // the count after adding
+  void clear() { std::fill(_used.begin(), _used.end(), 0); }
+
+private:
+  vector<uint64_t> _start;  // slots of node n: [_start[n], _start[n+1])
+  vector<uint32_t> _used;
+  vector<uint32_t> _group;
+  vector<uint32_t> _count;
+};
+
+//
+// An n x K matrix with rows only for the nodes touched since the
+// last clear(). Rows live in a pool of fixed-size blocks and are
+// found through one slot per node, so the matrix takes K doubles per
+// touched node plus 4 bytes per node, and a row pointer stays valid
+// until clear(). clear() keeps the blocks, so a matrix cleared every
+// iteration stays the size of the largest minibatch.
+//
+class SparseRows {
+public:
+  SparseRows(uint32_t n, uint32_t k): _k(k), _slot(n, NONE) { }
+  ~SparseRows();
+
+  double *row(uint32_t n);              // zeroed on first touch
+  const double *find(uint32_t n) const; // NULL if not touched
+  void zero(uint32_t n);
+  void set(uint32_t n, const double *v);
+  void clear();
+  const vector<uint32_t> &nodes() const { return _nodes; }
+  uint64_t bytes() const;
+
+  static const uint32_t BLOCK_ROWS = 1024;
+  static const uint32_t NONE = (uint32_t)-1;
+
+private:
+  double *add(uint32_t n);
+
+  uint32_t _k;
+  vector<uint32_t> _slot;
+  vector<uint32_t> _nodes;   // the node of each pool row
+  vector<double *> _blocks;
+};
+
+//
+// At most a fixed number of rows of an n x K matrix whose rows are
+// computed from other state (-lazy-pi keeps E[log pi] in one). A row
+// is found through one slot per node; when none is free, the least
+// recently used row is given up. lookup() returns false if the row
+// has to be filled by the caller, and drop() forgets a row that no
+// longer holds, so the matrix takes K doubles per cached row plus 4
+// bytes per node. A row stays where lookup() put it until other rows
+// have been looked up MIN_ROWS - 1 times. Not thread-safe.
+//
+class RowCache {
+public:
+  RowCache(uint32_t n, uint32_t k, uint32_t rows);
+  ~RowCache() { }
+
+  bool lookup(uint32_t n, double *&row);
+  void drop(uint32_t n);
+  void clear();
+  uint32_t rows() const { return _node.size(); }
+  uint64_t hits() const { return _hits; }
+  uint64_t misses() const { return _misses; }
+  uint64_t bytes() const;
+
+  static const uint32_t MIN_ROWS = 16;
+  static const uint32_t NONE = (uint32_t)-1;
+
+private:
+  void unlink(uint32_t e);
+  void push_front(uint32_t e);
+  void push_back(uint32_t e);
+
+  uint32_t _k;
+  vector<uint32_t> _slot;
+  vector<uint32_t> _node;    // the node of each row, or NONE
+  vector<uint32_t> _prev;    // rows from most to least recently used
+  vector<uint32_t> _next;
+  vector<double> _rows;
+  uint32_t _head;
+  uint32_t _tail;
+  uint64_t _hits;
+  uint64_t _misses;
+};
+
+//
+// Background checkpoint writer (-checkpoint, -checkpoint-delta). The
+// training loop copies its state into one of two in-memory images and
+// posts it; this thread writes a full image to checkpoint.bin, then
+// empties checkpoint.log, or appends a delta image to checkpoint.log,
+// while training continues. As with EvalThread, only the image the
+// writer is not reading is filled. A full image still waiting when
+// the next one is posted is replaced; a delta is never dropped, as
+// the records after it would not apply without it. A full image
+// posted with results also has the result files written from it; if
+// it is replaced, they are written from the image replacing it. An
+// image's buffers are freed once it is written, so between
+// checkpoints neither image takes any memory.
+//
+class CheckpointThread : public Thread {
+public:
+  CheckpointThread(GLMNetwork &glm);
+  ~CheckpointThread() { }
+
+  int do_work();
+  void post(bool delta, bool results = false);
+  void drain();
+  void finish();
+  bool need_full();
+
+private:
+  GLMNetwork &_glm;
+  CondMutex _cm;
+  CheckpointImage _img[2];
+  int _busy;     // image being written, or -1
+  int _pending;  // image posted and not yet picked up, or -1
+  bool _results[2];  // write the result files from the image too
+  bool _exit;
+  bool _need_full;  // a write failed; the chain must restart
+};
+
+//
+// Draws initial gamma rows [begin, end) from per-node random streams
+// (-crng); the rows do not depend on how nodes are split over threads.
+//
+class InitGammaThread : public Thread {
+public:
+  InitGammaThread(GLMNetwork &glm, uint32_t begin, uint32_t end)
+    : _glm(glm), _begin(begin), _end(end) { }
+  ~InitGammaThread() { }
+
+  int do_work();
+
+private:
+  GLMNetwork &_glm;
+  uint32_t _begin;
+  uint32_t _end;
+};
+
+//
+// Reallocates the node-indexed state owned by a NUMA node from a
+// thread pinned to that node (-numa).
+//
+class PlacementThread : public Thread {
+public:
+  PlacementThread(GLMNetwork &glm, uint32_t node)
+    : _glm(glm), _numa_node(node) { set_node(node); }
+  ~PlacementThread() { }
+
+  int do_work();
+
+private:
+  GLMNetwork &_glm;
+  uint32_t _numa_node;
+};
+
+//
+// The parameters the result files and communities are computed from:
+// the training state, an -async-eval snapshot, or a full checkpoint
+// image, which CheckpointThread writes the result files from while
+// training goes on. Rows of pi are normalized from gamma when there
+// is no pi to read them from (-lazy-pi, images).
+//
+class ModelView {
+public:
+  ModelView(const GLMNetwork &glm);
+  ModelView(const GLMNetwork &glm, const LinkModel &m);
+  ModelView(const GLMNetwork &glm, const CheckpointImage &img);
+  ~ModelView() { }
+
+  uint32_t iter() const { return _iter; }
+  const double *gamma(uint32_t p) const { return _gamma[p]; }
+  const double *pi_row(uint32_t p, Array &pi_p) const;
+  double lambda(uint32_t p) const { return _lambda[p]; }
+  double mu(uint32_t k) const { return _mu[k]; }
+  double globalmu() const { return _globalmu; }
+  uint32_t most_likely_group(uint32_t p) const;
+
+private:
+  uint32_t _k;
+  uint32_t _iter;
+  vector<const double *> _rows;  // of an image
+  const double * const *_gamma;
+  const double * const *_pi;
+  const double *_lambda;
+  const double *_mu;
+  double _globalmu;
+};
+
+//
+// The per-node lines of gamma.txt, groups.txt, deg.txt and the node
+// part of network.gml, for OutFile::put_rows().
+//
+class ModelRows : public RowFormatter {
+public:
+  typedef enum { GAMMA, GROUPS, POPULARITY, GML_NODES } File;
+
+  ModelRows(const GLMNetwork &glm, const ModelView &v, File file)
+    : _glm(glm), _v(v), _file(file) { }
+  ~ModelRows() { }
+
+  void format(uint32_t i, OutBuf &out) const;
+
+private:
+  const GLMNetwork &_glm;
+  const ModelView &_v;
+  File _file;
+};
+
 class GLMNetwork {
 public:
   GLMNetwork(Env &env, Network &network);
@@ -64,6 +586,8 @@ public:
 
   void gen();
   void randomnode_infer();
+  void sharded_infer();
+  void ps_evaluate();
   void randompair_infer();
   void randompair_infer_opt();
   void informative_sampling_infer();
@@ -76,6 +600,10 @@ public:
 
 private:
   void init_gamma();
+  void init_gamma(uint32_t begin, uint32_t end);
+  uint64_t seed() const { return (uint64_t)_env.seed; }
+  static bool partial_rows(const Env &env);
+  static bool ps_evaluator(const Env &env);
   void estimate_pi();
   void assign_training_links();
   void shuffle_nodes();
@@ -86,16 +614,33 @@ private:
   void opt_process_noninf(vector<uint32_t> &nodes, uint32_t &links, uint32_t &nonlinks,
 			  uint32_t &start_node);
 
-  void save_groups();
-  void save_model();
-  void save_popularity();
-  void save_mu();
+  void save_groups(const ModelView &v);
+  void save_model(const ModelView &v);
+  void save_popularity(const ModelView &v);
+  void save_mu(const ModelView &v);
+  int save_npy(const ModelView &v);
+  void save_results(const CheckpointImage &img);
+  int save_checkpoint(bool delta = false);
+  void snapshot_checkpoint(CheckpointImage &img, bool delta);
+  int load_checkpoint(string fname);
+  int load_ag_rows(const CheckpointFile &f, uint32_t r, string fname);
+  int load_checkpoint_log(string fname, uint32_t base);
+  int warm_start(string dir);
   double approx_log_likelihood();
   uint32_t duration() const;
 
   void process(uint32_t p, uint32_t q, double scale = 1.0);
+  void sample_nonlinks(uint32_t start_node, vector<Edge> &sample);
+  void update_node(uint32_t n);
+  void ps_init();
+  void ps_fetch_all();
+  void hold_row(uint32_t p);
+  void hold_remote(const vector<uint32_t> &remote);
 
   void estimate_pi(uint32_t p, Array &pi_p) const;
+  const double *pi_row(uint32_t p, Array &pi_p) const;
+  const double *elogpi(uint32_t a);
+  void dir_exp(const double *u, double *e) const;
   double pair_likelihood(uint32_t p, uint32_t q, yval_t y) const;
   double pair_likelihood2(uint32_t p, uint32_t q, yval_t y) const;
   string edgelist_s(EdgeList &elist);
@@ -107,12 +652,38 @@ private:
   void init_heldout();
   void load_heldout_sets();
 
+  void set_sample_list(const SampleMap &mp, SampleList &l);
+  uint32_t nthreads() const;
+  uint32_t worker_node(uint32_t i, uint32_t nt) const;
+  void start_worker(Thread *t, uint32_t i, uint32_t nt) const;
+  void split_work(const vector<uint32_t> *numa, uint32_t nitems,
+		  uint32_t nt, vector<vector<uint32_t> > &mine) const;
+  void numa_place();
+  void place_rows(uint32_t begin, uint32_t end);
+  void log_iteration_time();
+  void sample_likelihood(const SampleList &pairs, PairSums &sums,
+			 Array *lik = NULL,
+			 const LinkModel *model = NULL) const;
   double heldout_likelihood(bool nostop=false);
+  void log_resumed_heldout();
+  double heldout_likelihood(uint32_t iter, const LinkModel *model,
+			    bool &stop);
   double precision_likelihood(bool nostop=false);
+  double precision_likelihood(uint32_t iter, const LinkModel *model);
+  const Array &cached_heldout_likelihood(PairSums &sums);
+  void log_auc(uint32_t iter, const LinkModel *model,
+	       const SampleList &heldout, const Array &heldout_lik);
+  void snapshot(LinkModel &m) const;
+  bool evaluate(const LinkModel &m, uint32_t iter,
+		bool precision, bool save_ranking);
+  void post_evaluation();
   double link_prob(uint32_t p, uint32_t q, double &a1, double &a2,
 		   double &a3, double &a4) const;
   void write_rank();
-  void write_ranking_file();
+  void init_rank_queries();
+  void write_ranking_file(const LinkModel *model = NULL);
+  LinkModel *link_model() const;
+  LinkParams link_params() const;
   double validation_likelihood();
   double training_likelihood();
   int load_gamma();
@@ -121,16 +692,18 @@ private:
 
   void get_random_edge(bool link, Edge &e) const;
   bool edge_ok(const Edge &e) const;
-  void compute_and_log_groups();
+  void compute_and_log_groups(const ModelView &v);
   void write_communities(MapVec &communities, string name);
   void write_nodemap(FILE *f, NodeMap &mp);
-  void compute_mutual(string s);
+  uint32_t find_communities(const ModelView &v, GroupCounts &counts,
+			    MapVec &communities, OutFile *gml);
+  void compute_mutual(uint32_t iter, const MapVec &communities);
   double find_max_k(uint32_t i, uint32_t j, 
-		    Array &pi_i, Array &pi_j, uint32_t &max_k);
+		    const double *pi_i, const double *pi_j,
+		    const ModelView &v, uint32_t &max_k);
 
   yval_t get_y(uint32_t p, uint32_t q);
-  uint32_t most_likely_group(uint32_t p);
-  void do_on_stop();
+  void do_on_stop(bool wait = true);
 
   Env &_env;
   Network &_network;
@@ -161,8 +734,10 @@ private:
   AdjMatrix _y;
 
   Matrix _gamma;
-  Matrix _gammat;
-  Matrix _gammat_ag;
+  SparseRows _gammat;     // gradient of this minibatch's rows
+  SparseRows _gammat_ag;  // -gamma-adagrad sums, of nodes ever updated
+  NodeSet _sampled;       // this minibatch's start nodes
+  NodeSet _touched;       // and every node in its pairs
 
   Array _lambda;
   double _sigma_theta;
@@ -180,6 +755,7 @@ private:
   double _sigma_betat;
 
   Matrix _Elogpi;
+  RowCache *_epcache;     // -lazy-pi: E[log pi] rows, in place of _Elogpi
 
   double _rho;
   double _tau0;
@@ -207,6 +783,9 @@ private:
   FILE *_pef;
   FILE *_vef;
   FILE *_tef;
+  FILE *_itf;
+  FILE *_af;
+  struct timeval _report_tv;
 
   SampleMap _heldout_map;
   SampleMap _precision_map;
@@ -219,14 +798,38 @@ private:
   EdgeList _validation_pairs;
   EdgeList _training_pairs;
   NodeMap _sampled_nodes;
+  vector<RankQuery> _rank_queries; // in _sampled_nodes order
+
+  // flat copies of _heldout_map and _precision_map for evaluation
+  SampleList _heldout_list;
+  SampleList _precision_list;
 
   mutable uint32_t _nh;
   double _prev_h, _max_h;
 
   gsl_rng *_r;
+  mutable CRng _heldout_rng;
+  PSClient *_ps;
+  vector<uint32_t> _remote;  // other shards' rows held (partial_rows())
+  EvalThread *_eval;
+  HeldoutSample *_hs;
+  HeldoutCache *_hc;
+  GroupCounts *_nmi_counts;  // -nmi: reused by every report
+  CheckpointThread *_ckpt;
+  NodeSet *_ckpt_dirty;    // rows changed since the last checkpoint
+  bool _ckpt_based;        // a full checkpoint was taken in this run
+  uint32_t _ckpt_base;     // and the iteration of the last one
+  bool _resumed;
   friend class LocalCompute;
+  friend class PairEvalThread;
+  friend class RankingThread;
+  friend class InitGammaThread;
+  friend class PlacementThread;
+  friend class EvalThread;
+  friend class CheckpointThread;
+  friend class ModelRows;
+  friend class ModelView;
 
-  MapVec _communities;  
   MapVec _communities2;  
   MapVec _communities3;  
   MapVec _communities4;  
@@ -366,16 +969,100 @@ LocalCompute::cached_log_XS() const
   return _log_XS;
 }
 
+//
+// pair sums
+//
+
+inline void
+kahan_add(double &s, double &c, double v)
+{
+  double y = v - c;
+  double t = s + y;
+  c = (t - s) - y;
+  s = t;
+}
+
+inline void
+PairSums::reset()
+{
+  s = szeros = sones = .0;
+  k = kzeros = kones = 0;
+  _cs = _czeros = _cones = .0;
+}
+
+inline void
+PairSums::add(yval_t y, double u)
+{
+  kahan_add(s, _cs, u);
+  k++;
+  if (y) {
+    kahan_add(sones, _cones, u);
+    kones++;
+  } else {
+    kahan_add(szeros, _czeros, u);
+    kzeros++;
+  }
+}
+
+inline void
+PairSums::add(const PairSums &b)
+{
+  kahan_add(s, _cs, b.s);
+  kahan_add(szeros, _czeros, b.szeros);
+  kahan_add(sones, _cones, b.sones);
+  k += b.k;
+  kzeros += b.kzeros;
+  kones += b.kones;
+}
+
+// moves the sums by d without counting a pair
+inline void
+PairSums::adjust(yval_t y, double d)
+{
+  kahan_add(s, _cs, d);
+  if (y)
+    kahan_add(sones, _cones, d);
+  else
+    kahan_add(szeros, _czeros, d);
+}
+
+inline void
+HeldoutCache::mark(uint32_t node)
+{
+  _dirty.insert(node);
+}
+
+inline uint32_t
+PairEvalThread::nblocks(uint32_t npairs)
+{
+  return (npairs + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+//
+// top N
+//
+
 //
 // GLM network
 //
 
+//
+// With -lazy-pi, _Elogpi has no rows: the rows set_dir_exp() would
+// set are dropped from the cache instead, and elogpi() computes them
+// again from gamma when they are next read.
+//
 inline void
 GLMNetwork::set_dir_exp(const Matrix &u, Matrix &exp)
 {
+  if (_epcache) {
+    _epcache->clear();
+    return;
+  }
   const double ** const d = u.data();
   double **e = exp.data();
   for (uint32_t i = 0; i < u.m(); ++i) {
+    if (!d[i])    // a row this -shards worker does not hold
+      continue;
     // psi(e[i][j]) - psi(sum(e[i]))
     double s = .0;
     for (uint32_t j = 0; j < u.n(); ++j) 
@@ -391,15 +1078,65 @@ GLMNetwork::set_dir_exp(const Matrix &u, Matrix &exp)
 inline void
 GLMNetwork::set_dir_exp(uint32_t a, const Matrix &u, Matrix &exp)
 {
-  const double ** const d = u.data();
-  double **e = exp.data();
+  if (_epcache) {
+    _epcache->drop(a);
+    return;
+  }
+  dir_exp(u.data()[a], exp.data()[a]);
+}
 
+// psi(u[j]) - psi(sum(u)) for a row u of K values
+inline void
+GLMNetwork::dir_exp(const double *u, double *e) const
+{
   double s = .0;
-  for (uint32_t j = 0; j < u.n(); ++j) 
-    s += d[a][j];
+  for (uint32_t j = 0; j < _k; ++j) 
+    s += u[j];
   double psi_sum = gsl_sf_psi(s);
-  for (uint32_t j = 0; j < u.n(); ++j) 
-    e[a][j] = gsl_sf_psi(d[a][j]) - psi_sum;
+  for (uint32_t j = 0; j < _k; ++j) 
+    e[j] = gsl_sf_psi(u[j]) - psi_sum;
+}
+
+inline const double *
+GLMNetwork::elogpi(uint32_t a)
+{
+  if (!_epcache)
+    return _Elogpi.const_data()[a];
+  double *e;
+  if (!_epcache->lookup(a, e))
+    dir_exp(_gamma.const_data()[a], e);
+  return e;
+}
+
+// row p of pi; with -lazy-pi it is estimated from gamma into pi_p
+inline const double *
+GLMNetwork::pi_row(uint32_t p, Array &pi_p) const
+{
+  if (!_env.lazy_pi)
+    return _pi.const_data()[p];
+  estimate_pi(p, pi_p);
+  return pi_p.const_data();
+}
+
+//
+// -shards workers hold only the gamma and E[log pi] rows of their own
+// range and of the current minibatch, and no pi. The evaluator
+// (ps_evaluator()) keeps every gamma and pi row, as do workers started
+// from a saved model (-load, -warm-start), which fill rows of every
+// range.
+//
+inline bool
+GLMNetwork::partial_rows(const Env &env)
+{
+  return env.shards > 0 && !ps_evaluator(env) && !env.model_load &&
+    env.warm_start == "";
+}
+
+// -ps-eval runs as shard N of -shards N
+inline bool
+GLMNetwork::ps_evaluator(const Env &env)
+{
+  return env.shards > 0 && env.shard == (int32_t)env.shards;
 }
 
 inline uint32_t
@@ -409,6 +1146,125 @@ GLMNetwork::duration() const
   return t - _start_time;
 }
 
+inline uint32_t
+GLMNetwork::nthreads() const
+{
+  return _env.nthreads > 0 ? _env.nthreads : 1;
+}
+
+// with -numa, worker i of nt runs on NUMA node i * nnodes / nt
+inline uint32_t
+GLMNetwork::worker_node(uint32_t i, uint32_t nt) const
+{
+  return (uint64_t)i * NUMA::nnodes() / nt;
+}
+
+inline void
+GLMNetwork::start_worker(Thread *t, uint32_t i, uint32_t nt) const
+{
+  if (_env.numa)
+    t->set_node(worker_node(i, nt));
+  t->create();
+}
+
+inline uint32_t
+GroupCounts::add(uint32_t n, uint32_t g)
+{
+  uint64_t s = _start[n], e = s + _used[n];
+  for (; s < e; ++s)
+    if (_group[s] == g)
+      return ++_count[s];
+  assert (s < _start[n + 1]);
+  _group[s] = g;
+  _count[s] = 1;
+  _used[n]++;
+  return 1;
+}
+
+inline bool
+NodeSet::insert(uint32_t n)
+{
+  if (_stamp[n] == _epoch)
+    return false;
+  _stamp[n] = _epoch;
+  _nodes.push_back(n);
+  return true;
+}
+
+inline void
+NodeSet::clear()
+{
+  _nodes.clear();
+  if (++_epoch == 0) {
+    std::fill(_stamp.begin(), _stamp.end(), 0);
+    _epoch = 1;
+  }
+}
+
+inline double *
+SparseRows::row(uint32_t n)
+{
+  uint32_t s = _slot[n];
+  if (s == NONE)
+    return add(n);
+  return _blocks[s / BLOCK_ROWS] + (uint64_t)(s % BLOCK_ROWS) * _k;
+}
+
+inline const double *
+SparseRows::find(uint32_t n) const
+{
+  uint32_t s = _slot[n];
+  if (s == NONE)
+    return NULL;
+  return _blocks[s / BLOCK_ROWS] + (uint64_t)(s % BLOCK_ROWS) * _k;
+}
+
+inline void
+SparseRows::zero(uint32_t n)
+{
+  memset(row(n), 0, _k * sizeof(double));
+}
+
+inline bool
+RowCache::lookup(uint32_t n, double *&row)
+{
+  uint32_t e = _slot[n];
+  bool hit = e != NONE;
+  if (hit)
+    _hits++;
+  else {
+    _misses++;
+    e = _tail;
+    if (_node[e] != NONE)
+      _slot[_node[e]] = NONE;
+    _node[e] = n;
+    _slot[n] = e;
+  }
+  if (e != _head) {
+    unlink(e);
+    push_front(e);
+  }
+  row = &_rows[(uint64_t)e * _k];
+  return hit;
+}
+
+inline bool
+RankQuery::rank_candidate(uint32_t q) const
+{
+  return !std::binary_search(skip.begin(), skip.end(), q);
+}
+
+inline bool
+RankQuery::test_value(uint32_t q, yval_t &y) const
+{
+  vector<uint32_t>::const_iterator i =
+    std::lower_bound(test.begin(), test.end(), q);
+  if (i == test.end() || *i != q)
+    return false;
+  y = test_y[i - test.begin()];
+  return true;
+}
+
 inline bool
 GLMNetwork::edge_ok(const Edge &e) const
 {
@@ -437,15 +1293,31 @@ GLMNetwork::get_y(uint32_t p, uint32_t q)
 }
 
 
+inline const double *
+ModelView::pi_row(uint32_t p, Array &pi_p) const
+{
+  if (_pi)
+    return _pi[p];
+  const double *g = _gamma[p];
+  double s = .0;
+  for (uint32_t k = 0; k < _k; ++k)
+    s += g[k];
+  assert(s);
+  for (uint32_t k = 0; k < _k; ++k)
+    pi_p[k] = g[k] / s;
+  return pi_p.const_data();
+}
+
 inline uint32_t
-GLMNetwork::most_likely_group(uint32_t p)
+ModelView::most_likely_group(uint32_t p) const
 {
-  const double **pid = _pi.const_data();
+  Array pi_p(_k);
+  const double *pid = pi_row(p, pi_p);
   double max_k = .0, max_p = .0;
   
   for (uint32_t k = 0; k < _k; ++k)
-    if (pid[p][k] > max_p) {
-      max_p = pid[p][k];
+    if (pid[k] > max_p) {
+      max_p = pid[k];
       max_k = k;
     }
   return max_k;
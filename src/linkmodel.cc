@@ -0,0 +1,441 @@
+#include "linkmodel.hh"
+#include "outfile.hh"
+#include "log.hh"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <gsl/gsl_cblas.h>
+
+// rows and columns of a gamma.txt file
+static int
+gamma_dims(string fname, uint32_t &n, uint32_t &k)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return -1;
+  }
+  char *line = NULL;
+  size_t sz = 0;
+  n = 0;
+  k = 0;
+  while (getline(&line, &sz, f) > 0) {
+    if (n == 0) {
+      char *p = line, *q = NULL;
+      uint32_t c = 0;
+      for (;;) {
+	strtod(p, &q);
+	if (q == p)
+	  break;
+	p = q;
+	c++;
+      }
+      if (c < 3) {
+	fprintf(stderr, "error parsing %s\n", fname.c_str());
+	free(line);
+	fclose(f);
+	return -1;
+      }
+      k = c - 2; // node seq and id come first
+    }
+    n++;
+  }
+  free(line);
+  fclose(f);
+  return 0;
+}
+
+LinkModel::LinkModel(uint32_t n, uint32_t k, bool globalmu)
+  : _n(n), _k(k), _pi(n, k), _lambda(n), _mu(k),
+    _globalmu(.0), _epsilon(.0), _globalmu_on(globalmu),
+    _seq2id(n)
+{
+}
+
+// opens a .npy file and checks that it holds rows x cols values
+static FILE *
+open_npy(string fname, const char *type, uint64_t &rows, uint64_t &cols)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return NULL;
+  }
+  if (NpyFile::read_header(f, fname, type, rows, cols) < 0) {
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+// the modification time of fname, or false if it cannot be read
+static bool
+mtime(string fname, struct timespec &t)
+{
+  struct stat st;
+  if (stat(fname.c_str(), &st) < 0)
+    return false;
+  t = st.st_mtim;
+  return true;
+}
+
+static bool
+older(const struct timespec &a, const struct timespec &b)
+{
+  return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+//
+// save_model() writes the .npy files after the text ones, so an
+// export older than any of gamma.txt, deg.txt and mu.txt is left over
+// from an earlier run and must not shadow the newer text files.
+//
+static bool
+npy_current(string dir)
+{
+  static const char *npy[] = { "/pi.npy", "/lambda.npy", "/mu.npy",
+			       "/ids.npy" };
+  static const char *txt[] = { "/gamma.txt", "/deg.txt", "/mu.txt" };
+  struct timespec oldest, t;
+  if (!mtime(dir + npy[0], oldest))
+    return false;
+  for (uint32_t i = 1; i < sizeof(npy) / sizeof(npy[0]); ++i) {
+    if (!mtime(dir + npy[i], t))
+      return false;
+    if (older(t, oldest))
+      oldest = t;
+  }
+  for (uint32_t i = 0; i < sizeof(txt) / sizeof(txt[0]); ++i)
+    if (mtime(dir + txt[i], t) && older(oldest, t)) {
+      fprintf(stderr, "+ ignoring the .npy files in %s: %s is newer\n",
+	      dir.c_str(), txt[i] + 1);
+      return false;
+    }
+  return true;
+}
+
+LinkModel *
+LinkModel::load(string dir, bool globalmu)
+{
+  if (npy_current(dir)) {
+    uint64_t n, k;
+    FILE *f = open_npy(dir + "/pi.npy", "f8", n, k);
+    if (!f)
+      return NULL;
+    fclose(f);
+    LinkModel *m = new LinkModel(n, k, globalmu);
+    if (k == 0 || m->load_npy(dir) < 0) {
+      delete m;
+      return NULL;
+    }
+    return m;
+  }
+
+  uint32_t n, k;
+  if (gamma_dims(dir + "/gamma.txt", n, k) < 0)
+    return NULL;
+  LinkModel *m = new LinkModel(n, k, globalmu);
+  if (m->load_gamma(dir + "/gamma.txt") < 0 ||
+      m->load_lambda(dir + "/deg.txt") < 0 ||
+      m->load_mu(dir + "/mu.txt") < 0) {
+    delete m;
+    return NULL;
+  }
+  return m;
+}
+
+int
+LinkModel::load_gamma(string fname)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return -1;
+  }
+  char *line = NULL;
+  size_t sz = 0;
+  double **pid = _pi.data();
+  uint32_t i = 0;
+  while (getline(&line, &sz, f) > 0 && i < _n) {
+    char *p = line;
+    uint32_t seq = strtoul(p, &p, 10);
+    uint32_t id = strtoul(p, &p, 10);
+    if (seq >= _n) {
+      fprintf(stderr, "bad node %d in %s\n", seq, fname.c_str());
+      free(line);
+      fclose(f);
+      return -1;
+    }
+    double s = .0;
+    for (uint32_t k = 0; k < _k; ++k) {
+      pid[seq][k] = strtod(p, &p);
+      s += pid[seq][k];
+    }
+    assert(s);
+    for (uint32_t k = 0; k < _k; ++k)
+      pid[seq][k] /= s;
+    _id2seq[id] = seq;
+    _seq2id[seq] = id;
+    i++;
+  }
+  free(line);
+  fclose(f);
+  return 0;
+}
+
+int
+LinkModel::load_npy(string dir)
+{
+  // globalmu is only in mu.txt
+  if (load_mu(dir + "/mu.txt") < 0)
+    return -1;
+
+  uint64_t rows, cols;
+  string fname = dir + "/pi.npy";
+  FILE *f = open_npy(fname, "f8", rows, cols);
+  if (!f)
+    return -1;
+  double **pid = _pi.data();
+  bool ok = rows == _n && cols == _k;
+  for (uint32_t i = 0; i < _n && ok; ++i)
+    ok = fread(pid[i], sizeof(double), _k, f) == _k;
+  fclose(f);
+
+  if (ok) {
+    fname = dir + "/lambda.npy";
+    if (!(f = open_npy(fname, "f8", rows, cols)))
+      return -1;
+    ok = rows == _n && cols == 0 &&
+      fread(_lambda.data(), sizeof(double), _n, f) == _n;
+    fclose(f);
+  }
+  if (ok) {
+    fname = dir + "/mu.npy";
+    if (!(f = open_npy(fname, "f8", rows, cols)))
+      return -1;
+    ok = rows == _k && cols == 0 &&
+      fread(_mu.data(), sizeof(double), _k, f) == _k;
+    fclose(f);
+  }
+  if (ok) {
+    fname = dir + "/ids.npy";
+    if (!(f = open_npy(fname, "u4", rows, cols)))
+      return -1;
+    ok = rows == _n && cols == 0 &&
+      fread(_seq2id.data(), sizeof(uint32_t), _n, f) == _n;
+    fclose(f);
+  }
+  if (!ok) {
+    fprintf(stderr, "%s is short or does not match pi.npy\n", fname.c_str());
+    return -1;
+  }
+  for (uint32_t i = 0; i < _n; ++i)
+    _id2seq[_seq2id[i]] = i;
+  return 0;
+}
+
+int
+LinkModel::load_lambda(string fname)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return -1;
+  }
+  uint32_t seq, id, deg;
+  double lambda;
+  while (fscanf(f, "%u\t%u\t%u\t%lf\n", &seq, &id, &deg, &lambda) == 4) {
+    if (seq >= _n) {
+      fprintf(stderr, "bad node %d in %s\n", seq, fname.c_str());
+      fclose(f);
+      return -1;
+    }
+    _lambda[seq] = lambda;
+  }
+  fclose(f);
+  return 0;
+}
+
+int
+LinkModel::load_mu(string fname)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return -1;
+  }
+  uint32_t k;
+  double v;
+  while (fscanf(f, "%u\t%lf\n", &k, &v) == 2) {
+    if (k == 65536)
+      _globalmu = v;
+    else if (k < _k)
+      _mu[k] = v;
+  }
+  fclose(f);
+  return 0;
+}
+
+LinkIndex::LinkIndex(const LinkParams &params)
+  : _params(params), _n(params.n), _k(params.k), _pop(_n)
+{
+}
+
+LinkIndex::~LinkIndex()
+{
+  for (uint32_t k = 0; k < _lists.size(); ++k)
+    delete _lists[k];
+}
+
+void
+LinkIndex::build()
+{
+  const double * const * const pid = _params.pi;
+  for (uint32_t k = 0; k < _k; ++k) {
+    uArray *l = new uArray(_n);
+    for (uint32_t p = 0; p < _n; ++p)
+      (*l)[p] = p;
+    std::sort(l->data(), l->data() + _n, ByValue(pid, k));
+    _lists.push_back(l);
+  }
+  for (uint32_t p = 0; p < _n; ++p)
+    _pop[p] = p;
+  std::sort(_pop.data(), _pop.data() + _n,
+	    ByValue(_params.lambda));
+}
+
+//
+// Upper bound on link_prob(p,q) for every q below depth d in all the
+// lists: each sigmoid is increasing in lambda_q, and the weight of
+// community k is at most pi_p[k] times the pi[k] found at depth d.
+//
+double
+LinkIndex::bound(uint32_t p, uint32_t d) const
+{
+  const double * const * const pid = _params.pi;
+  const double *lambda = _params.lambda;
+  double l = lambda[p] + lambda[_pop[d]];
+  double se = 1.0 / (1 + exp(-(l + _params.epsilon)));
+  double t = se;
+  for (uint32_t k = 0; k < _k; ++k) {
+    if (pid[p][k] == .0)
+      continue;
+    double u = l + (_params.globalmu_on ? _params.globalmu : _params.mu[k]);
+    double sk = 1.0 / (1 + exp(-u));
+    if (sk > se)
+      t += pid[p][k] * pid[(*_lists[k])[d]][k] * (sk - se);
+  }
+  // allow for rounding differences with link_prob()
+  return t + 1e-12;
+}
+
+LinkBlockScorer::LinkBlockScorer(const LinkModel &model)
+  : _model(model), _n(model._n), _k(model._k)
+{
+}
+
+// orders community ids by mu, then by id
+class ByMu {
+public:
+  ByMu(const Array &mu): _mu(mu) { }
+  bool operator()(uint32_t a, uint32_t b) const {
+    if (_mu[a] != _mu[b])
+      return _mu[a] < _mu[b];
+    return a < b;
+  }
+private:
+  const Array &_mu;
+};
+
+int
+LinkBlockScorer::build()
+{
+  vector<uint32_t> cols(_k);
+  for (uint32_t k = 0; k < _k; ++k)
+    cols[k] = k;
+
+  _gstart.clear();
+  _gmu.clear();
+  if (_model._globalmu_on) {
+    _gstart.push_back(0);
+    _gmu.push_back(_model._globalmu);
+  } else {
+    std::sort(cols.begin(), cols.end(), ByMu(_model._mu));
+    for (uint32_t j = 0; j < _k; ++j)
+      if (j == 0 || _model._mu[cols[j]] != _model._mu[cols[j - 1]]) {
+	_gstart.push_back(j);
+	_gmu.push_back(_model._mu[cols[j]]);
+      }
+  }
+  _gstart.push_back(_k);
+  if (2 * ngroups() > _k)
+    return -1;
+
+  const double ** const pid = _model._pi.const_data();
+  _pi.resize((size_t)_n * _k);
+  for (uint32_t p = 0; p < _n; ++p)
+    for (uint32_t j = 0; j < _k; ++j)
+      _pi[(size_t)p * _k + j] = pid[p][cols[j]];
+  return 0;
+}
+
+// queries per block, so that the scores of a block, and the
+// affinities of one group, each fit in BLOCK_DOUBLES
+uint32_t
+LinkBlockScorer::block_size() const
+{
+  uint64_t b = BLOCK_DOUBLES / ((uint64_t)_n + 1);
+  if (b < 1)
+    b = 1;
+  if (b > MAX_BLOCK)
+    b = MAX_BLOCK;
+  return b;
+}
+
+void
+LinkBlockScorer::score(const uint32_t *queries, uint32_t nq,
+		       vector<double> &out, vector<double> &ws) const
+{
+  size_t rows = (size_t)nq * _k;
+  size_t cells = (size_t)nq * _n;
+  out.resize(cells);
+  ws.resize(rows + cells);
+  double *q = &ws[0];
+  double *c = q + rows;
+
+  for (uint32_t i = 0; i < nq; ++i)
+    memcpy(q + (size_t)i * _k, &_pi[(size_t)queries[i] * _k],
+	   _k * sizeof(double));
+
+  // each group's affinities are added into the scores as soon as its
+  // product is taken; the affinity left for eps is one minus the
+  // product over all columns, which is the last group's when there is
+  // only one
+  const Array &lambda = _model._lambda;
+  const double eps = _model._epsilon;
+  uint32_t ng = ngroups();
+  for (uint32_t g = 0; g <= ng; ++g) {
+    if (g == ng && ng > 1)
+      cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+		  nq, _n, _k, 1.0, q, _k, &_pi[0], _k, .0, c, _n);
+    else if (g < ng) {
+      // c = Q_g * Pi_g^T over the columns of group g
+      uint32_t k0 = _gstart[g], kg = _gstart[g + 1] - k0;
+      cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+		  nq, _n, kg, 1.0, q + k0, _k, &_pi[k0], _k, .0, c, _n);
+    }
+    for (uint32_t i = 0; i < nq; ++i) {
+      double lp = lambda[queries[i]];
+      for (uint32_t m = 0; m < _n; ++m) {
+	size_t x = (size_t)i * _n + m;
+	double l = lp + lambda[m];
+	if (g < ng) {
+	  double a = c[x] / (1 + exp(-(l + _gmu[g])));
+	  out[x] = g == 0 ? a : out[x] + a;
+	} else
+	  out[x] += (1 - c[x]) / (1 + exp(-(l + eps)));
+      }
+    }
+  }
+}
@@ -0,0 +1,345 @@
+#ifndef LINKMODEL_HH
+#define LINKMODEL_HH
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "env.hh"
+#include "matrix.hh"
+
+//
+// The arrays link_prob() reads, borrowed from a LinkModel or from the
+// training parameters (GLMNetwork::link_params()), so that a LinkIndex
+// can be built over either without copying pi. Valid as long as the
+// arrays they point into are not changed.
+//
+class LinkParams {
+public:
+  double link_prob(uint32_t p, uint32_t q) const;
+
+  uint32_t n;
+  uint32_t k;
+  const double * const *pi;
+  const double *lambda;
+  const double *mu;
+  double globalmu;
+  double epsilon;
+  bool globalmu_on;
+};
+
+//
+// The parameters link_prob() needs, detached from training: pi (the
+// normalized gamma rows), lambda, mu and the node id mapping. Built
+// from a GLMNetwork or loaded from gamma.txt, deg.txt and mu.txt as
+// written by GLMNetwork::save_model(). Loading reads nothing but the
+// model: when the directory also has the -npy export, and it is no
+// older than the text files, the arrays are read from it as they are,
+// at full precision and without parsing.
+//
+class LinkModel {
+public:
+  LinkModel(uint32_t n, uint32_t k, bool globalmu);
+
+  static LinkModel *load(string dir, bool globalmu);
+
+  uint32_t n() const { return _n; }
+  uint32_t k() const { return _k; }
+
+  bool lookup(uint32_t id, uint32_t &seq) const;
+  uint32_t id(uint32_t seq) const { return _seq2id[seq]; }
+  LinkParams params() const;
+  double link_prob(uint32_t p, uint32_t q) const;
+  double pair_likelihood(uint32_t p, uint32_t q, yval_t y) const;
+
+private:
+  int load_gamma(string fname);
+  int load_lambda(string fname);
+  int load_mu(string fname);
+  int load_npy(string dir);
+
+  uint32_t _n;
+  uint32_t _k;
+  Matrix _pi;
+  Array _lambda;
+  Array _mu;
+  double _globalmu;
+  double _epsilon;
+  bool _globalmu_on;
+  IDMap _id2seq;
+  uArray _seq2id;
+
+  friend class GLMNetwork;
+  friend class LinkBlockScorer;
+  friend class ModelView;
+};
+
+//
+// Bounded heap holding the N highest scoring candidates seen so far.
+// Ties are broken by the lower candidate id, which is the order a
+// stable descending sort of all candidates would give.
+//
+class TopN {
+public:
+  TopN(uint32_t n): _n(n) { _heap.reserve(n); }
+
+  void clear() { _heap.clear(); }
+  bool full() const { return _heap.size() == _n; }
+  const KV &worst() const { return _heap.front(); }
+  void push(uint32_t m, double v);
+  void sorted(vector<KV> &out) const;
+
+  static bool better(const KV &a, const KV &b);
+
+private:
+  uint32_t _n;
+  vector<KV> _heap; // front is the worst candidate kept
+};
+
+//
+// Exact top-N link retrieval with Fagin's threshold algorithm.
+//
+// link_prob(p,q) mixes sigmoid(lambda_p + lambda_q + mu_k) with weights
+// pi_p[k] * pi_q[k], so it grows with lambda_q and with each pi_q[k].
+// Per-community lists sorted by pi[k] and a popularity list sorted by
+// lambda are read in parallel; a node not seen by depth d is bounded
+// by the values at depth d, and the scan stops once the N-th best
+// score found is above that bound. Candidates are screened by the
+// filter's rank_candidate(q).
+//
+class LinkIndex {
+public:
+  LinkIndex(const LinkParams &params);
+  ~LinkIndex();
+
+  void build();
+  template<class F> uint32_t top(uint32_t p, TopN &top,
+				 vector<uint32_t> &seen, uint32_t epoch,
+				 const F &filter) const;
+
+private:
+  // orders node ids by decreasing v[id], or rows[id][col], then by id
+  class ByValue {
+  public:
+    ByValue(const double *v): _v(v), _rows(NULL), _col(0) { }
+    ByValue(const double * const *rows, uint32_t col)
+      : _v(NULL), _rows(rows), _col(col) { }
+    double value(uint32_t a) const { return _v ? _v[a] : _rows[a][_col]; }
+    bool operator()(uint32_t a, uint32_t b) const {
+      double va = value(a), vb = value(b);
+      if (va != vb)
+	return va > vb;
+      return a < b;
+    }
+  private:
+    const double *_v;
+    const double * const *_rows;
+    uint32_t _col;
+  };
+
+  double bound(uint32_t p, uint32_t d) const;
+
+  LinkParams _params;
+  uint32_t _n;
+  uint32_t _k;
+  vector<uArray *> _lists; // by pi[k], descending
+  uArray _pop;             // by lambda, descending
+};
+
+//
+// Scores blocks of query nodes against all nodes with matrix
+// multiplies. link_prob(p,q) sees the communities only through
+// sigmoid(lambda_p + lambda_q + mu_k) * pi_p[k] * pi_q[k], so the
+// communities sharing a mu value (all of them with -globalmu, and
+// every community whose mu is still at 0) reduce to one inner product
+// of pi rows. build() copies pi into one contiguous n x K array with
+// the columns grouped by mu; score() takes each group's affinities for
+// a query block from one cblas_dgemm() over its columns and folds them
+// into the scores straight away, with one sigmoid per pair and group.
+// That only saves work when there are clearly fewer groups than
+// communities, as with -globalmu or while many mu are still 0; when
+// more than half the communities have a mu of their own, build()
+// fails without copying pi and the caller ranks pair by pair instead.
+//
+// Sums are taken in a different order than in link_prob(), so scores
+// can differ from it in the last bits.
+//
+class LinkBlockScorer {
+public:
+  LinkBlockScorer(const LinkModel &model);
+
+  int build();
+  uint32_t ngroups() const { return _gmu.size(); }
+  uint32_t block_size() const;
+
+  // out is nq x n, row i scoring queries[i] against every node; ws
+  // is scratch space owned by the calling thread, nq x (n + K)
+  void score(const uint32_t *queries, uint32_t nq,
+	     vector<double> &out, vector<double> &ws) const;
+
+  // doubles of out and of scratch space per block, for each thread
+  static const uint32_t BLOCK_DOUBLES = 1 << 22;
+  static const uint32_t MAX_BLOCK = 256;
+
+private:
+  const LinkModel &_model;
+  uint32_t _n;
+  uint32_t _k;
+  vector<double> _pi;        // n x K, columns in group order
+  vector<uint32_t> _gstart;  // group g is columns [_gstart[g], _gstart[g+1])
+  vector<double> _gmu;
+};
+
+inline bool
+LinkModel::lookup(uint32_t id, uint32_t &seq) const
+{
+  IDMap::const_iterator itr = _id2seq.find(id);
+  if (itr == _id2seq.end())
+    return false;
+  seq = itr->second;
+  return true;
+}
+
+inline LinkParams
+LinkModel::params() const
+{
+  LinkParams lp;
+  lp.n = _n;
+  lp.k = _k;
+  lp.pi = _pi.const_data();
+  lp.lambda = _lambda.const_data();
+  lp.mu = _mu.const_data();
+  lp.globalmu = _globalmu;
+  lp.epsilon = _epsilon;
+  lp.globalmu_on = _globalmu_on;
+  return lp;
+}
+
+// same mixture, in the same order, as GLMNetwork::link_prob()
+inline double
+LinkParams::link_prob(uint32_t p, uint32_t q) const
+{
+  double s = .0, m = .0, u, r;
+  for (uint32_t j = 0; j < k; ++j) {
+    if (globalmu_on)
+      u = lambda[p] + lambda[q] + globalmu;
+    else
+      u = lambda[p] + lambda[q] + mu[j];
+    r = (double)1.0 / (1 + exp(-u));
+    s += r * pi[p][j] * pi[q][j];
+    m += pi[p][j] * pi[q][j];
+  }
+  u = lambda[p] + lambda[q] + epsilon;
+  r = (double)1.0 / (1 + exp(-u));
+  s += r * (1 - m);
+  return s;
+}
+
+// same mixture, in the same order, as GLMNetwork::link_prob()
+inline double
+LinkModel::link_prob(uint32_t p, uint32_t q) const
+{
+  const double ** const pid = _pi.const_data();
+  double s = .0, m = .0, u, r;
+  for (uint32_t k = 0; k < _k; ++k) {
+    if (_globalmu_on)
+      u = _lambda[p] + _lambda[q] + _globalmu;
+    else
+      u = _lambda[p] + _lambda[q] + _mu[k];
+    r = (double)1.0 / (1 + exp(-u));
+    s += r * pid[p][k] * pid[q][k];
+    m += pid[p][k] * pid[q][k];
+  }
+  u = _lambda[p] + _lambda[q] + _epsilon;
+  r = (double)1.0 / (1 + exp(-u));
+  s += r * (1 - m);
+  return s;
+}
+
+// same as GLMNetwork::pair_likelihood2()
+inline double
+LinkModel::pair_likelihood(uint32_t p, uint32_t q, yval_t y) const
+{
+  const double ** const pid = _pi.const_data();
+  double s = .0, m = .0, u, r, z;
+  for (uint32_t k = 0; k < _k; ++k) {
+    if (_globalmu_on)
+      u = _lambda[p] + _lambda[q] + _globalmu;
+    else
+      u = _lambda[p] + _lambda[q] + _mu[k];
+    r = (double)1.0 / (1 + exp(-u));
+    z = y ? r : 1 - r;
+    s += z * pid[p][k] * pid[q][k];
+    m += pid[p][k] * pid[q][k];
+  }
+  u = _lambda[p] + _lambda[q] + _epsilon;
+  r = (double)1.0 / (1 + exp(-u));
+  z = y ? r : 1 - r;
+  s += z * (1 - m);
+  if (s < 1e-30)
+    s = 1e-30;
+  return log(s);
+}
+
+inline bool
+TopN::better(const KV &a, const KV &b)
+{
+  if (a.second != b.second)
+    return a.second > b.second;
+  return a.first < b.first;
+}
+
+inline void
+TopN::push(uint32_t m, double v)
+{
+  KV kv(m, v);
+  if (_heap.size() < _n) {
+    _heap.push_back(kv);
+    std::push_heap(_heap.begin(), _heap.end(), TopN::better);
+  } else if (_n > 0 && better(kv, _heap.front())) {
+    std::pop_heap(_heap.begin(), _heap.end(), TopN::better);
+    _heap.back() = kv;
+    std::push_heap(_heap.begin(), _heap.end(), TopN::better);
+  }
+}
+
+inline void
+TopN::sorted(vector<KV> &out) const
+{
+  out = _heap;
+  std::sort(out.begin(), out.end(), TopN::better);
+}
+
+template<class F> inline uint32_t
+LinkIndex::top(uint32_t p, TopN &top,
+	       vector<uint32_t> &seen, uint32_t epoch,
+	       const F &filter) const
+{
+  const double * const * const pid = _params.pi;
+  vector<const uArray *> lists;
+  lists.push_back(&_pop);
+  for (uint32_t k = 0; k < _k; ++k)
+    if (pid[p][k] > .0)
+      lists.push_back(_lists[k]);
+
+  uint32_t scored = 0;
+  for (uint32_t d = 0; d < _n; ++d) {
+    for (uint32_t i = 0; i < lists.size(); ++i) {
+      uint32_t q = (*lists[i])[d];
+      if (seen[q] == epoch)
+	continue;
+      seen[q] = epoch;
+      if (!filter.rank_candidate(q))
+	continue;
+      top.push(q, _params.link_prob(p, q));
+      scored++;
+    }
+    // ties with the N-th best go to the lower id, so an unseen node
+    // that only matches it could still displace it
+    if (d + 1 < _n && top.full() && top.worst().second > bound(p, d + 1))
+      break;
+  }
+  return scored;
+}
+
+#endif
@@ -1,7 +1,12 @@
 #include "env.hh"
 #include "glm.hh"
 #include "log.hh"
+#include "ps.hh"
+#include "score.hh"
+#include "serve.hh"
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include <string>
 #include <iostream>
@@ -13,8 +18,11 @@ Logger::Level Env::level = Logger::DEBUG;
 FILE *Env::_plogf = NULL;
 void usage();
 void test();
+int run_local_shards(uint32_t shards, string ps_path);
 
 Env *env_global = NULL;
+int global_argc = 0;
+char **global_argv = NULL;
 
 volatile sig_atomic_t sig_handler_active = 0;
 
@@ -36,6 +44,8 @@ main(int argc, char **argv)
 {
   
   signal(SIGTERM, term_handler);
+  global_argc = argc;
+  global_argv = argv;
   
   bool run_gap = false;
   bool force_overwrite_dir = true;
@@ -109,6 +119,28 @@ main(int argc, char **argv)
   bool globalmu = false;
   bool adagrad = false;
   bool gamma_adagrad = false;
+  bool crng = false;
+  bool numa = false;
+  uint32_t shards = 0;
+  int32_t shard = -1;
+  string ps_path = "";
+  bool ps_server = false;
+  bool ps_eval = false;
+  bool rank_scan = false;
+  bool async_eval = false;
+  uint32_t heldout_sample = 0;
+  double heldout_tol = -1;
+  bool rank_gemm = false;
+  uint32_t checkpoint_freq = 0;
+  uint32_t checkpoint_delta = 0;
+  string resume = "";
+  string warm_start = "";
+  bool npy = false;
+  uint32_t lazy_pi = 0;
+  string score_fname = "";
+  string score_out = "";
+  string serve_path = "";
+  string serve_exclude = "";
 
   if (argc == 1) {
     usage();
@@ -318,6 +350,81 @@ main(int argc, char **argv)
       adagrad = true;
     }  else if (strcmp(argv[i], "-gamma-adagrad") == 0) {
       gamma_adagrad = true;
+    } else if (strcmp(argv[i], "-crng") == 0) {
+      crng = true;
+      fprintf(stdout, "+ counter-based random streams\n");
+    } else if (strcmp(argv[i], "-numa") == 0) {
+      numa = true;
+      fprintf(stdout, "+ NUMA-aware placement\n");
+    } else if (strcmp(argv[i], "-shards") == 0) {
+      shards = atoi(argv[++i]);
+      fprintf(stdout, "+ shards = %d\n", shards);
+    } else if (strcmp(argv[i], "-shard") == 0) {
+      shard = atoi(argv[++i]);
+      fprintf(stdout, "+ shard = %d\n", shard);
+    } else if (strcmp(argv[i], "-ps") == 0) {
+      ps_path = string(argv[++i]);
+      fprintf(stdout, "+ parameter server socket = %s\n", ps_path.c_str());
+    } else if (strcmp(argv[i], "-ps-server") == 0) {
+      ps_server = true;
+      fprintf(stdout, "+ parameter server mode\n");
+    } else if (strcmp(argv[i], "-ps-eval") == 0) {
+      ps_eval = true;
+      fprintf(stdout, "+ parameter server evaluator mode\n");
+    } else if (strcmp(argv[i], "-score") == 0) {
+      if (i + 2 > argc - 1) {
+	fprintf(stderr, "+ insufficient arguments!\n");
+	exit(-1);
+      }
+      score_fname = string(argv[++i]);
+      score_out = string(argv[++i]);
+      fprintf(stdout, "+ scoring pairs in %s into %s\n",
+	      score_fname.c_str(), score_out.c_str());
+    } else if (strcmp(argv[i], "-serve") == 0) {
+      serve_path = string(argv[++i]);
+      fprintf(stdout, "+ serving recommendations on %s\n", serve_path.c_str());
+    } else if (strcmp(argv[i], "-serve-exclude") == 0) {
+      serve_exclude = string(argv[++i]);
+      fprintf(stdout, "+ not recommending the pairs in %s\n",
+	      serve_exclude.c_str());
+    } else if (strcmp(argv[i], "-rank-scan") == 0) {
+      rank_scan = true;
+      fprintf(stdout, "+ ranking scans all candidates\n");
+    } else if (strcmp(argv[i], "-async-eval") == 0) {
+      async_eval = true;
+      fprintf(stdout, "+ evaluating parameter snapshots in the background\n");
+    } else if (strcmp(argv[i], "-heldout-sample") == 0) {
+      heldout_sample = atoi(argv[++i]);
+      fprintf(stdout, "+ heldout sample = %d pairs per stratum\n",
+	      heldout_sample);
+    } else if (strcmp(argv[i], "-heldout-incr") == 0) {
+      heldout_tol = atof(argv[++i]);
+      fprintf(stdout, "+ incremental heldout, mu tolerance = %.3g\n",
+	      heldout_tol);
+    } else if (strcmp(argv[i], "-rank-gemm") == 0) {
+      rank_gemm = true;
+      fprintf(stdout, "+ ranking with blocked matrix multiplies\n");
+    } else if (strcmp(argv[i], "-checkpoint") == 0) {
+      checkpoint_freq = atoi(argv[++i]);
+      fprintf(stdout, "+ checkpoint every %d iterations\n", checkpoint_freq);
+    } else if (strcmp(argv[i], "-checkpoint-delta") == 0) {
+      checkpoint_delta = atoi(argv[++i]);
+      fprintf(stdout, "+ delta checkpoint every %d iterations\n",
+	      checkpoint_delta);
+    } else if (strcmp(argv[i], "-resume") == 0) {
+      resume = string(argv[++i]);
+      fprintf(stdout, "+ resume from %s\n", resume.c_str());
+    } else if (strcmp(argv[i], "-warm-start") == 0) {
+      warm_start = string(argv[++i]);
+      fprintf(stdout, "+ warm start from the model in %s\n",
+	      warm_start.c_str());
+    } else if (strcmp(argv[i], "-npy") == 0) {
+      npy = true;
+      fprintf(stdout, "+ export the model as .npy files\n");
+    } else if (strcmp(argv[i], "-lazy-pi") == 0) {
+      lazy_pi = atoi(argv[++i]);
+      fprintf(stdout, "+ compute E[log pi] and pi on demand, caching %d rows\n",
+	      lazy_pi);
     } else {
       fprintf(stdout, "unknown option %s!", argv[i]);
       assert(0);
@@ -328,6 +435,37 @@ main(int argc, char **argv)
   datfname = datdir + "/train.tsv";
   
   assert (!(batch && online));
+
+  if (score_fname != "") {
+    PairScorer scorer(datdir == "" ? "." : datdir, nthreads, globalmu);
+    if (scorer.load() < 0)
+      return -1;
+    return scorer.score(score_fname, score_out);
+  }
+
+  if (serve_path != "") {
+    RecServer server(datdir == "" ? "." : datdir, serve_path,
+		     nthreads > 0 ? nthreads : 4, globalmu, serve_exclude);
+    return server.run();
+  }
+
+  if (shards > 0) {
+    if (ps_path == "")
+      ps_path = ParamServer::default_path();
+    if (ps_server) {
+      if (shard < 0 || (uint32_t)shard >= shards) {
+	fprintf(stderr, "-ps-server needs -shard <i>, the range it serves\n");
+	return -1;
+      }
+      ParamServer ps(ps_path, shards, shard);
+      return ps.run();
+    }
+    if (ps_eval)
+      shard = shards;
+    else if (shard < 0)
+      return run_local_shards(shards, ps_path);
+    assert ((uint32_t)shard <= shards);
+  }
   
   Env env(n, k, massive, 
 	  hol_ratio, rand_seed,
@@ -344,7 +482,10 @@ main(int argc, char **argv)
 	  acc, lcacc, ngscale, link_thresh,
 	  lt_min_deg, lowconf, nolambda, nmemberships, ammopt, 
 	  onesonly, init_comm, init_comm_fname, node_scaling_on,
-	  lpmode, gtrim, fastinit, max_iterations, globalmu, adagrad, gamma_adagrad);
+	  lpmode, gtrim, fastinit, max_iterations, globalmu, adagrad, gamma_adagrad,
+	  crng, numa, shards, shard, ps_path, rank_scan, async_eval,
+	  heldout_sample, heldout_tol, rank_gemm, checkpoint_freq,
+	  resume, checkpoint_delta, warm_start, npy, lazy_pi);
 
   env_global = &env;
   Network network(env);
@@ -366,6 +507,55 @@ main(int argc, char **argv)
   }
 }
 
+//
+// -shards N without -shard or -ps-server: fork N parameter servers,
+// N workers and the evaluator on this machine, each running this same
+// binary with the arguments it was given plus its role
+//
+int
+run_local_shards(uint32_t shards, string ps_path)
+{
+  // the server of each range, then the workers, then the evaluator
+  vector<pid_t> pids;
+  for (uint32_t j = 0; j <= 2 * shards; ++j) {
+    uint32_t s = j % shards;
+    pid_t pid = fork();
+    if (pid < 0) {
+      fprintf(stderr, "fork failed: %s\n", strerror(errno));
+      return -1;
+    }
+    if (pid == 0) {
+      char sbuf[32];
+      sprintf(sbuf, "%d", s);
+      vector<const char *> args;
+      for (int i = 0; i < global_argc; ++i)
+	args.push_back(global_argv[i]);
+      args.push_back("-ps");
+      args.push_back(ps_path.c_str());
+      if (j < shards)
+	args.push_back("-ps-server");
+      if (j < 2 * shards) {
+	args.push_back("-shard");
+	args.push_back(sbuf);
+      } else
+	args.push_back("-ps-eval");
+      args.push_back(NULL);
+      execv("/proc/self/exe", (char * const *)&args[0]);
+      fprintf(stderr, "exec failed: %s\n", strerror(errno));
+      _exit(-1);
+    }
+    pids.push_back(pid);
+  }
+  int rv = 0;
+  for (uint32_t i = 0; i < pids.size(); ++i) {
+    int status;
+    if (waitpid(pids[i], &status, 0) < 0 ||
+	!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      rv = -1;
+  }
+  return rv;
+}
+
 void
 usage()
 {
@@ -383,6 +573,64 @@ usage()
 	  "\t-massive\t\tfor large datasets\n"
 	  "\t-preprocess\t\tpreprocess large datasets\n"
 	  "\t-rfreq\t\tset the frequency at which logging (of heldout-likelihood etc.) is done\n"
+	  "\t-nthreads <N>\tnumber of threads used to evaluate heldout and test pairs\n"
+	  "\t-crng\t\tuse counter-based random streams keyed by (seed, iteration, node);\n"
+	  "\t\t\tresults do not depend on -nthreads\n"
+	  "\t-numa\t\tplace node parameters and adjacency lists on the NUMA node\n"
+	  "\t\t\towning them, pin the training thread, and pin each\n"
+	  "\t\t\tevaluation worker to the NUMA node whose pairs and\n"
+	  "\t\t\tquery nodes it takes (experimental: not yet timed on\n"
+	  "\t\t\ta multi-socket host)\n"
+	  "\t-shards <N>\ttrain with N worker processes, each owning a range of\n"
+	  "\t\t\tnodes; without -shard, starts N parameter servers,\n"
+	  "\t\t\tN local workers and an evaluator\n"
+	  "\t-shard <i>\trun as worker i of -shards N\n"
+	  "\t-ps <path>\tparameter server Unix sockets are <path>.<i>\n"
+	  "\t-ps-server\twith -shard <i>, run as the parameter server of\n"
+	  "\t\t\tthe rows of worker i\n"
+	  "\t-ps-eval\trun as the evaluator of -shards N: fetch the whole\n"
+	  "\t\t\tmodel at each report, evaluate it and stop training\n"
+	  "\t\t\twhen it converges; write the result files\n"
+	  "\t-score <pairs> <out>\tscore the (id, id) pairs in <pairs> with the\n"
+	  "\t\t\tmodel (gamma.txt, deg.txt, mu.txt) in -dir and write\n"
+	  "\t\t\t\"id id probability\" lines to <out>\n"
+	  "\t-serve <path>\tanswer top-N and pair-score requests for the model\n"
+	  "\t\t\tin -dir on a Unix socket; -nthreads connections (default 4)\n"
+	  "\t\t\tare served at once; top-N lists include nodes already\n"
+	  "\t\t\tlinked to the query unless -serve-exclude is given\n"
+	  "\t-serve-exclude <pairs>\twith -serve, leave the \"id id\" pairs in\n"
+	  "\t\t\t<pairs> (e.g. the training network) out of top-N lists\n"
+	  "\t-rank-scan\tscore every candidate when ranking instead of using\n"
+	  "\t\t\tthe threshold-algorithm index\n"
+	  "\t-async-eval\tevaluate heldout, precision and ranking on a snapshot\n"
+	  "\t\t\tof the parameters in a background thread while training\n"
+	  "\t\t\tcontinues\n"
+	  "\t-heldout-sample <n>\testimate the heldout likelihood from n links\n"
+	  "\t\t\tand n non-links, doubled whenever the stopping rule\n"
+	  "\t\t\tcannot tell a change from sampling noise\n"
+	  "\t-heldout-incr <tol>\tkeep heldout pair likelihoods between reports\n"
+	  "\t\t\tand rescore only pairs of updated nodes, until mu moves\n"
+	  "\t\t\tmore than tol\n"
+	  "\t-rank-gemm\tscore blocks of query nodes against all nodes with\n"
+	  "\t\t\tBLAS matrix multiplies when ranking, if at most half\n"
+	  "\t\t\tthe communities have distinct mu (as with -globalmu)\n"
+	  "\t-checkpoint <n>\twrite the full training state to checkpoint.bin\n"
+	  "\t\t\tevery n iterations (and at the end of training)\n"
+	  "\t-checkpoint-delta <n>\tappend the gamma and lambda rows changed\n"
+	  "\t\t\tsince the last checkpoint to checkpoint.log every n\n"
+	  "\t\t\titerations; -checkpoint writes full ones in between\n"
+	  "\t-resume <file>\tcontinue training from a checkpoint.bin and the\n"
+	  "\t\t\tcheckpoint.log next to it\n"
+	  "\t-warm-start <dir>\tstart from the gamma.txt, deg.txt and mu.txt\n"
+	  "\t\t\tof a run on an earlier version of the graph, matching\n"
+	  "\t\t\tnodes by id; new nodes start from their neighbors\n"
+	  "\t-npy\t\talso save gamma, pi, lambda, mu and the node ids as\n"
+	  "\t\t\tNumPy .npy files\n"
+	  "\t-lazy-pi <rows>\tkeep no n x K E[log pi] and pi matrices; compute\n"
+	  "\t\t\ttheir rows from gamma when needed, and keep the last\n"
+	  "\t\t\tE[log pi] rows used in a cache of this many rows;\n"
+	  "\t\t\tranks as with -rank-scan, and ignores -async-eval\n"
+	  "\t\t\tand -rank-gemm, which need a dense copy of pi\n"
 	  );
   fflush(stdout);
 }
@@ -582,7 +582,8 @@ D1Array<KV>::s() const
 template <class T>
 class D2Array {
 public:
-  D2Array(uint32_t m, uint32_t n, bool zero=true);
+  // with alloc false, no row is allocated until alloc_row()
+  D2Array(uint32_t m, uint32_t n, bool zero=true, bool alloc=true);
   D2Array(const D2Array<T> &a);
   ~D2Array();
 
@@ -629,6 +630,13 @@ public:
 
   void reset(D2Array<T> &u);
   void reset();
+  void move_rows(uint32_t begin, uint32_t end);
+
+  // a -shards worker holds only some rows; with rows missing, only
+  // the methods taking a row index may be used, on rows it holds
+  bool has_row(uint32_t i) const { return _data[i] != NULL; }
+  void alloc_row(uint32_t i);
+  void free_row(uint32_t i);
 
   string s() const;
 
@@ -639,11 +647,15 @@ private:
 };
 
 template<class T> inline
-D2Array<T>::D2Array(uint32_t m, uint32_t n, bool zero):
+D2Array<T>::D2Array(uint32_t m, uint32_t n, bool zero, bool alloc):
   _m(m), _n(n)
 {
   _data = new T*[m];
   for (uint32_t i = 0; i < m; ++i) {
+    if (!alloc) {
+      _data[i] = NULL;
+      continue;
+    }
     _data[i] = new T[n];
     if (zero)
       memset(_data[i], 0, sizeof(T)*n);
@@ -754,6 +766,37 @@ D2Array<T>::scale(uint32_t p, T s)
   return *this;
 }
 
+// reallocate rows [begin, end) from the calling thread, so that their
+// pages are first touched (and placed) where that thread runs
+template<class T> inline void
+D2Array<T>::move_rows(uint32_t begin, uint32_t end)
+{
+  for (uint32_t i = begin; i < end && i < _m; ++i) {
+    if (!_data[i])
+      continue;
+    T *r = new T[_n];
+    memcpy(r, _data[i], sizeof(T)*_n);
+    delete[] _data[i];
+    _data[i] = r;
+  }
+}
+
+template<class T> inline void
+D2Array<T>::alloc_row(uint32_t i)
+{
+  if (_data[i])
+    return;
+  _data[i] = new T[_n];
+  memset(_data[i], 0, sizeof(T)*_n);
+}
+
+template<class T> inline void
+D2Array<T>::free_row(uint32_t i)
+{
+  delete[] _data[i];
+  _data[i] = NULL;
+}
+
 template<class T> inline int
 D2Array<T>::copy_from(const D2Array<T> &a)
 {
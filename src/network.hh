@@ -86,6 +86,7 @@ public:
   void load_heldout_sets(string fname, SampleMap &mp, uArray &ignore_npairs);
 
   const vector<uint32_t> *get_edges(uint32_t a) const;
+  void move_edges(uint32_t begin, uint32_t end);
 
   const IDMap &id2seq() const { return _id2seq; }
   const IDMap &seq2id() const { return _seq2id; }
@@ -206,6 +207,21 @@ Network::get_edges(uint32_t a) const
   return v;
 }
 
+// reallocate the adjacency lists of nodes [begin, end) from the
+// calling thread (see D2Array::move_rows())
+inline void
+Network::move_edges(uint32_t begin, uint32_t end)
+{
+  std::vector<uint32_t> **v = _sparse_y.data();
+  for (uint32_t i = begin; i < end && i < _sparse_y.size(); ++i) {
+    if (!v[i])
+      continue;
+    std::vector<uint32_t> *u = new vector<uint32_t>(*v[i]);
+    delete v[i];
+    v[i] = u;
+  }
+}
+
 // inline bool
 // Network::exists(uint32_t p, uint32_t q) const
 // {
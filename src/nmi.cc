@@ -0,0 +1,120 @@
+#include "nmi.hh"
+#include <math.h>
+#include <algorithm>
+
+// -p log2 p
+static inline double
+h(double p)
+{
+  return p > .0 ? -p * log(p) / M_LN2 : .0;
+}
+
+// sorted, duplicate free member lists of the non-empty communities
+static void
+members(const MapVec &c, vector<vector<uint32_t> > &m, uint32_t &maxid)
+{
+  m.clear();
+  for (MapVec::const_iterator i = c.begin(); i != c.end(); ++i) {
+    vector<uint32_t> v(i->second);
+    std::sort(v.begin(), v.end());
+    v.erase(std::unique(v.begin(), v.end()), v.end());
+    if (v.size() == 0)
+      continue;
+    if (v.back() > maxid)
+      maxid = v.back();
+    m.push_back(v);
+  }
+}
+
+//
+// H(A | B) in bits for a pair of communities over n nodes, where a
+// nodes are in both, b in A only, c in B only and d in neither. Fails
+// if the two are anticorrelated.
+//
+static bool
+cond_entropy(double a, double b, double c, double d, double n,
+	     double &e)
+{
+  double h11 = h(a / n), h10 = h(b / n), h01 = h(c / n), h00 = h(d / n);
+  if (h11 + h00 <= h10 + h01)
+    return false;
+  e = h11 + h10 + h01 + h00 - h((a + c) / n) - h((b + d) / n);
+  return true;
+}
+
+double
+overlapping_nmi(const MapVec &cx, const MapVec &cy)
+{
+  vector<vector<uint32_t> > x, y;
+  uint32_t maxid = 0;
+  members(cx, x, maxid);
+  members(cy, y, maxid);
+  if (x.size() == 0 || y.size() == 0)
+    return .0;
+
+  // node -> communities of y, and the nodes covered by either
+  vector<uint32_t> start(maxid + 2, 0);
+  vector<bool> covered(maxid + 1, false);
+  for (uint32_t l = 0; l < y.size(); ++l)
+    for (uint32_t i = 0; i < y[l].size(); ++i) {
+      start[y[l][i] + 1]++;
+      covered[y[l][i]] = true;
+    }
+  for (uint32_t v = 0; v <= maxid; ++v)
+    start[v + 1] += start[v];
+  vector<uint32_t> index(start[maxid + 1]);
+  vector<uint32_t> fill(start.begin(), start.end() - 1);
+  for (uint32_t l = 0; l < y.size(); ++l)
+    for (uint32_t i = 0; i < y[l].size(); ++i)
+      index[fill[y[l][i]]++] = l;
+  for (uint32_t k = 0; k < x.size(); ++k)
+    for (uint32_t i = 0; i < x[k].size(); ++i)
+      covered[x[k][i]] = true;
+  double n = .0;
+  for (uint32_t v = 0; v <= maxid; ++v)
+    if (covered[v])
+      n++;
+
+  // a community with no acceptable match keeps its own entropy
+  vector<double> hx(x.size()), hy(y.size());
+  for (uint32_t k = 0; k < x.size(); ++k)
+    hx[k] = h(x[k].size() / n) + h(1 - x[k].size() / n);
+  for (uint32_t l = 0; l < y.size(); ++l)
+    hy[l] = h(y[l].size() / n) + h(1 - y[l].size() / n);
+  vector<double> hx0(hx), hy0(hy);
+
+  vector<uint32_t> overlap(y.size(), 0);
+  vector<uint32_t> touched;
+  for (uint32_t k = 0; k < x.size(); ++k) {
+    const vector<uint32_t> &xk = x[k];
+    for (uint32_t i = 0; i < xk.size(); ++i)
+      for (uint32_t j = start[xk[i]]; j < start[xk[i] + 1]; ++j)
+	if (overlap[index[j]]++ == 0)
+	  touched.push_back(index[j]);
+
+    for (uint32_t t = 0; t < touched.size(); ++t) {
+      uint32_t l = touched[t];
+      double a = overlap[l];
+      double b = xk.size() - a;
+      double c = y[l].size() - a;
+      double d = n - a - b - c;
+      double e;
+      if (cond_entropy(a, b, c, d, n, e) && e < hx[k])
+	hx[k] = e;
+      if (cond_entropy(a, c, b, d, n, e) && e < hy[l])
+	hy[l] = e;
+      overlap[l] = 0;
+    }
+    touched.clear();
+  }
+
+  // a community that covers every node carries no information
+  double sx = .0, sy = .0;
+  for (uint32_t k = 0; k < x.size(); ++k)
+    if (hx0[k] > .0)
+      sx += hx[k] / hx0[k];
+  for (uint32_t l = 0; l < y.size(); ++l)
+    if (hy0[l] > .0)
+      sy += hy[l] / hy0[l];
+  return 1 - (sx / x.size() + sy / y.size()) / 2;
+}
@@ -0,0 +1,22 @@
+#ifndef NMI_HH
+#define NMI_HH
+
+#include "env.hh"
+
+//
+// Normalized mutual information between two overlapping covers
+// (Lancichinetti, Fortunato and Kertesz, 2009), the measure the
+// external mutual tool reports. Each community is a binary variable
+// over the nodes that appear in either cover; it is matched with the
+// community of the other cover that leaves it the least conditional
+// entropy, among those that are not anticorrelated with it, and
+//
+//   NMI = 1 - (H(X|Y)_norm + H(Y|X)_norm) / 2
+//
+// Only communities that share a node are compared. Their overlaps are
+// counted in one pass over the sorted member lists of one cover and a
+// node -> community index of the other.
+//
+double overlapping_nmi(const MapVec &x, const MapVec &y);
+
+#endif
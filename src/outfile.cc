@@ -0,0 +1,322 @@
+#include "outfile.hh"
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <vector>
+
+static const double POW10[OutBuf::MAX_PREC + 1] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+OutBuf::OutBuf(size_t cap)
+  : _buf(NULL), _len(0), _cap(0)
+{
+  if (cap > 0)
+    grow(cap);
+}
+
+OutBuf::~OutBuf()
+{
+  free(_buf);
+}
+
+void
+OutBuf::grow(size_t n)
+{
+  size_t cap = _cap > 0 ? _cap : 256;
+  while (cap < _len + n)
+    cap *= 2;
+  char *b = (char *)realloc(_buf, cap);
+  if (!b) {
+    fprintf(stderr, "out of memory formatting output\n");
+    abort();
+  }
+  _buf = b;
+  _cap = cap;
+}
+
+void
+OutBuf::overflow(size_t n)
+{
+  grow(n);
+}
+
+OutBuf &
+OutBuf::put(const char *s, size_t n)
+{
+  room(n);
+  memcpy(_buf + _len, s, n);
+  _len += n;
+  return *this;
+}
+
+OutBuf &
+OutBuf::put_uint(uint64_t v)
+{
+  char d[20];
+  uint32_t c = 0;
+  do {
+    d[c++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  room(c);
+  while (c)
+    _buf[_len++] = d[--c];
+  return *this;
+}
+
+OutBuf &
+OutBuf::put_int(int64_t v)
+{
+  if (v < 0) {
+    put('-');
+    return put_uint(-(uint64_t)v);
+  }
+  return put_uint(v);
+}
+
+//
+// x = |v| 10^prec carries a relative error of at most 2^-53, so when
+// its fraction is further than x 2^-52 from one half it rounds the
+// same way as the exact value printf rounds; otherwise, and for x at
+// or past 2^52 (or not a number), snprintf decides.
+//
+OutBuf &
+OutBuf::put_fixed(double v, uint32_t prec)
+{
+  double a = fabs(v);
+  double x = prec <= MAX_PREC ? a * POW10[prec] : HUGE_VAL;
+  double r = floor(x);
+  if (!(x < 4503599627370496.0) || fabs(x - r - 0.5) <= x * 2.3e-16) {
+    char b[512];
+    int c = snprintf(b, sizeof(b), "%.*f", (int)prec, v);
+    if (c < 0 || c >= (int)sizeof(b)) {
+      fprintf(stderr, "cannot format %g\n", v);
+      abort();
+    }
+    return put(b, c);
+  }
+  uint64_t u = (uint64_t)r + (x - r > 0.5 ? 1 : 0);
+  uint64_t scale = (uint64_t)POW10[prec];
+  if (signbit(v))
+    put('-');
+  put_uint(u / scale);
+  if (prec == 0)
+    return *this;
+  put('.');
+  uint64_t f = u % scale;
+  room(prec);
+  for (uint32_t i = prec; i > 0; --i) {
+    _buf[_len + i - 1] = '0' + f % 10;
+    f /= 10;
+  }
+  _len += prec;
+  return *this;
+}
+
+OutFile::OutFile()
+  : _f(NULL), _failed(false), _written(0)
+{
+}
+
+OutFile::~OutFile()
+{
+  if (_f)
+    close();
+}
+
+int
+OutFile::open(string fname, const char *mode)
+{
+  _f = fopen(fname.c_str(), mode);
+  if (!_f) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return -1;
+  }
+  // the buffer is ours; stdio would only copy it once more
+  setvbuf(_f, NULL, _IONBF, 0);
+  _fname = fname;
+  _failed = false;
+  _written = 0;
+  _len = 0;
+  if (_cap < BUFSIZE)
+    grow(BUFSIZE);
+  return 0;
+}
+
+int
+OutFile::flush()
+{
+  if (_len > 0 && !_failed && fwrite(_buf, 1, _len, _f) != _len) {
+    fprintf(stderr, "cannot write %s: %s\n", _fname.c_str(),
+	    strerror(errno));
+    _failed = true;
+  }
+  _written += _len;
+  _len = 0;
+  return _failed ? -1 : 0;
+}
+
+int
+OutFile::close()
+{
+  flush();
+  if (fclose(_f) != 0 && !_failed) {
+    fprintf(stderr, "cannot write %s: %s\n", _fname.c_str(),
+	    strerror(errno));
+    _failed = true;
+  }
+  _f = NULL;
+  return _failed ? -1 : 0;
+}
+
+void
+OutFile::overflow(size_t n)
+{
+  flush();
+  if (n > _cap)
+    grow(n);
+}
+
+int
+OutFile::put_rows(const RowFormatter &rf, uint32_t n, uint32_t nthreads)
+{
+  if (nthreads <= 1 || n < 2 * nthreads) {
+    for (uint32_t i = 0; i < n; ++i)
+      rf.format(i, *this);
+    return _failed ? -1 : 0;
+  }
+
+  // a round of ROWS_PER_ROUND rows at a time bounds the memory the
+  // formatted blocks take
+  vector<FormatThread *> threads(nthreads);
+  for (uint32_t begin = 0; begin < n; begin += ROWS_PER_ROUND) {
+    uint32_t end = n - begin > ROWS_PER_ROUND ? begin + ROWS_PER_ROUND : n;
+    uint64_t rows = end - begin;
+    for (uint32_t t = 0; t < nthreads; ++t) {
+      threads[t] = new FormatThread(rf, begin + rows * t / nthreads,
+				    begin + rows * (t + 1) / nthreads);
+      threads[t]->create();
+    }
+    for (uint32_t t = 0; t < nthreads; ++t) {
+      threads[t]->join();
+      put(threads[t]->out());
+      delete threads[t];
+    }
+  }
+  return _failed ? -1 : 0;
+}
+
+int
+FormatThread::do_work()
+{
+  for (uint32_t i = _begin; i < _end; ++i)
+    _rf.format(i, _out);
+  return 0;
+}
+
+int
+NpyFile::open(string fname, const char *type, uint64_t rows, uint64_t cols)
+{
+  if (OutFile::open(fname) < 0)
+    return -1;
+  uint16_t one = 1;
+  bool little = *(const char *)&one == 1;
+  char dict[128];
+  int c;
+  if (cols > 0)
+    c = snprintf(dict, sizeof(dict), "{'descr': '%c%s', 'fortran_order': "
+		 "False, 'shape': (%lu, %lu), }", little ? '<' : '>', type,
+		 (unsigned long)rows, (unsigned long)cols);
+  else
+    c = snprintf(dict, sizeof(dict), "{'descr': '%c%s', 'fortran_order': "
+		 "False, 'shape': (%lu,), }", little ? '<' : '>', type,
+		 (unsigned long)rows);
+
+  // magic, version and length take 10 bytes; the dictionary is padded
+  // with spaces and a newline so that the data starts 64-byte aligned
+  uint32_t hlen = (10 + c + 1 + 63) / 64 * 64 - 10;
+  uint8_t pre[10] = { 0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0,
+		      (uint8_t)(hlen & 0xff), (uint8_t)(hlen >> 8) };
+  put((const char *)pre, sizeof(pre));
+  put(dict, c);
+  for (uint32_t i = c; i < hlen - 1; ++i)
+    put(' ');
+  put('\n');
+  _expected = 10 + hlen + rows * (cols > 0 ? cols : 1) * (type[1] - '0');
+  return 0;
+}
+
+int
+NpyFile::close()
+{
+  uint64_t w = written();
+  int r = OutFile::close();
+  if (r == 0 && w != _expected) {
+    fprintf(stderr, "npy file has %lu bytes, expected %lu\n",
+	    (unsigned long)w, (unsigned long)_expected);
+    return -1;
+  }
+  return r;
+}
+
+//
+// Reads the header of a .npy file like the ones open() writes and
+// leaves f at the data. Fails unless the array holds values of type
+// in host byte order, in C order, with one dimension (cols = 0) or
+// two.
+//
+int
+NpyFile::read_header(FILE *f, string fname, const char *type,
+		     uint64_t &rows, uint64_t &cols)
+{
+  uint8_t pre[12];
+  if (fread(pre, 1, 10, f) != 10 || memcmp(pre, "\x93NUMPY", 6) != 0 ||
+      (pre[6] != 1 && pre[6] != 2)) {
+    fprintf(stderr, "%s is not a .npy file\n", fname.c_str());
+    return -1;
+  }
+  uint32_t hlen = pre[8] | pre[9] << 8;
+  if (pre[6] == 2) {
+    if (fread(pre + 10, 1, 2, f) != 2) {
+      fprintf(stderr, "%s is not a .npy file\n", fname.c_str());
+      return -1;
+    }
+    hlen |= pre[10] << 16 | pre[11] << 24;
+  }
+  string h(hlen, ' ');
+  if (hlen > 65536 || fread(&h[0], 1, hlen, f) != hlen) {
+    fprintf(stderr, "bad header in %s\n", fname.c_str());
+    return -1;
+  }
+
+  uint16_t one = 1;
+  string descr = string(*(const char *)&one == 1 ? "'<" : "'>") + type + "'";
+  size_t d = h.find("'descr':");
+  size_t o = h.find("'fortran_order':");
+  size_t s = h.find("'shape':");
+  if (d == string::npos || h.find(descr, d) != h.find_first_not_of(" ", d + 8) ||
+      o == string::npos || h.find("False", o) != h.find_first_not_of(" ", o + 16) ||
+      s == string::npos || (s = h.find('(', s)) == string::npos) {
+    fprintf(stderr, "%s does not hold %s values in C order\n",
+	    fname.c_str(), descr.c_str());
+    return -1;
+  }
+  const char *p = h.c_str() + s + 1;
+  char *q = NULL;
+  rows = strtoull(p, &q, 10);
+  cols = 0;
+  while (*q == ' ' || *q == ',')
+    q++;
+  if (*q != ')') {
+    p = q;
+    cols = strtoull(p, &q, 10);
+    while (*q == ' ' || *q == ',')
+      q++;
+  }
+  if (q == p || *q != ')') {
+    fprintf(stderr, "%s does not hold a 1-d or 2-d array\n", fname.c_str());
+    return -1;
+  }
+  return 0;
+}
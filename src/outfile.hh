@@ -0,0 +1,131 @@
+#ifndef OUTFILE_HH
+#define OUTFILE_HH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "thread.hh"
+
+using namespace std;
+
+//
+// Text formatted straight into a growing memory buffer. put_fixed()
+// gives exactly what printf's "%.<prec>f" gives, but from the value
+// scaled and rounded to an integer; only the rare values whose scaled
+// product lies too close to a rounding tie to decide from a double,
+// and values too large for it, go through snprintf.
+//
+class OutBuf {
+public:
+  OutBuf(size_t cap = 0);
+  virtual ~OutBuf();
+
+  OutBuf &put(char c) { room(1); _buf[_len++] = c; return *this; }
+  OutBuf &put(const char *s) { return put(s, strlen(s)); }
+  OutBuf &put(const string &s) { return put(s.data(), s.size()); }
+  OutBuf &put(const char *s, size_t n);
+  OutBuf &put(const OutBuf &b) { return put(b._buf, b._len); }
+  OutBuf &put_uint(uint64_t v);
+  OutBuf &put_int(int64_t v);
+  OutBuf &put_fixed(double v, uint32_t prec);
+
+  const char *data() const { return _buf; }
+  size_t size() const { return _len; }
+  void clear() { _len = 0; }
+
+  static const uint32_t MAX_PREC = 9;
+
+protected:
+  void room(size_t n) { if (_len + n > _cap) overflow(n); }
+  virtual void overflow(size_t n);
+  void grow(size_t n);
+
+  char *_buf;
+  size_t _len;
+  size_t _cap;
+
+private:
+  OutBuf(const OutBuf &);
+  OutBuf &operator=(const OutBuf &);
+};
+
+// formats row i of a file into out; may be called from several
+// threads at once
+class RowFormatter {
+public:
+  virtual ~RowFormatter() { }
+  virtual void format(uint32_t i, OutBuf &out) const = 0;
+};
+
+//
+// A result file written through a large OutBuf: the buffer goes to
+// the file only when it fills and on close(), so a file costs a few
+// large writes instead of one stdio call per value. put_rows()
+// formats rows in blocks over several threads and writes the blocks
+// in row order, so the file is the same for any number of threads.
+//
+class OutFile : public OutBuf {
+public:
+  OutFile();
+  ~OutFile();
+
+  int open(string fname, const char *mode = "w");
+  int close();
+  bool is_open() const { return _f != NULL; }
+  int flush();
+  int put_rows(const RowFormatter &rf, uint32_t n, uint32_t nthreads);
+  uint64_t written() const { return _written + _len; }
+
+  static const size_t BUFSIZE = 4 << 20;
+  static const uint32_t ROWS_PER_ROUND = 1 << 16;
+
+private:
+  void overflow(size_t n);
+
+  FILE *_f;
+  string _fname;
+  bool _failed;
+  uint64_t _written;
+};
+
+//
+// A NumPy array file: the format 1.0 header, then rows x cols values
+// of type ("f8" or "u4") in C order and host byte order, which the
+// header names. Rows are put() as they are produced, so no second
+// copy of the array is made; np.load(fname, mmap_mode='r') maps the
+// file without parsing it. cols = 0 makes a 1-d array. close() fails
+// unless exactly rows x cols values were put.
+//
+class NpyFile : public OutFile {
+public:
+  NpyFile(): _expected(0) { }
+
+  int open(string fname, const char *type, uint64_t rows,
+	   uint64_t cols = 0);
+  int close();
+
+  static int read_header(FILE *f, string fname, const char *type,
+			 uint64_t &rows, uint64_t &cols);
+
+private:
+  uint64_t _expected;
+};
+
+class FormatThread : public Thread {
+public:
+  FormatThread(const RowFormatter &rf, uint32_t begin, uint32_t end)
+    : _rf(rf), _begin(begin), _end(end) { }
+  ~FormatThread() { }
+
+  int do_work();
+  const OutBuf &out() const { return _out; }
+
+private:
+  const RowFormatter &_rf;
+  uint32_t _begin;
+  uint32_t _end;
+  OutBuf _out;
+};
+
+#endif
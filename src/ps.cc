@@ -0,0 +1,593 @@
+#include "ps.hh"
+#include "log.hh"
+#include "sockio.hh"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <algorithm>
+
+string
+ParamServer::default_path()
+{
+  char buf[64];
+  sprintf(buf, "/tmp/nodepop-ps-%d.sock", (int)getpid());
+  return string(buf);
+}
+
+// the socket of the server of range; path is the -ps path
+string
+ParamServer::range_path(string path, uint32_t range)
+{
+  char buf[16];
+  sprintf(buf, ".%d", range);
+  return path + buf;
+}
+
+ParamServer::ParamServer(string path, uint32_t nshards, uint32_t range)
+  : _path(range_path(path, range)), _nshards(nshards), _range(range),
+    _lfd(-1), _init(false), _begin(0), _end(0), _gamma(NULL), _lambda(NULL),
+    _mu(NULL), _mut(NULL), _mut_ag(NULL), _globalmu(.0),
+    _iter(0), _nsampled(0), _stop(false), _ready(false), _lost(0)
+{
+  memset(&_params, 0, sizeof(_params));
+}
+
+ParamServer::~ParamServer()
+{
+  for (uint32_t i = 0; i < _fds.size(); ++i)
+    close(_fds[i]);
+  if (_lfd >= 0) {
+    close(_lfd);
+    unlink(_path.c_str());
+  }
+  delete _gamma;
+  delete _lambda;
+  delete _mu;
+  delete _mut;
+  delete _mut_ag;
+}
+
+int
+ParamServer::run()
+{
+  struct sockaddr_un addr;
+  if (sockaddr_set(addr, _path) < 0)
+    return -1;
+  unlink(_path.c_str());
+  _lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (_lfd < 0 ||
+      bind(_lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(_lfd, _nshards) < 0) {
+    fprintf(stderr, "cannot listen on %s: %s\n",
+	    _path.c_str(), strerror(errno));
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stdout, "+ parameter server %d listening on %s for %d shards\n",
+	  _range, _path.c_str(), _nshards);
+  fflush(stdout);
+
+  // connections are taken at any time, from a restarted worker or
+  // the evaluator
+  uint32_t nconnected = 0;
+  while (nconnected < _nshards || _fds.size() > 0) {
+    vector<struct pollfd> pfds(_fds.size() + 1);
+    pfds[0].fd = _lfd;
+    pfds[0].events = POLLIN;
+    for (uint32_t i = 0; i < _fds.size(); ++i) {
+      pfds[i+1].fd = _fds[i];
+      pfds[i+1].events = POLLIN;
+    }
+    int timeout = -1;
+    if (_lost) {
+      time_t left = _lost + RECONNECT_SECS - time(0);
+      timeout = left > 0 ? left * 1000 : 0;
+    }
+    if (poll(&pfds[0], pfds.size(), timeout) < 0) {
+      if (errno == EINTR)
+	continue;
+      fprintf(stderr, "poll failed: %s\n", strerror(errno));
+      return -1;
+    }
+    if (pfds[0].revents & POLLIN) {
+      int fd = accept(_lfd, NULL, NULL);
+      if (fd >= 0) {
+	_fds.push_back(fd);
+	_fd_shard.push_back(-1);
+	nconnected++;
+      }
+    }
+    for (uint32_t i = 1; i < pfds.size(); ++i)
+      if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+	if (handle(pfds[i].fd) < 0)
+	  close_fd(pfds[i].fd);
+
+    if (_lost && time(0) >= _lost + (time_t)RECONNECT_SECS) {
+      fprintf(stderr, "parameter server %d: a worker has been gone for "
+	      "%d seconds; stopping training\n", _range, RECONNECT_SECS);
+      _lost = 0;
+      stop_training();
+    }
+  }
+  fprintf(stdout, "+ parameter server %d done after %d iterations\n",
+	  _range, _iter);
+  return 0;
+}
+
+// the workers connected, not counting the evaluator
+uint32_t
+ParamServer::nworkers() const
+{
+  uint32_t c = 0;
+  for (uint32_t i = 0; i < _fd_shard.size(); ++i)
+    if (_fd_shard[i] >= 0 && (uint32_t)_fd_shard[i] < _nshards)
+      c++;
+  return c;
+}
+
+void
+ParamServer::close_fd(int fd)
+{
+  close(fd);
+  uint32_t i = std::find(_fds.begin(), _fds.end(), fd) - _fds.begin();
+  bool worker = _fd_shard[i] >= 0 && (uint32_t)_fd_shard[i] < _nshards;
+  _fds.erase(_fds.begin() + i);
+  _fd_shard.erase(_fd_shard.begin() + i);
+
+  // the gradient of a worker that went away is dropped; the worker
+  // that replaces it pushes its own
+  for (i = 0; i < _mu_waiting.size(); ++i)
+    if (_mu_waiting[i] == fd) {
+      _mu_waiting.erase(_mu_waiting.begin() + i);
+      _mu_pushed.erase(_mu_pushed.begin() + i);
+      _mu_nsampled.erase(_mu_nsampled.begin() + i);
+      break;
+    }
+  vector<int>::iterator itr = std::find(_sync_waiting.begin(),
+					_sync_waiting.end(), fd);
+  if (itr != _sync_waiting.end())
+    _sync_waiting.erase(itr);
+  for (i = 0; i < _iter_waiting.size(); ++i)
+    if (_iter_waiting[i].first == fd) {
+      _iter_waiting.erase(_iter_waiting.begin() + i);
+      break;
+    }
+
+  // the others wait at the next mu update for the worker to come
+  // back; only the server holding that barrier keeps the time
+  if (worker && _range == 0 && !_stop && !_lost && nworkers() < _nshards)
+    _lost = time(0);
+}
+
+void
+ParamServer::reply_mu()
+{
+  PSMsg r(PSMsg::MU, 0, 0, _iter);
+  uint32_t stop = _stop ? 1 : 0;
+  for (uint32_t i = 0; i < _mu_waiting.size(); ++i) {
+    int fd = _mu_waiting[i];
+    writen(fd, &r, sizeof(r));
+    writen(fd, _mu->data(), _params.k * sizeof(double));
+    writen(fd, &_globalmu, sizeof(double));
+    writen(fd, &stop, sizeof(stop));
+  }
+  _mu_waiting.clear();
+  _mu_pushed.clear();
+  _mu_nsampled.clear();
+}
+
+void
+ParamServer::reply_sync()
+{
+  PSMsg r(PSMsg::SYNC, 0, 0, _iter);
+  for (uint32_t i = 0; i < _sync_waiting.size(); ++i)
+    writen(_sync_waiting[i], &r, sizeof(r));
+  _sync_waiting.clear();
+}
+
+// answers the WAITs for iterations that are done, or all of them once
+// training has stopped
+void
+ParamServer::reply_wait()
+{
+  PSMsg r(PSMsg::WAIT, 0, _stop ? 1 : 0, _iter);
+  for (uint32_t i = 0; i < _iter_waiting.size(); ) {
+    if (!_stop && (!_ready || _iter < _iter_waiting[i].second)) {
+      ++i;
+      continue;
+    }
+    writen(_iter_waiting[i].first, &r, sizeof(r));
+    _iter_waiting.erase(_iter_waiting.begin() + i);
+  }
+}
+
+void
+ParamServer::stop_training()
+{
+  _stop = true;
+  reply_mu();
+  reply_sync();
+  reply_wait();
+}
+
+int
+ParamServer::hello(const PSParams &p)
+{
+  if (_init) {
+    if (p.n == _params.n && p.k == _params.k)
+      return 0;
+    fprintf(stderr, "parameter server %d: a worker has n = %d, K = %d, "
+	    "not n = %d, K = %d\n", _range, p.n, p.k, _params.n, _params.k);
+    return -1;
+  }
+  _params = p;
+  shard_range(p.n, _nshards, _range, _begin, _end);
+  _gamma = new Matrix(_end - _begin, p.k);
+  _lambda = new Array(_end - _begin);
+  _mu = new Array(p.k);
+  _mut = new Array(p.k);
+  _mut_ag = new Array(p.k);
+  _init = true;
+  fprintf(stdout, "+ parameter server %d: n = %d, K = %d, rows %d to %d\n",
+	  _range, p.n, p.k, _begin, _end - 1);
+  fflush(stdout);
+  return 0;
+}
+
+// row ids come off the socket; a request for a row this server does
+// not hold closes the connection that sent it
+int
+ParamServer::check_ids(const vector<uint32_t> &ids, uint32_t shard) const
+{
+  for (uint32_t i = 0; i < ids.size(); ++i)
+    if (ids[i] < _begin || ids[i] >= _end) {
+      fprintf(stderr, "parameter server %d: shard %d asked for row %d, "
+	      "not in rows %d to %d\n", _range, shard, ids[i],
+	      _begin, _end - 1);
+      return -1;
+    }
+  return 0;
+}
+
+void
+ParamServer::update_mu()
+{
+  // same update as GLMNetwork::randomnode_infer(), applied once for
+  // every node sampled by any shard in this iteration
+  double globalmut = .0;
+  Array &mu = *_mu, &mut = *_mut, &mut_ag = *_mut_ag;
+  for (uint32_t i = 0; i < _mu_pushed.size(); ++i) {
+    for (uint32_t k = 0; k < _params.k; ++k)
+      mut[k] += _mu_pushed[i][k];
+    _nsampled += _mu_nsampled[i];
+  }
+  for (uint32_t k = 0; k < _params.k; ++k) {
+    globalmut += mut[k];
+    mut[k] = mut[k] + ((_params.mu0 - mu[k]) / (_params.sigma0 * _params.sigma0));
+    mut_ag[k] += mut[k] * mut[k];
+  }
+  globalmut += (_params.mu0 - _globalmu) / (_params.sigma0 * _params.sigma0);
+  double murho = pow(_params.mutau0 + _iter, -1 * _params.mukappa);
+
+  for (uint32_t i = 0; i < _nsampled; ++i) {
+    for (uint32_t k = 0; k < _params.k; ++k) {
+      if (_params.adagrad)
+	mu[k] += mut[k] / sqrt(mut_ag[k]);
+      else
+	mu[k] += murho * mut[k];
+      if (mu[k] < .0)
+	mu[k] = .0;
+    }
+    _globalmu += murho * globalmut;
+    if (_globalmu < .0)
+      _globalmu = .0;
+  }
+  mut.zero();
+  _nsampled = 0;
+  _iter++;
+}
+
+int
+ParamServer::handle(int fd)
+{
+  PSMsg m;
+  if (readn(fd, &m, sizeof(m)) < 0)
+    return -1;
+
+  uint32_t k = _params.k;
+  switch (m.op) {
+  case PSMsg::HELLO: {
+    PSParams p;
+    if (readn(fd, &p, sizeof(p)) < 0 || hello(p) < 0)
+      return -1;
+    uint32_t i = std::find(_fds.begin(), _fds.end(), fd) - _fds.begin();
+    _fd_shard[i] = m.shard;
+    if (_lost && nworkers() >= _nshards)
+      _lost = 0;
+    PSMsg r(PSMsg::HELLO, m.shard, _nshards, _iter);
+    return writen(fd, &r, sizeof(r));
+  }
+  case PSMsg::GET: {
+    // a request names each row at most once
+    if (!_init || m.count > _end - _begin)
+      return -1;
+    vector<uint32_t> ids(m.count);
+    if (m.count > 0 && readn(fd, &ids[0], m.count * sizeof(uint32_t)) < 0)
+      return -1;
+    if (check_ids(ids, m.shard) < 0)
+      return -1;
+    PSMsg r(PSMsg::GET, m.shard, m.count, _iter);
+    if (writen(fd, &r, sizeof(r)) < 0)
+      return -1;
+    const double * const *gd = _gamma->const_data();
+    for (uint32_t i = 0; i < m.count; ++i) {
+      uint32_t r = ids[i] - _begin;
+      if (writen(fd, gd[r], k * sizeof(double)) < 0 ||
+	  writen(fd, &(*_lambda)[r], sizeof(double)) < 0)
+	return -1;
+    }
+    return 0;
+  }
+  case PSMsg::PUT: {
+    if (!_init || m.count > _end - _begin)
+      return -1;
+    vector<uint32_t> ids(m.count);
+    if (m.count > 0 && readn(fd, &ids[0], m.count * sizeof(uint32_t)) < 0)
+      return -1;
+    if (check_ids(ids, m.shard) < 0)
+      return -1;
+    double **gd = _gamma->data();
+    for (uint32_t i = 0; i < m.count; ++i) {
+      uint32_t r = ids[i] - _begin;
+      if (readn(fd, gd[r], k * sizeof(double)) < 0 ||
+	  readn(fd, &(*_lambda)[r], sizeof(double)) < 0)
+	return -1;
+    }
+    PSMsg r(PSMsg::PUT, m.shard, m.count, _iter);
+    return writen(fd, &r, sizeof(r));
+  }
+  case PSMsg::MU: {
+    if (!_init)
+      return -1;
+    vector<double> mut(k);
+    if (readn(fd, &mut[0], k * sizeof(double)) < 0)
+      return -1;
+    _mu_waiting.push_back(fd);
+    _mu_pushed.push_back(mut);
+    _mu_nsampled.push_back(m.count);
+    if (!_stop) {
+      if (_mu_waiting.size() < _nshards)
+	return 0;
+      update_mu();
+    }
+
+    // every shard has pushed its gradient, or training is over
+    reply_mu();
+    reply_wait();
+    return 0;
+  }
+  case PSMsg::SYNC: {
+    // the first time, every shard has published its initial rows; a
+    // worker that restarts later is let through at once
+    _sync_waiting.push_back(fd);
+    if (!_ready && _sync_waiting.size() < _nshards)
+      return 0;
+    _ready = true;
+    reply_sync();
+    reply_wait();
+    return 0;
+  }
+  case PSMsg::WAIT:
+    _iter_waiting.push_back(std::make_pair(fd, m.iter));
+    reply_wait();
+    return 0;
+  case PSMsg::STOP: {
+    stop_training();
+    PSMsg r(PSMsg::STOP, m.shard, 0, _iter);
+    return writen(fd, &r, sizeof(r));
+  }
+  default:
+    fprintf(stderr, "parameter server: bad message %d from shard %d\n",
+	    m.op, m.shard);
+    return -1;
+  }
+}
+
+PSClient::PSClient(string path, uint32_t shard, uint32_t nshards)
+  : _path(path), _shard(shard), _nshards(nshards), _n(0), _k(0),
+    _fds(nshards, -1), _byrange(nshards)
+{
+}
+
+PSClient::~PSClient()
+{
+  for (uint32_t r = 0; r < _fds.size(); ++r)
+    if (_fds[r] >= 0)
+      close(_fds[r]);
+}
+
+int
+PSClient::connect_server()
+{
+  for (uint32_t r = 0; r < _nshards; ++r) {
+    string path = ParamServer::range_path(_path, r);
+    struct sockaddr_un addr;
+    if (sockaddr_set(addr, path) < 0)
+      return -1;
+    // the server may still be starting up
+    for (uint32_t i = 0; i < 300 && _fds[r] < 0; ++i) {
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0)
+	return -1;
+      if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+	_fds[r] = fd;
+      else {
+	close(fd);
+	usleep(100000);
+      }
+    }
+    if (_fds[r] < 0) {
+      lerr("cannot connect to parameter server %s: %s",
+	   path.c_str(), strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int
+PSClient::send(int fd, const PSMsg &m, const void *a, size_t alen,
+	       const void *b, size_t blen)
+{
+  if (writen(fd, &m, sizeof(m)) < 0 ||
+      (alen > 0 && writen(fd, a, alen) < 0) ||
+      (blen > 0 && writen(fd, b, blen) < 0)) {
+    lerr("parameter server write failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int
+PSClient::recv(int fd, PSMsg &m)
+{
+  if (readn(fd, &m, sizeof(m)) < 0) {
+    lerr("parameter server read failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int
+PSClient::hello(const PSParams &p)
+{
+  _n = p.n;
+  _k = p.k;
+  for (uint32_t r = 0; r < _nshards; ++r) {
+    PSMsg m(PSMsg::HELLO, _shard, 0, 0);
+    if (send(_fds[r], m, &p, sizeof(p)) < 0 || recv(_fds[r], m) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// sorts ids into the ranges of the servers that hold them
+void
+PSClient::split(const vector<uint32_t> &ids)
+{
+  for (uint32_t r = 0; r < _nshards; ++r)
+    _byrange[r].clear();
+  for (uint32_t i = 0; i < ids.size(); ++i)
+    _byrange[ParamServer::shard_of(_n, _nshards, ids[i])].push_back(ids[i]);
+}
+
+//
+// Every request goes out before any reply is read, so the servers of
+// all ranges work on one call's rows at the same time.
+//
+int
+PSClient::get_rows(const vector<uint32_t> &ids, Matrix &gamma, Array &lambda)
+{
+  split(ids);
+  for (uint32_t r = 0; r < _nshards; ++r) {
+    const vector<uint32_t> &v = _byrange[r];
+    PSMsg m(PSMsg::GET, _shard, v.size(), 0);
+    if (v.size() > 0 &&
+	send(_fds[r], m, &v[0], v.size() * sizeof(uint32_t)) < 0)
+      return -1;
+  }
+  double **gd = gamma.data();
+  for (uint32_t r = 0; r < _nshards; ++r) {
+    const vector<uint32_t> &v = _byrange[r];
+    PSMsg m;
+    if (v.size() == 0)
+      continue;
+    if (recv(_fds[r], m) < 0)
+      return -1;
+    for (uint32_t i = 0; i < v.size(); ++i)
+      if (readn(_fds[r], gd[v[i]], _k * sizeof(double)) < 0 ||
+	  readn(_fds[r], &lambda[v[i]], sizeof(double)) < 0)
+	return -1;
+  }
+  return 0;
+}
+
+int
+PSClient::put_rows(const vector<uint32_t> &ids,
+		   const Matrix &gamma, const Array &lambda)
+{
+  split(ids);
+  const double * const *gd = gamma.const_data();
+  const double * const ld = lambda.const_data();
+  for (uint32_t r = 0; r < _nshards; ++r) {
+    const vector<uint32_t> &v = _byrange[r];
+    PSMsg m(PSMsg::PUT, _shard, v.size(), 0);
+    if (v.size() == 0)
+      continue;
+    if (send(_fds[r], m, &v[0], v.size() * sizeof(uint32_t)) < 0)
+      return -1;
+    for (uint32_t i = 0; i < v.size(); ++i)
+      if (writen(_fds[r], gd[v[i]], _k * sizeof(double)) < 0 ||
+	  writen(_fds[r], ld + v[i], sizeof(double)) < 0)
+	return -1;
+  }
+  for (uint32_t r = 0; r < _nshards; ++r) {
+    PSMsg m;
+    if (_byrange[r].size() > 0 && recv(_fds[r], m) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// mu, the barrier and stop are handled by the server of range 0
+int
+PSClient::push_mu(uint32_t iter, uint32_t nsampled, const Array &mut,
+		  Array &mu, double &globalmu, bool &stop)
+{
+  PSMsg m(PSMsg::MU, _shard, nsampled, iter);
+  uint32_t s;
+  int fd = _fds[0];
+  if (send(fd, m, mut.const_data(), _k * sizeof(double)) < 0 ||
+      recv(fd, m) < 0 ||
+      readn(fd, mu.data(), _k * sizeof(double)) < 0 ||
+      readn(fd, &globalmu, sizeof(double)) < 0 ||
+      readn(fd, &s, sizeof(s)) < 0)
+    return -1;
+  stop = s;
+  return 0;
+}
+
+int
+PSClient::sync()
+{
+  PSMsg m(PSMsg::SYNC, _shard, 0, 0);
+  if (send(_fds[0], m, NULL, 0) < 0 || recv(_fds[0], m) < 0)
+    return -1;
+  return 0;
+}
+
+// waits until the server of range 0 is done with iteration iter, and
+// returns the iteration it is at; stop is set once training is over
+int
+PSClient::wait(uint32_t iter, uint32_t &at, bool &stop)
+{
+  PSMsg m(PSMsg::WAIT, _shard, 0, iter);
+  if (send(_fds[0], m, NULL, 0) < 0 || recv(_fds[0], m) < 0)
+    return -1;
+  at = m.iter;
+  stop = m.count;
+  return 0;
+}
+
+int
+PSClient::stop()
+{
+  PSMsg m(PSMsg::STOP, _shard, 0, 0);
+  if (send(_fds[0], m, NULL, 0) < 0 || recv(_fds[0], m) < 0)
+    return -1;
+  return 0;
+}
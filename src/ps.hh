@@ -0,0 +1,158 @@
+#ifndef PS_HH
+#define PS_HH
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include "env.hh"
+
+//
+// Parameter server for sharded training (-shards N).
+//
+// Each worker process owns a contiguous range of nodes and is the only
+// writer of their gamma and lambda rows. There is one server per
+// range, listening on range_path(); it keeps the latest copy of that
+// range's rows only, so no worker needs room for the whole model.
+// Every worker connects to every server and fetches the rows owned by
+// other shards from the servers of their ranges. The server of range
+// 0 also sums the mu gradients of all shards and applies them once per
+// iteration, holds the barriers, and tells the evaluator (-ps-eval),
+// which fetches every row at each report, when an iteration is done.
+//
+// A worker that goes away may be restarted and reconnect; the others
+// wait for it at the next mu update, and training is stopped only if
+// it stays away for RECONNECT_SECS. Messages go over Unix domain
+// sockets.
+//
+class PSMsg {
+public:
+  typedef enum { HELLO = 1, GET, PUT, MU, SYNC, STOP, WAIT } Op;
+
+  PSMsg(): op(0), shard(0), count(0), iter(0) { }
+  PSMsg(uint32_t o, uint32_t s, uint32_t c, uint32_t i)
+    : op(o), shard(s), count(c), iter(i) { }
+
+  uint32_t op;
+  uint32_t shard;
+  uint32_t count;
+  uint32_t iter;
+};
+
+// model sizes and mu hyperparameters, sent by every worker with HELLO
+class PSParams {
+public:
+  uint32_t n;
+  uint32_t k;
+  uint32_t adagrad;
+  double mu0;
+  double sigma0;
+  double mutau0;
+  double mukappa;
+};
+
+class ParamServer {
+public:
+  ParamServer(string path, uint32_t nshards, uint32_t range);
+  ~ParamServer();
+
+  int run();
+
+  static void shard_range(uint32_t n, uint32_t nshards, uint32_t shard,
+			  uint32_t &begin, uint32_t &end);
+  static uint32_t shard_of(uint32_t n, uint32_t nshards, uint32_t node);
+  static string default_path();
+  static string range_path(string path, uint32_t range);
+
+  static const uint32_t RECONNECT_SECS = 60;
+
+private:
+  int handle(int fd);
+  int hello(const PSParams &p);
+  int check_ids(const std::vector<uint32_t> &ids, uint32_t shard) const;
+  void update_mu();
+  void reply_mu();
+  void reply_sync();
+  void reply_wait();
+  void stop_training();
+  uint32_t nworkers() const;
+  void close_fd(int fd);
+
+  string _path;
+  uint32_t _nshards;
+  uint32_t _range;
+  int _lfd;
+  std::vector<int> _fds;
+  std::vector<int32_t> _fd_shard;   // the shard of each of _fds, from HELLO
+
+  PSParams _params;
+  bool _init;
+  uint32_t _begin;   // rows [_begin, _end) are served here
+  uint32_t _end;
+  Matrix *_gamma;
+  Array *_lambda;
+  Array *_mu;
+  Array *_mut;
+  Array *_mut_ag;
+  double _globalmu;
+
+  uint32_t _iter;
+  uint32_t _nsampled;
+  bool _stop;
+  bool _ready;       // every shard has published its initial rows
+  time_t _lost;      // when a worker went away, 0 if none is missing
+  std::vector<int> _mu_waiting;
+  std::vector<std::vector<double> > _mu_pushed;  // gradient of each waiting
+  std::vector<uint32_t> _mu_nsampled;
+  std::vector<int> _sync_waiting;
+  std::vector<std::pair<int, uint32_t> > _iter_waiting;
+};
+
+class PSClient {
+public:
+  PSClient(string path, uint32_t shard, uint32_t nshards);
+  ~PSClient();
+
+  int connect_server();
+  int hello(const PSParams &p);
+  int get_rows(const std::vector<uint32_t> &ids, Matrix &gamma, Array &lambda);
+  int put_rows(const std::vector<uint32_t> &ids,
+	       const Matrix &gamma, const Array &lambda);
+  int push_mu(uint32_t iter, uint32_t nsampled, const Array &mut,
+	      Array &mu, double &globalmu, bool &stop);
+  int sync();
+  int wait(uint32_t iter, uint32_t &at, bool &stop);
+  int stop();
+
+private:
+  int send(int fd, const PSMsg &m, const void *a, size_t alen,
+	   const void *b = NULL, size_t blen = 0);
+  int recv(int fd, PSMsg &m);
+  void split(const std::vector<uint32_t> &ids);
+
+  string _path;
+  uint32_t _shard;
+  uint32_t _nshards;
+  uint32_t _n;
+  uint32_t _k;
+  std::vector<int> _fds;   // to the server of each range
+  std::vector<std::vector<uint32_t> > _byrange;  // split() of a request
+};
+
+inline void
+ParamServer::shard_range(uint32_t n, uint32_t nshards, uint32_t shard,
+			 uint32_t &begin, uint32_t &end)
+{
+  begin = (uint64_t)n * shard / nshards;
+  end = (uint64_t)n * (shard + 1) / nshards;
+}
+
+// the shard whose range holds node
+inline uint32_t
+ParamServer::shard_of(uint32_t n, uint32_t nshards, uint32_t node)
+{
+  return ((uint64_t)(node + 1) * nshards - 1) / n;
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef RNG_HH
+#define RNG_HH
+
+#include <stdint.h>
+#include <math.h>
+
+//
+// Counter-based random streams (Philox4x32-10, Salmon et al., SC'11).
+//
+// A stream is identified by (seed, stream, iter, node); the k-th draw
+// of a stream is a pure function of those values and k, so draws do
+// not depend on which thread makes them or in what order.
+//
+class CRng {
+public:
+  typedef enum { INIT = 1, SHUFFLE, MINIBATCH, NONLINKS, HELDOUT } Stream;
+
+  CRng(uint64_t seed, uint32_t stream, uint32_t iter, uint32_t node);
+
+  uint32_t next();
+  double uniform();              // [0,1)
+  double uniform_pos();          // (0,1)
+  uint32_t uniform_int(uint32_t n);
+  double gaussian(double sigma);
+  double gamma(double a, double b);
+
+  template<class T> void shuffle(T *v, uint32_t n);
+
+private:
+  static void round(uint32_t *ctr, const uint32_t *key);
+  void refill();
+
+  uint32_t _key[2];
+  uint32_t _ctr[4];
+  uint32_t _buf[4];
+  uint32_t _pos;
+};
+
+inline
+CRng::CRng(uint64_t seed, uint32_t stream, uint32_t iter, uint32_t node)
+  : _pos(4)
+{
+  _key[0] = (uint32_t)seed;
+  _key[1] = (uint32_t)(seed >> 32);
+  _ctr[0] = 0;
+  _ctr[1] = node;
+  _ctr[2] = iter;
+  _ctr[3] = stream;
+}
+
+inline void
+CRng::round(uint32_t *ctr, const uint32_t *key)
+{
+  uint64_t p0 = (uint64_t)0xD2511F53 * ctr[0];
+  uint64_t p1 = (uint64_t)0xCD9E8D57 * ctr[2];
+  uint32_t hi0 = (uint32_t)(p0 >> 32), lo0 = (uint32_t)p0;
+  uint32_t hi1 = (uint32_t)(p1 >> 32), lo1 = (uint32_t)p1;
+  uint32_t c1 = ctr[1], c3 = ctr[3];
+  ctr[0] = hi1 ^ c1 ^ key[0];
+  ctr[1] = lo1;
+  ctr[2] = hi0 ^ c3 ^ key[1];
+  ctr[3] = lo0;
+}
+
+inline void
+CRng::refill()
+{
+  uint32_t key[2] = { _key[0], _key[1] };
+  for (uint32_t i = 0; i < 4; ++i)
+    _buf[i] = _ctr[i];
+  for (uint32_t r = 0; r < 10; ++r) {
+    if (r > 0) {
+      key[0] += 0x9E3779B9;
+      key[1] += 0xBB67AE85;
+    }
+    round(_buf, key);
+  }
+  _ctr[0]++; // 2^32 blocks per stream
+  _pos = 0;
+}
+
+inline uint32_t
+CRng::next()
+{
+  if (_pos == 4)
+    refill();
+  return _buf[_pos++];
+}
+
+inline double
+CRng::uniform()
+{
+  return next() / 4294967296.0;
+}
+
+inline double
+CRng::uniform_pos()
+{
+  double u;
+  do {
+    u = uniform();
+  } while (u == .0);
+  return u;
+}
+
+inline uint32_t
+CRng::uniform_int(uint32_t n)
+{
+  // rejection sampling avoids the modulo bias
+  uint32_t limit = 0xFFFFFFFF - (0xFFFFFFFF % n);
+  uint32_t v;
+  do {
+    v = next();
+  } while (v >= limit);
+  return v % n;
+}
+
+inline double
+CRng::gaussian(double sigma)
+{
+  // Box-Muller; the second variate is discarded so that the number
+  // of draws per call is fixed
+  double u = uniform_pos();
+  double v = uniform();
+  return sigma * sqrt(-2.0 * log(u)) * cos(2 * M_PI * v);
+}
+
+inline double
+CRng::gamma(double a, double b)
+{
+  // Marsaglia and Tsang (2000)
+  if (a < 1) {
+    double u = uniform_pos();
+    return gamma(1.0 + a, b) * pow(u, 1.0 / a);
+  }
+  double d = a - 1.0 / 3;
+  double c = (1.0 / 3) / sqrt(d);
+  for (;;) {
+    double x, v;
+    do {
+      x = gaussian(1.0);
+      v = 1.0 + c * x;
+    } while (v <= 0);
+    v = v * v * v;
+    double u = uniform_pos();
+    if (u < 1 - 0.0331 * x * x * x * x)
+      return b * d * v;
+    if (log(u) < 0.5 * x * x + d * (1 - v + log(v)))
+      return b * d * v;
+  }
+}
+
+template<class T> inline void
+CRng::shuffle(T *v, uint32_t n)
+{
+  for (uint32_t i = n; i > 1; --i) {
+    uint32_t j = uniform_int(i);
+    T t = v[i-1];
+    v[i-1] = v[j];
+    v[j] = t;
+  }
+}
+
+#endif
@@ -0,0 +1,176 @@
+#include "score.hh"
+#include "log.hh"
+#include <string.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <vector>
+
+PairScorer::PairScorer(string dir, uint32_t nthreads, bool globalmu)
+  : _dir(dir), _nthreads(nthreads > 0 ? nthreads : 1),
+    _globalmu(globalmu), _model(NULL)
+{
+}
+
+PairScorer::~PairScorer()
+{
+  delete _model;
+}
+
+int
+PairScorer::load()
+{
+  struct timeval start, end, d;
+  gettimeofday(&start, NULL);
+  _model = LinkModel::load(_dir, _globalmu);
+  if (!_model)
+    return -1;
+  gettimeofday(&end, NULL);
+  timeval_subtract(&d, &end, &start);
+  fprintf(stdout, "+ loaded model: n = %d, K = %d in %.3f s\n",
+	  _model->n(), _model->k(), d.tv_sec + d.tv_usec / 1e6);
+  fflush(stdout);
+  return 0;
+}
+
+// reads an id at p, after blanks, and moves p past it; fails
+// without reading past eol
+static bool
+parse_id(const char *&p, const char *eol, uint32_t &id)
+{
+  while (p < eol && (*p == ' ' || *p == '\t'))
+    p++;
+  if (p == eol || *p < '0' || *p > '9')
+    return false;
+  char *q = NULL;
+  unsigned long v = strtoul(p, &q, 10);
+  if (q > eol || v > 0xffffffffUL)
+    return false;
+  id = v;
+  p = q;
+  return true;
+}
+
+//
+// A line is two ids, separated and optionally followed by blanks;
+// anything after a blank that follows the second id is ignored.
+// Blank lines and lines starting with '#' are skipped; any other
+// line is counted as bad.
+//
+int
+ScoreThread::do_work()
+{
+  const char *p = _begin;
+  while (p < _end) {
+    const char *eol = (const char *)memchr(p, '\n', _end - p);
+    if (!eol)
+      eol = _end;
+    const char *e = eol;
+    if (e > p && e[-1] == '\r')
+      e--;
+    const char *s = p;
+    while (s < e && (*s == ' ' || *s == '\t'))
+      s++;
+    if (s < e && *s != '#') {
+      uint32_t a, b;
+      if (parse_id(s, e, a) && s < e && (*s == ' ' || *s == '\t') &&
+	  parse_id(s, e, b) && (s == e || *s == ' ' || *s == '\t')) {
+	const LinkModel &m = _scorer.model();
+	uint32_t sa, sb;
+	if (m.lookup(a, sa) && m.lookup(b, sb)) {
+	  _out.put_uint(a).put('\t').put_uint(b).put('\t');
+	  _out.put_fixed(m.link_prob(sa, sb), 9).put('\n');
+	  _npairs++;
+	} else
+	  _nunknown++;
+      } else
+	_nbad++;
+    }
+    p = eol + 1;
+  }
+  return 0;
+}
+
+int
+PairScorer::score(string infname, string outfname)
+{
+  FILE *inf = fopen(infname.c_str(), "r");
+  if (!inf) {
+    fprintf(stderr, "cannot open %s: %s\n", infname.c_str(), strerror(errno));
+    return -1;
+  }
+  OutFile outf;
+  if (outf.open(outfname) < 0) {
+    fclose(inf);
+    return -1;
+  }
+
+  vector<char> buf(CHUNK_SIZE + 1);
+  uint32_t carry = 0;
+  uint64_t npairs = 0, nunknown = 0, nbad = 0;
+  for (;;) {
+    size_t r = fread(&buf[carry], 1, CHUNK_SIZE - carry, inf);
+    size_t len = carry + r;
+    if (len == 0)
+      break;
+    // the last line may have no newline; the buffer has room for one,
+    // so every line the threads parse ends in the chunk
+    if (r == 0 && buf[len - 1] != '\n')
+      buf[len++] = '\n';
+
+    // score whole lines only; the tail is carried into the next chunk
+    size_t end = len;
+    if (r > 0) {
+      while (end > 0 && buf[end - 1] != '\n')
+	end--;
+      if (end == 0) {
+	if (len == CHUNK_SIZE) {
+	  fprintf(stderr, "line too long in %s\n", infname.c_str());
+	  fclose(inf);
+	  return -1;
+	}
+	carry = len;
+	continue;
+      }
+    }
+
+    // split at line boundaries, one range per thread
+    const char *base = &buf[0];
+    vector<ScoreThread *> threads;
+    size_t b = 0;
+    for (uint32_t i = 0; i < _nthreads && b < end; ++i) {
+      size_t e = (i == _nthreads - 1) ? end : end * (i + 1) / _nthreads;
+      while (e < end && (e == 0 || base[e - 1] != '\n'))
+	e++;
+      if (e <= b)
+	continue;
+      threads.push_back(new ScoreThread(*this, base + b, base + e));
+      b = e;
+    }
+    if (threads.size() == 1)
+      threads[0]->do_work();
+    else
+      for (uint32_t i = 0; i < threads.size(); ++i)
+	threads[i]->create();
+    for (uint32_t i = 0; i < threads.size(); ++i) {
+      if (threads.size() > 1)
+	threads[i]->join();
+      outf.put(threads[i]->out());
+      npairs += threads[i]->npairs();
+      nunknown += threads[i]->nunknown();
+      nbad += threads[i]->nbad();
+      delete threads[i];
+    }
+
+    carry = len - end;
+    memmove(&buf[0], &buf[end], carry);
+    if (r == 0)
+      break;
+  }
+  fclose(inf);
+  if (outf.close() < 0)
+    return -1;
+  fprintf(stdout, "+ scored %lu pairs, skipped %lu with unknown ids "
+	  "and %lu bad lines\n", (unsigned long)npairs,
+	  (unsigned long)nunknown, (unsigned long)nbad);
+  return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef SCORE_HH
+#define SCORE_HH
+
+#include <stdint.h>
+#include <string>
+#include "env.hh"
+#include "thread.hh"
+#include "linkmodel.hh"
+#include "outfile.hh"
+
+//
+// Scores (id, id) pairs with a model saved by GLMNetwork::save_model()
+// (-score): gamma.txt, deg.txt and mu.txt, or an up-to-date -npy
+// export, are read from the model directory, and neither the training
+// network nor the heldout sets are loaded. Pairs are read in large
+// chunks, and each chunk is split over -nthreads threads that parse,
+// score and format their lines.
+//
+class PairScorer {
+public:
+  PairScorer(string dir, uint32_t nthreads, bool globalmu);
+  ~PairScorer();
+
+  int load();
+  int score(string infname, string outfname);
+  const LinkModel &model() const { return *_model; }
+
+  static const uint32_t CHUNK_SIZE = 8 << 20;
+
+private:
+  string _dir;
+  uint32_t _nthreads;
+  bool _globalmu;
+  LinkModel *_model;
+};
+
+class ScoreThread : public Thread {
+public:
+  ScoreThread(const PairScorer &scorer, const char *begin, const char *end)
+    : _scorer(scorer), _begin(begin), _end(end),
+      _npairs(0), _nunknown(0), _nbad(0) { }
+  ~ScoreThread() { }
+
+  int do_work();
+  const OutBuf &out() const { return _out; }
+  uint64_t npairs() const { return _npairs; }
+  uint64_t nunknown() const { return _nunknown; }
+  uint64_t nbad() const { return _nbad; }
+
+private:
+  const PairScorer &_scorer;
+  const char *_begin;
+  const char *_end;
+  OutBuf _out;
+  uint64_t _npairs;
+  uint64_t _nunknown;
+  uint64_t _nbad;
+};
+
+#endif
@@ -0,0 +1,309 @@
+#include "serve.hh"
+#include "sockio.hh"
+#include "log.hh"
+#include <signal.h>
+#include <sys/time.h>
+#include <algorithm>
+
+RecServer::RecServer(string dir, string path, uint32_t nthreads,
+		     bool globalmu, string exclude)
+  : _dir(dir), _path(path), _nthreads(nthreads), _globalmu(globalmu),
+    _exclude(exclude), _lfd(-1), _current(NULL), _generation(0), _nrequests(0)
+{
+  _latency.reserve(LATENCY_WINDOW);
+}
+
+RecServer::~RecServer()
+{
+  if (_lfd >= 0) {
+    close(_lfd);
+    unlink(_path.c_str());
+  }
+  delete _current;
+}
+
+int
+RecServer::run()
+{
+  if (reload() < 0)
+    return -1;
+
+  struct sockaddr_un addr;
+  if (sockaddr_set(addr, _path) < 0)
+    return -1;
+  unlink(_path.c_str());
+  _lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (_lfd < 0 ||
+      bind(_lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(_lfd, 128) < 0) {
+    fprintf(stderr, "cannot listen on %s: %s\n",
+	    _path.c_str(), strerror(errno));
+    return -1;
+  }
+  // a client that goes away must not take the server with it
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stdout, "+ serving %s on %s with %d workers\n",
+	  _dir.c_str(), _path.c_str(), _nthreads);
+  fflush(stdout);
+
+  vector<RecWorker *> workers(_nthreads);
+  for (uint32_t i = 0; i < _nthreads; ++i) {
+    workers[i] = new RecWorker(*this, _lfd);
+    workers[i]->create();
+  }
+  for (uint32_t i = 0; i < _nthreads; ++i) {
+    workers[i]->join();
+    delete workers[i];
+  }
+  return 0;
+}
+
+RecSnapshot *
+RecServer::acquire()
+{
+  _mutex.lock();
+  RecSnapshot *s = _current;
+  s->_refs++;
+  _mutex.unlock();
+  return s;
+}
+
+void
+RecServer::release(RecSnapshot *s)
+{
+  _mutex.lock();
+  s->_refs--;
+  bool retired = (s != _current && s->_refs == 0);
+  _mutex.unlock();
+  if (retired)
+    delete s;
+}
+
+//
+// Loads the model files into a new snapshot; the old snapshot is
+// freed by whichever request releases it last.
+//
+int
+RecServer::reload()
+{
+  _reload_mutex.lock();
+  struct timeval start, end, d;
+  gettimeofday(&start, NULL);
+  LinkModel *m = LinkModel::load(_dir, _globalmu);
+  if (!m) {
+    _reload_mutex.unlock();
+    return -1;
+  }
+  RecSnapshot *s = new RecSnapshot(m, _generation + 1);
+  if (_exclude != "" && s->exclude(_exclude) < 0) {
+    delete s;
+    _reload_mutex.unlock();
+    return -1;
+  }
+  gettimeofday(&end, NULL);
+  timeval_subtract(&d, &end, &start);
+
+  _mutex.lock();
+  RecSnapshot *old = _current;
+  _current = s;
+  _generation = s->generation();
+  bool retired = (old && old->_refs == 0);
+  _mutex.unlock();
+  if (retired)
+    delete old;
+
+  fprintf(stdout, "+ loaded model %d: n = %d, K = %d in %.3f s\n",
+	  s->generation(), m->n(), m->k(), d.tv_sec + d.tv_usec / 1e6);
+  fflush(stdout);
+  _reload_mutex.unlock();
+  return 0;
+}
+
+//
+// Reads the pairs not to recommend, one "id id" line each, as in a
+// network file; each node is excluded from the other's lists. Pairs
+// with an id the model does not know are ignored.
+//
+int
+RecSnapshot::exclude(string fname)
+{
+  FILE *f = fopen(fname.c_str(), "r");
+  if (!f) {
+    fprintf(stderr, "cannot open %s: %s\n", fname.c_str(), strerror(errno));
+    return -1;
+  }
+  vector<Edge> pairs;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    uint32_t a, b, p, q;
+    if (line[0] == '#' || sscanf(line, "%u %u", &a, &b) != 2)
+      continue;
+    if (!_model->lookup(a, p) || !_model->lookup(b, q) || p == q)
+      continue;
+    pairs.push_back(Edge(p, q));
+    pairs.push_back(Edge(q, p));
+  }
+  fclose(f);
+  std::sort(pairs.begin(), pairs.end());
+  pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+  uint32_t n = _model->n();
+  _start.assign(n + 1, 0);
+  _excluded.resize(pairs.size());
+  for (uint32_t i = 0; i < pairs.size(); ++i) {
+    _start[pairs[i].first + 1]++;
+    _excluded[i] = pairs[i].second;
+  }
+  for (uint32_t p = 0; p < n; ++p)
+    _start[p + 1] += _start[p];
+  fprintf(stdout, "+ excluding %ld pairs read from %s\n",
+	  pairs.size() / 2, fname.c_str());
+  return 0;
+}
+
+void
+RecServer::record(double us)
+{
+  _mutex.lock();
+  if (_latency.size() < LATENCY_WINDOW)
+    _latency.push_back(us);
+  else
+    _latency[_nrequests % LATENCY_WINDOW] = us;
+  _nrequests++;
+  _mutex.unlock();
+}
+
+void
+RecServer::stats(RecStats &s)
+{
+  _mutex.lock();
+  vector<double> v(_latency);
+  s.requests = _nrequests;
+  _mutex.unlock();
+
+  s.p50 = s.p90 = s.p99 = s.p999 = s.max = .0;
+  if (v.size() == 0)
+    return;
+  std::sort(v.begin(), v.end());
+  uint32_t n = v.size();
+  s.p50 = v[(uint32_t)(0.5 * (n - 1))];
+  s.p90 = v[(uint32_t)(0.9 * (n - 1))];
+  s.p99 = v[(uint32_t)(0.99 * (n - 1))];
+  s.p999 = v[(uint32_t)(0.999 * (n - 1))];
+  s.max = v[n - 1];
+}
+
+int
+RecWorker::do_work()
+{
+  for (;;) {
+    int fd = accept(_lfd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+	continue;
+      lerr("accept failed: %s", strerror(errno));
+      return -1;
+    }
+    serve(fd);
+    close(fd);
+  }
+  return 0;
+}
+
+int
+RecWorker::topn(const RecSnapshot &s, uint32_t p, uint32_t n,
+		vector<RecItem> &items)
+{
+  const LinkModel &m = s.model();
+  if (_seen.size() != m.n()) {
+    _seen.assign(m.n(), 0);
+    _epoch = 0;
+  }
+  if (++_epoch == 0) {
+    std::fill(_seen.begin(), _seen.end(), 0);
+    _epoch = 1;
+  }
+
+  TopN top(n);
+  s.index().top(p, top, _seen, _epoch, s.candidates(p));
+  vector<KV> v;
+  top.sorted(v);
+  items.resize(v.size());
+  for (uint32_t i = 0; i < v.size(); ++i) {
+    items[i].id = m.id(v[i].first);
+    items[i].pad = 0;
+    items[i].score = v[i].second;
+  }
+  return 0;
+}
+
+void
+RecWorker::serve(int fd)
+{
+  RecRequest req;
+  vector<RecItem> items;
+  while (readn(fd, &req, sizeof(req)) == 0) {
+    struct timeval start, end, d;
+    gettimeofday(&start, NULL);
+
+    RecReply r(RecReply::OK, req.tag, 0);
+    items.clear();
+    RecStats st;
+    bool with_stats = false;
+
+    switch (req.op) {
+    case RecRequest::TOPN:
+    case RecRequest::SCORE: {
+      RecSnapshot *s = _server.acquire();
+      const LinkModel &m = s->model();
+      uint32_t p, q;
+      r.generation = s->generation();
+      if (!m.lookup(req.a, p))
+	r.status = RecReply::UNKNOWN_ID;
+      else if (req.op == RecRequest::TOPN) {
+	if (req.b == 0 || req.b > RecServer::MAX_TOPN)
+	  r.status = RecReply::BAD_REQUEST;
+	else
+	  topn(*s, p, req.b, items);
+      } else if (!m.lookup(req.b, q))
+	r.status = RecReply::UNKNOWN_ID;
+      else {
+	RecItem it;
+	it.id = req.b;
+	it.pad = 0;
+	it.score = m.link_prob(p, q);
+	items.push_back(it);
+      }
+      _server.release(s);
+      break;
+    }
+    case RecRequest::STATS:
+      _server.stats(st);
+      with_stats = true;
+      break;
+    case RecRequest::RELOAD:
+      if (_server.reload() < 0)
+	r.status = RecReply::RELOAD_FAILED;
+      break;
+    default:
+      r.status = RecReply::BAD_REQUEST;
+    }
+
+    r.count = with_stats ? 1 : items.size();
+    if (r.generation == 0) {
+      RecSnapshot *s = _server.acquire();
+      r.generation = s->generation();
+      _server.release(s);
+    }
+    if (writen(fd, &r, sizeof(r)) < 0 ||
+	(with_stats && writen(fd, &st, sizeof(st)) < 0) ||
+	(items.size() > 0 &&
+	 writen(fd, &items[0], items.size() * sizeof(RecItem)) < 0))
+      return;
+
+    gettimeofday(&end, NULL);
+    timeval_subtract(&d, &end, &start);
+    if (req.op == RecRequest::TOPN || req.op == RecRequest::SCORE)
+      _server.record(d.tv_sec * 1e6 + d.tv_usec);
+  }
+}
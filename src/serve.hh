@@ -0,0 +1,179 @@
+#ifndef SERVE_HH
+#define SERVE_HH
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "env.hh"
+#include "thread.hh"
+#include "linkmodel.hh"
+
+//
+// Resident recommendation server (-serve <socket>).
+//
+// The model in -dir (gamma.txt, deg.txt, mu.txt, or the -npy export
+// when it is there and up to date) is loaded once and indexed with a LinkIndex;
+// -nthreads workers then accept connections on a Unix domain socket
+// and answer fixed-size binary requests until the client hangs up.
+// RELOAD loads the files again into a new snapshot and swaps it in;
+// requests already running keep the old snapshot until they finish,
+// so no request is dropped.
+//
+// TOPN ranks every node but the query itself, so nodes the query is
+// already linked to are returned too. With -serve-exclude <pairs>,
+// the pairs in that file (the training network file, say) are left
+// out of each other's lists, as write_ranking_file() leaves out
+// training links; the file is read again on RELOAD.
+//
+// All fields are in host byte order.
+//
+//   request: RecRequest
+//   reply:   RecReply, then count RecItems (TOPN, SCORE) or one
+//            RecStats (STATS)
+//
+class RecRequest {
+public:
+  typedef enum { TOPN = 1, SCORE, STATS, RELOAD } Op;
+
+  uint32_t op;
+  uint32_t tag;   // echoed in the reply
+  uint32_t a;     // TOPN: node id; SCORE: first node id
+  uint32_t b;     // TOPN: N; SCORE: second node id
+};
+
+class RecReply {
+public:
+  typedef enum { OK = 0, UNKNOWN_ID, BAD_REQUEST, RELOAD_FAILED } Status;
+
+  RecReply(uint32_t s, uint32_t t, uint32_t c)
+    : status(s), tag(t), count(c), generation(0) { }
+
+  uint32_t status;
+  uint32_t tag;
+  uint32_t count;
+  uint32_t generation; // model snapshot that answered
+};
+
+class RecItem {
+public:
+  uint32_t id;
+  uint32_t pad;
+  double score;
+};
+
+// request latencies in microseconds, over the last LATENCY_WINDOW
+// requests
+class RecStats {
+public:
+  uint64_t requests;
+  double p50;
+  double p90;
+  double p99;
+  double p999;
+  double max;
+};
+
+// any node other than the query and the nodes excluded for it
+class ExcludedCandidate {
+public:
+  ExcludedCandidate(uint32_t p, const uint32_t *begin, const uint32_t *end)
+    : _p(p), _begin(begin), _end(end) { }
+  bool rank_candidate(uint32_t q) const
+  { return q != _p && !std::binary_search(_begin, _end, q); }
+
+private:
+  uint32_t _p;
+  const uint32_t *_begin;
+  const uint32_t *_end;
+};
+
+class RecSnapshot {
+public:
+  RecSnapshot(LinkModel *model, uint32_t generation)
+    : _model(model), _index(model->params()), _generation(generation), _refs(0)
+  { _index.build(); }
+  ~RecSnapshot() { delete _model; }
+
+  int exclude(string fname);
+  ExcludedCandidate candidates(uint32_t p) const;
+
+  const LinkModel &model() const { return *_model; }
+  const LinkIndex &index() const { return _index; }
+  uint32_t generation() const { return _generation; }
+
+private:
+  LinkModel *_model;
+  LinkIndex _index;
+  uint32_t _generation;
+  uint32_t _refs;
+  // excluded nodes of node p: _excluded[_start[p].._start[p+1]), sorted
+  vector<uint32_t> _start;
+  vector<uint32_t> _excluded;
+  friend class RecServer;
+};
+
+inline ExcludedCandidate
+RecSnapshot::candidates(uint32_t p) const
+{
+  if (_start.empty())
+    return ExcludedCandidate(p, NULL, NULL);
+  const uint32_t *e = _excluded.empty() ? NULL : &_excluded[0];
+  return ExcludedCandidate(p, e + _start[p], e + _start[p + 1]);
+}
+
+class RecServer {
+public:
+  RecServer(string dir, string path, uint32_t nthreads, bool globalmu,
+	    string exclude = "");
+  ~RecServer();
+
+  int run();
+
+  static const uint32_t MAX_TOPN = 10000;
+  static const uint32_t LATENCY_WINDOW = 1 << 16;
+
+private:
+  RecSnapshot *acquire();
+  void release(RecSnapshot *s);
+  int reload();
+  void record(double us);
+  void stats(RecStats &s);
+
+  string _dir;
+  string _path;
+  uint32_t _nthreads;
+  bool _globalmu;
+  string _exclude;
+  int _lfd;
+
+  Mutex _mutex;         // guards _current, snapshot refs and latencies
+  Mutex _reload_mutex;  // one reload at a time
+  RecSnapshot *_current;
+  uint32_t _generation;
+
+  vector<double> _latency;
+  uint64_t _nrequests;
+  friend class RecWorker;
+};
+
+class RecWorker : public Thread {
+public:
+  RecWorker(RecServer &server, int lfd)
+    : _server(server), _lfd(lfd), _epoch(0) { }
+  ~RecWorker() { }
+
+  int do_work();
+
+private:
+  void serve(int fd);
+  int topn(const RecSnapshot &s, uint32_t p, uint32_t n,
+	   vector<RecItem> &items);
+
+  RecServer &_server;
+  int _lfd;
+  vector<uint32_t> _seen;
+  uint32_t _epoch;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef SOCKIO_HH
+#define SOCKIO_HH
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+
+// blocking socket I/O shared by the parameter server and -serve
+
+inline int
+readn(int fd, void *buf, size_t n)
+{
+  char *p = (char *)buf;
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+inline int
+writen(int fd, const void *buf, size_t n)
+{
+  const char *p = (const char *)buf;
+  while (n > 0) {
+    ssize_t r = write(fd, p, n);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+inline int
+sockaddr_set(struct sockaddr_un &addr, std::string path)
+{
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", path.c_str());
+    return -1;
+  }
+  strcpy(addr.sun_path, path.c_str());
+  return 0;
+}
+
+#endif
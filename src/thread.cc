@@ -0,0 +1,54 @@
+#include "thread.hh"
+#include "affinity.hh"
+
+pthread_mutex_t Thread::_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+Thread::Thread()
+  : _done(false), _node(-1), _tid(0)
+{
+  pthread_attr_init(&_attr);
+  pthread_attr_setdetachstate(&_attr, PTHREAD_CREATE_JOINABLE);
+}
+
+Thread::~Thread()
+{
+  pthread_attr_destroy(&_attr);
+}
+
+int
+Thread::create()
+{
+  _done = false;
+  int r = pthread_create(&_tid, &_attr, Thread::run, (void *)this);
+  if (r != 0)
+    fprintf(stderr, "error creating thread: %d\n", r);
+  return r;
+}
+
+int
+Thread::join()
+{
+  void *status;
+  return pthread_join(_tid, &status);
+}
+
+void *
+Thread::run(void *arg)
+{
+  Thread *t = (Thread *)arg;
+  if (t->_node >= 0)
+    NUMA::run_on_node(t->_node);
+  t->do_work();
+  t->_done = true;
+  return NULL;
+}
+
+void
+Thread::static_initialize()
+{
+}
+
+void
+Thread::static_uninitialize()
+{
+}
@@ -17,6 +17,7 @@ public:
   int create();
   int join();
   pthread_t id() const { return _tid; }
+  void set_node(int node) { _node = node; }
 
   virtual int do_work() { return 0; }
   
@@ -27,6 +28,7 @@ protected:
   static void *run(void *);
   
   bool _done;
+  int _node; // NUMA node to run on, or -1
   pthread_t _tid;
   pthread_attr_t _attr;
   static pthread_mutex_t _file_mutex;